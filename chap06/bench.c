@@ -0,0 +1,625 @@
+/* bench.c */
+
+#include "chap06.h"
+#include "http_builder.h"
+#include "http_client.h"
+#include "scan.h"
+
+#if !defined(__linux__)
+#error "bench is built on epoll, which is Linux only"
+#endif
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// Upper bound of readiness events harvested per epoll_wait() call
+#define MAX_EVENTS 256
+// Most paths in the request mix
+#define MAX_PATHS 64
+// Longest request sent, headers included
+#define REQUEST_SIZE 1024
+// Longest response headers accepted
+#define HEADER_SIZE 8192
+// Bytes read from a socket at once
+#define RECEIVE_SIZE 65536
+
+// Latencies are recorded in microseconds with 3 significant digits, in the
+// manner of HdrHistogram: values below SUB_BUCKET_COUNT are counted one by
+// one, then each power of two is split into SUB_BUCKET_HALF equal steps.
+#define SUB_BUCKET_BITS 11
+#define SUB_BUCKET_COUNT (1 << SUB_BUCKET_BITS)
+#define SUB_BUCKET_HALF (SUB_BUCKET_COUNT / 2)
+// Longest latency told apart from longer ones, a bit over an hour
+#define MAX_LATENCY 0xffffffffULL
+#define HISTOGRAM_SIZE ((32 - SUB_BUCKET_BITS + 2) * SUB_BUCKET_HALF)
+
+// A request of the mix, formatted once
+typedef struct request_text {
+  char text[REQUEST_SIZE];
+  int length;
+} request_text;
+
+// Latency histogram
+typedef struct histogram {
+  uint64_t counts[HISTOGRAM_SIZE];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+} histogram;
+
+enum connection_state {
+  CONNECTION_CLOSED,     // To be connected on the next pass
+  CONNECTION_CONNECTING, // connect() in progress
+  CONNECTION_SENDING,    // Request being sent
+  CONNECTION_RECEIVING   // Response being received
+};
+
+// A connection to the server, with the request it has in flight
+typedef struct connection {
+  SOCKET socket;
+  enum connection_state state;
+  const request_text *request;
+  int sent;            // Bytes of the request sent
+  uint64_t start;      // When the request was started, in microseconds
+  char header[HEADER_SIZE];
+  int header_length;   // Bytes of header received
+  int scanned;         // Bytes of header searched for the blank line
+  int headers_done;    // Whether the blank line was found
+  long long body_left; // Bytes of body still to receive
+  int until_close;     // Whether the body runs until the server closes
+  int status;          // Status code of the response
+  int server_closes;   // Whether the server closes the connection after it
+  uint64_t received;   // Bytes of response received
+} connection;
+
+// A thread driving its share of the connections through its own epoll
+// instance. Nothing is shared between workers until they are joined.
+typedef struct worker {
+  pthread_t thread;
+  int epoll_fd;
+  connection *connections;
+  int connection_count;
+  int next_request; // Next request of the mix to send
+  char buffer[RECEIVE_SIZE];
+  histogram *latency;
+  // Results
+  uint64_t requests;
+  uint64_t bytes;
+  uint64_t statuses[6]; // Responses by status class, 1xx to 5xx
+  uint64_t connect_errors;
+  uint64_t read_errors;
+  uint64_t write_errors;
+} worker;
+
+// Settings, read by the workers once set up
+static struct addrinfo *peer_address = NULL;
+static request_text requests[MAX_PATHS];
+static int request_count = 0;
+static int close_connections = 0;
+static uint64_t deadline = 0;
+
+void *run_worker(void *argument);
+uint64_t now_us(void);
+void open_connection(worker *w, connection *c);
+void close_connection(worker *w, connection *c);
+void start_request(worker *w, connection *c);
+void drive_connection(worker *w, connection *c);
+int receive_response(worker *w, connection *c, const char *data, int length);
+void finish_request(worker *w, connection *c);
+void format_request(request_text *request, const char *hostname,
+                    const char *port, const char *path);
+int histogram_index(uint64_t value);
+uint64_t histogram_value(int index);
+void histogram_record(histogram *h, uint64_t value);
+void histogram_merge(histogram *into, const histogram *from);
+uint64_t histogram_percentile(const histogram *h, double percentile);
+
+/**
+ * @brief Load an HTTP server and report its throughput and latency.
+ *
+ * Each of --threads N threads keeps its share of --connections N connections
+ * busy for --duration SECONDS, sending the next request as soon as a response
+ * is complete. Connections are kept alive unless --close is given, in which
+ * case each request opens its own and its latency includes the handshake.
+ * The requests go in turn to the path of the URL and to the PATHs that
+ * follow it: a path given twice gets twice the requests.
+ *
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on error.
+ */
+int main(int argc, char *argv[]) {
+  int threads = 2;
+  int connections = 16;
+  int duration = 10;
+  int first_path = 0;
+  for (int i = 1; i < argc && !first_path && threads > 0; ++i) {
+    if (strcmp(argv[i], "--close") == 0)
+      close_connections = 1;
+    else if (strncmp(argv[i], "--", 2) != 0)
+      first_path = i;
+    else if (i + 1 == argc)
+      threads = 0;
+    else if (strcmp(argv[i], "--threads") == 0)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--connections") == 0)
+      connections = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--duration") == 0)
+      duration = atoi(argv[++i]);
+    else
+      threads = 0;
+  }
+  if (!first_path || threads < 1 || connections < threads || duration < 1 ||
+      argc - first_path > MAX_PATHS) {
+    fprintf(stderr, "usage: bench [--threads N] [--connections N] "
+                    "[--duration SECONDS] [--close] URL [PATH...]\n");
+    return EXIT_FAILURE;
+  }
+
+  char *hostname, *port, *path;
+  parse_url(argv[first_path], &hostname, &port, &path);
+  peer_address = resolve_host(hostname, port);
+  format_request(&requests[request_count++], hostname, port, path);
+  for (int i = first_path + 1; i < argc; ++i)
+    format_request(&requests[request_count++], hostname, port,
+                   argv[i][0] == '/' ? argv[i] + 1 : argv[i]);
+
+  printf("\nRunning %d s test with %d threads and %d connections, %s, "
+         "%d path(s)\n",
+         duration, threads, connections,
+         close_connections ? "one per request" : "kept alive", request_count);
+
+  worker *workers = (worker *)calloc(threads, sizeof(worker));
+  connection *slots = (connection *)calloc(connections, sizeof(connection));
+  if (!workers || !slots) {
+    fprintf(stderr, "Out of memory.\n");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t start = now_us();
+  deadline = start + (uint64_t)duration * 1000000;
+  for (int i = 0; i < threads; ++i) {
+    worker *w = &workers[i];
+    // The remainder of the connections goes to the first workers
+    int share = connections / threads + (i < connections % threads);
+    w->connections = slots;
+    w->connection_count = share;
+    w->next_request = i % request_count;
+    slots += share;
+    w->latency = (histogram *)calloc(1, sizeof(histogram));
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!w->latency || w->epoll_fd < 0) {
+      fprintf(stderr, "epoll_create1() failed. (%d)\n", errno);
+      return EXIT_FAILURE;
+    }
+    int error = pthread_create(&w->thread, NULL, run_worker, w);
+    if (error) {
+      fprintf(stderr, "pthread_create() failed. (%d)\n", error);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Add everything up in the first worker
+  worker *total = &workers[0];
+  pthread_join(total->thread, NULL);
+  for (int i = 1; i < threads; ++i) {
+    worker *w = &workers[i];
+    pthread_join(w->thread, NULL);
+    histogram_merge(total->latency, w->latency);
+    total->requests += w->requests;
+    total->bytes += w->bytes;
+    for (int j = 0; j < 6; ++j)
+      total->statuses[j] += w->statuses[j];
+    total->connect_errors += w->connect_errors;
+    total->read_errors += w->read_errors;
+    total->write_errors += w->write_errors;
+  }
+  double elapsed = (now_us() - start) / 1e6;
+
+  const histogram *latency = total->latency;
+  printf("  Requests:   %llu in %.2f s, %.1f per second\n",
+         (unsigned long long)total->requests, elapsed,
+         total->requests / elapsed);
+  printf("  Transfer:   %.1f MB, %.1f MB per second\n", total->bytes / 1e6,
+         total->bytes / 1e6 / elapsed);
+  printf("  Responses:  2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu\n",
+         (unsigned long long)total->statuses[2],
+         (unsigned long long)total->statuses[3],
+         (unsigned long long)total->statuses[4],
+         (unsigned long long)total->statuses[5]);
+  printf("  Errors:     connect %llu, read %llu, write %llu\n",
+         (unsigned long long)total->connect_errors,
+         (unsigned long long)total->read_errors,
+         (unsigned long long)total->write_errors);
+  if (latency->total) {
+    printf("  Latency:    min %llu us, mean %.1f us, max %llu us\n",
+           (unsigned long long)latency->min, latency->sum / latency->total,
+           (unsigned long long)latency->max);
+    printf("              p50 %llu us, p90 %llu us, p99 %llu us, "
+           "p99.9 %llu us\n",
+           (unsigned long long)histogram_percentile(latency, 50),
+           (unsigned long long)histogram_percentile(latency, 90),
+           (unsigned long long)histogram_percentile(latency, 99),
+           (unsigned long long)histogram_percentile(latency, 99.9));
+  }
+
+  freeaddrinfo(peer_address);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Keep the connections of a worker busy until the deadline.
+ *
+ * Sockets are registered edge-triggered for both directions once, when they
+ * are connected, and each wakeup drives its connection as far as it goes.
+ * Requests still in flight at the deadline are not counted.
+ *
+ * @param argument The worker.
+ * @return NULL.
+ */
+void *run_worker(void *argument) {
+  worker *w = (worker *)argument;
+  for (int i = 0; i < w->connection_count; ++i) {
+    w->connections[i].socket = -1;
+    open_connection(w, &w->connections[i]);
+  }
+
+  uint64_t now;
+  while ((now = now_us()) < deadline) {
+    // Connections that failed are retried once in a while
+    int closed = 0;
+    for (int i = 0; i < w->connection_count; ++i)
+      if (w->connections[i].state == CONNECTION_CLOSED)
+        closed = 1;
+    int timeout = (int)((deadline - now + 999) / 1000);
+    if (closed && timeout > 10)
+      timeout = 10;
+
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+    if (ready < 0 && errno != EINTR) {
+      fprintf(stderr, "epoll_wait() failed. (%d)\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ready; ++i)
+      drive_connection(w, (connection *)events[i].data.ptr);
+
+    for (int i = 0; closed && i < w->connection_count; ++i)
+      if (w->connections[i].state == CONNECTION_CLOSED)
+        open_connection(w, &w->connections[i]);
+  }
+
+  for (int i = 0; i < w->connection_count; ++i)
+    if (ISVALIDSOCKET(w->connections[i].socket))
+      CLOSESOCKET(w->connections[i].socket);
+  return NULL;
+}
+
+/**
+ * @brief Read the monotonic clock.
+ *
+ * @return The time in microseconds.
+ */
+uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Start connecting a connection to the server.
+ *
+ * The request is started along with the connection, so that the latency of
+ * a request on a connection of its own includes the handshake. A connection
+ * that cannot even be started is counted as an error and left closed.
+ *
+ * @param w The worker of the connection.
+ * @param c The connection, closed.
+ */
+void open_connection(worker *w, connection *c) {
+  c->state = CONNECTION_CLOSED;
+  c->socket = socket(peer_address->ai_family,
+                     peer_address->ai_socktype | SOCK_NONBLOCK,
+                     peer_address->ai_protocol);
+  if (!ISVALIDSOCKET(c->socket)) {
+    w->connect_errors++;
+    return;
+  }
+  int yes = 1;
+  setsockopt(c->socket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = c;
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->socket, &event) < 0 ||
+      (connect(c->socket, peer_address->ai_addr, peer_address->ai_addrlen) &&
+       errno != EINPROGRESS)) {
+    w->connect_errors++;
+    close_connection(w, c);
+    return;
+  }
+  start_request(w, c);
+  c->state = CONNECTION_CONNECTING;
+}
+
+/**
+ * @brief Close a connection, to be opened again on the next pass.
+ *
+ * @param w The worker of the connection.
+ * @param c The connection.
+ */
+void close_connection(worker *w, connection *c) {
+  (void)w; // Closing the socket takes it out of the epoll instance
+  CLOSESOCKET(c->socket);
+  c->socket = -1;
+  c->state = CONNECTION_CLOSED;
+}
+
+/**
+ * @brief Pick the next request of the mix for a connection.
+ *
+ * @param w The worker of the connection.
+ * @param c The connection, ready to send.
+ */
+void start_request(worker *w, connection *c) {
+  c->request = &requests[w->next_request];
+  w->next_request = (w->next_request + 1) % request_count;
+  c->sent = 0;
+  c->start = now_us();
+  c->header_length = 0;
+  c->scanned = 0;
+  c->headers_done = 0;
+  c->received = 0;
+  c->state = CONNECTION_SENDING;
+}
+
+/**
+ * @brief Move a connection on after its socket was reported ready.
+ *
+ * The connection goes as far as it can without blocking: it finishes
+ * connecting, sends its request, receives its response, and goes on with the
+ * next request, until the socket would block.
+ *
+ * @param w The worker of the connection.
+ * @param c The connection.
+ */
+void drive_connection(worker *w, connection *c) {
+  while (1) {
+    if (c->state == CONNECTION_CLOSED)
+      return;
+
+    if (c->state == CONNECTION_CONNECTING) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(c->socket, SOL_SOCKET, SO_ERROR, &error, &length);
+      if (error) {
+        w->connect_errors++;
+        close_connection(w, c);
+        return;
+      }
+      c->state = CONNECTION_SENDING;
+    }
+
+    if (c->state == CONNECTION_SENDING) {
+      ssize_t sent = send(c->socket, c->request->text + c->sent,
+                          c->request->length - c->sent, MSG_NOSIGNAL);
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return; // Still connecting, or send buffer full
+      if (sent < 0) {
+        w->write_errors++;
+        close_connection(w, c);
+        return;
+      }
+      c->sent += sent;
+      if (c->sent < c->request->length)
+        continue;
+      c->state = CONNECTION_RECEIVING;
+    }
+
+    ssize_t received = recv(c->socket, w->buffer, RECEIVE_SIZE, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return; // Drained: wait for the next edge
+    if (received < 0 ||
+        (received == 0 && (!c->headers_done || !c->until_close))) {
+      w->read_errors++;
+      close_connection(w, c);
+      return;
+    }
+    if (received == 0 || receive_response(w, c, w->buffer, received))
+      finish_request(w, c);
+  }
+}
+
+/**
+ * @brief Account for bytes of a response.
+ *
+ * The headers are gathered until the blank line that ends them, then the
+ * status code, the Content-Length and the Connection header are read from
+ * them. Without a Content-Length, the body runs until the server closes the
+ * connection.
+ *
+ * @param w The worker of the connection.
+ * @param c The connection, receiving.
+ * @param data The bytes received.
+ * @param length The number of bytes received.
+ * @return 1 if the response is complete, 0 if more is expected.
+ */
+int receive_response(worker *w, connection *c, const char *data, int length) {
+  c->received += length;
+  if (c->headers_done) {
+    c->body_left -= length;
+    return !c->until_close && c->body_left <= 0;
+  }
+
+  int copied = HEADER_SIZE - c->header_length;
+  if (copied > length)
+    copied = length;
+  memcpy(c->header + c->header_length, data, copied);
+  c->header_length += copied;
+
+  // The blank line may straddle this read and the previous one
+  const char *end = c->header + c->header_length;
+  const char *blank = scan_find(c->header + c->scanned, end, "\r\n\r\n", 4);
+  if (blank == end) {
+    if (c->header_length == HEADER_SIZE) {
+      w->read_errors++;
+      close_connection(w, c);
+      return 0;
+    }
+    c->scanned = c->header_length > 3 ? c->header_length - 3 : 0;
+    return 0;
+  }
+
+  c->headers_done = 1;
+  c->status = c->header_length > 12 ? atoi(c->header + 9) : 0;
+  const char *content_length =
+      scan_find(c->header, blank, "\nContent-Length:", 16);
+  c->until_close = content_length == blank;
+  c->body_left = c->until_close ? 0 : strtoll(content_length + 16, NULL, 10);
+  c->server_closes =
+      scan_find(c->header, blank, "\nConnection: close", 18) != blank;
+
+  // Whatever follows the blank line is body
+  c->body_left -= (end - (blank + 4)) + (length - copied);
+  return !c->until_close && c->body_left <= 0;
+}
+
+/**
+ * @brief Record a completed request and start the next one.
+ *
+ * The connection is reused unless either side closes it after the response.
+ *
+ * @param w The worker of the connection.
+ * @param c The connection, whose response is complete.
+ */
+void finish_request(worker *w, connection *c) {
+  uint64_t now = now_us();
+  histogram_record(w->latency, now - c->start);
+  w->requests++;
+  w->bytes += c->received;
+  if (c->status >= 100 && c->status < 600)
+    w->statuses[c->status / 100]++;
+
+  if (now >= deadline)
+    close_connection(w, c);
+  else if (close_connections || c->server_closes || c->until_close) {
+    close_connection(w, c);
+    open_connection(w, c);
+  } else
+    start_request(w, c);
+}
+
+/**
+ * @brief Format a GET request of the mix.
+ *
+ * @param request Receives the request.
+ * @param hostname The host, for the Host header.
+ * @param port The port, for the Host header.
+ * @param path The path, without its leading '/'.
+ */
+void format_request(request_text *request, const char *hostname,
+                    const char *port, const char *path) {
+  http_builder builder;
+  http_builder_init(&builder, request->text, sizeof(request->text), NULL, 0);
+  http_builder_format(&builder, "GET /%s HTTP/1.1\r\n", path);
+  http_builder_format(&builder, "Host: %s:%s\r\n", hostname, port);
+  http_builder_header(&builder, "Connection",
+                      close_connections ? "close" : "keep-alive");
+  http_builder_header(&builder, "User-Agent", "honpwc bench 1.0");
+  http_builder_end(&builder);
+  if (builder.failed) {
+    fprintf(stderr, "Path too long: %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  request->length = (int)builder.length;
+}
+
+/**
+ * @brief Find the counter of a value in a histogram.
+ *
+ * @param value The value, at most MAX_LATENCY.
+ * @return The index of its counter.
+ */
+int histogram_index(uint64_t value) {
+  if (value < SUB_BUCKET_COUNT)
+    return (int)value;
+  int bucket = (63 - __builtin_clzll(value)) - (SUB_BUCKET_BITS - 1);
+  return bucket * SUB_BUCKET_HALF + (int)(value >> bucket);
+}
+
+/**
+ * @brief Return the highest value counted by a counter of a histogram.
+ *
+ * @param index The index of the counter.
+ * @return The value.
+ */
+uint64_t histogram_value(int index) {
+  if (index < SUB_BUCKET_COUNT)
+    return index;
+  int bucket = index / SUB_BUCKET_HALF - 1;
+  uint64_t sub_bucket = index - bucket * SUB_BUCKET_HALF;
+  return ((sub_bucket + 1) << bucket) - 1;
+}
+
+/**
+ * @brief Count a value in a histogram.
+ *
+ * @param h The histogram.
+ * @param value The value, clamped to MAX_LATENCY.
+ */
+void histogram_record(histogram *h, uint64_t value) {
+  if (value > MAX_LATENCY)
+    value = MAX_LATENCY;
+  h->counts[histogram_index(value)]++;
+  if (h->total == 0 || value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+  h->total++;
+  h->sum += value;
+}
+
+/**
+ * @brief Add the values counted by a histogram to another.
+ *
+ * @param into The histogram added to.
+ * @param from The histogram added.
+ */
+void histogram_merge(histogram *into, const histogram *from) {
+  if (from->total == 0)
+    return;
+  for (int i = 0; i < HISTOGRAM_SIZE; ++i)
+    into->counts[i] += from->counts[i];
+  if (into->total == 0 || from->min < into->min)
+    into->min = from->min;
+  if (from->max > into->max)
+    into->max = from->max;
+  into->total += from->total;
+  into->sum += from->sum;
+}
+
+/**
+ * @brief Return the value below which a percentage of the values fall.
+ *
+ * @param h The histogram, not empty.
+ * @param percentile The percentage, such as 99.9.
+ * @return The highest value counted along with the value at the percentile,
+ * which is at most 0.1% above it, and never above the largest value.
+ */
+uint64_t histogram_percentile(const histogram *h, double percentile) {
+  uint64_t rank = (uint64_t)(percentile / 100 * h->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_SIZE; ++i) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      uint64_t value = histogram_value(i);
+      return value < h->max ? value : h->max;
+    }
+  }
+  return h->max;
+}
@@ -0,0 +1,148 @@
+/* http_client.c */
+
+#include "http_client.h"
+
+/**
+ * @brief A function to parse a given URL.
+ *
+ * The function takes as input as URL, and it returns as output the hostname,
+ * the port number, and the document path. To avoid needing to do manual memory
+ * management, the outputs are returned as pointers to specific parts of the
+ * input URL. The input URL is modified by null-terminating specific positions.
+ *
+ * @param url The URL to parse.
+ * @param hostname A pointer to the start of the hostname.
+ * @param port A pointer to the start of the port number (or 0 if not
+ * specified).
+ * @param path A pointer to the start of the document path.
+ */
+void parse_url(char *url, char **hostname, char **port, char **path) {
+  // For debugging purposes, optionally printf the URL.
+  printf("%8s:\t%s\n", "URL", url);
+
+  // parse the protocol
+  char *scheme_separator = "://";
+  char *p;
+  p = strstr(url, scheme_separator);
+  char *protocol = 0;
+  if (p) {
+    protocol = url;
+    *p = 0;
+    p += strlen(scheme_separator);
+  } else {
+    p = url;
+  }
+
+  if (protocol) {
+    if (strcmp(protocol, "http")) {
+      fprintf(stderr, "Unknown protocol '%s'. Only 'http' is supported.\n",
+              protocol);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Return the hostname
+  *hostname = p;
+  while (*p && *p != ':' && *p != '/' && *p != '#')
+    ++p;
+
+  // If set return the port number or return 80
+  *port = "80";
+  if (*p == ':') {
+    *p++ = 0;
+    *port = p;
+  }
+  while (*p && *p != '/' && *p != '#')
+    ++p;
+
+  // Set the path variable: Since we must null-terminate after the hostname and
+  // port (if specified) by replacing ':' or '/' with '\0', unless we want to
+  // indulge in memory allocation, simplicity asks to skip it. All document
+  // paths start with '/', so the function caller can easily prepend that when
+  // the HTTP request is constructed.
+  *path = p;
+  if (*p == '/')
+    *path = p + 1;
+  *p++ = 0;
+
+  // Check for hash and ignore it since it is never sent to the web server
+  while (*p && *p != '#')
+    ++p;
+  if (*p == '#')
+    *p = 0;
+
+  // Print out returned values for debugging purposes
+  printf("%8s:\t%s\n", "Hostname", *hostname);
+  printf("%8s:\t%s\n", "Port", *port);
+  printf("%8s:\t%s\n\n", "Path", *path);
+}
+
+/**
+ * @brief A function to resolve the address of a remote host.
+ *
+ * The first address getaddrinfo() returns is used. If the host cannot be
+ * resolved, the program exits with an error message.
+ *
+ * @param hostname The hostname or IP address of the remote host.
+ * @param port The port number of the remote host.
+ * @return The address list, to be released with freeaddrinfo().
+ */
+struct addrinfo *resolve_host(char *hostname, char *port) {
+  // Configure remote address
+  printf("Configuring remote address...\n");
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *peer_address;
+  if (getaddrinfo(hostname, port, &hints, &peer_address)) {
+    fprintf(stderr, "getaddrinfo() failed. (%d)\n", GETSOCKETERRNO());
+    exit(EXIT_FAILURE);
+  }
+
+  // Print hostname resolution result for debugging purposes
+  printf("Remote address is: ");
+  char address_buffer[100];
+  char service_buffer[100];
+  getnameinfo(peer_address->ai_addr, peer_address->ai_addrlen, address_buffer,
+              sizeof(address_buffer), service_buffer, sizeof(service_buffer),
+              NI_NUMERICHOST);
+  printf("%s %s\n", address_buffer, service_buffer);
+
+  return peer_address;
+}
+
+/**
+ * @brief A function to connect to a remote host and return the socket.
+ *
+ * This function takes a hostname and port number and attempts to connect to
+ * the remote host using a TCP socket. If the connection is successful, the
+ * socket is returned; otherwise, the program exits with an error message.
+ *
+ * @param hostname The hostname or IP address of the remote host.
+ * @param port The port number of the remote host.
+ * @return The socket used to connect to the remote host.
+ */
+SOCKET connect_to_host(char *hostname, char *port) {
+  struct addrinfo *peer_address = resolve_host(hostname, port);
+
+  // Create a new socket to establish the TCP connection
+  printf("Creating socket...\n");
+  SOCKET server;
+  server = socket(peer_address->ai_family, peer_address->ai_socktype,
+                  peer_address->ai_protocol);
+  if (!ISVALIDSOCKET(server)) {
+    fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
+    exit(EXIT_FAILURE);
+  }
+
+  printf("Connecting...\n");
+  if (connect(server, peer_address->ai_addr, peer_address->ai_addrlen)) {
+    fprintf(stderr, "connect() failed. (%d)\n", GETSOCKETERRNO());
+    exit(EXIT_FAILURE);
+  }
+  freeaddrinfo(peer_address);
+
+  printf("Connected.\n\n");
+
+  return server;
+}
@@ -0,0 +1,12 @@
+/* http_client.h */
+
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+#include "chap06.h"
+
+void parse_url(char *url, char **hostname, char **port, char **path);
+struct addrinfo *resolve_host(char *hostname, char *port);
+SOCKET connect_to_host(char *hostname, char *port);
+
+#endif
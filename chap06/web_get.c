@@ -1,12 +1,13 @@
 /* web_get.c */
 
 #include "chap06.h"
+#include "http_builder.h"
+#include "http_client.h"
+#include "scan.h"
 
 #define TIMEOUT 5.0
 
-void parse_url(char *url, char **hostname, char **port, char **path);
 void send_request(SOCKET s, char *hostname, char *port, char *path);
-SOCKET connect_to_host(char *hostname, char *port);
 
 /**
  * @brief This function implement an HTTP web client.
@@ -66,6 +67,9 @@ int main(int argc, char *argv[]) {
   /* Dynamically tracks the changing position to read the response body, once
    * per chunk or length (each could need many packets to complete) */
   char *body = NULL;
+  /* Where the search for the end of the headers resumes after each packet:
+   * the bytes before it have been searched already. */
+  char *scanned = response;
   /* If you recall, the HTTP response body length can be determined by a few
    * different methods. We define an enumeration to list the method types, and
    * we define the "encoding" variable to store the actual method used. */
@@ -136,22 +140,35 @@ int main(int argc, char *argv[]) {
 
       // Search for the end of the HTTP headers or beginning of HTTP body
       char *headers_end = "\r\n\r\n";
-      if (!body && (meta = strstr(response, headers_end))) {
+      meta = NULL;
+      if (!body) {
+        meta = (char *)scan_find(scanned, pkt, headers_end, 4);
+        if (meta == pkt) {
+          // The blank line may straddle this packet and the next one
+          scanned = pkt - response > 3 ? pkt - 3 : response;
+          meta = NULL;
+        }
+      }
+      if (meta) {
+        char *headers_stop = meta;
         *meta = 0;
         body = meta + strlen(headers_end);
         printf("\nReceived Headers:\n%s\n", response);
 
         // Determine which body length method is used.
         char *content_length = "\nContent-Length:";
-        meta = strstr(response, content_length);
-        if (meta) {
+        meta = (char *)scan_find(response, headers_stop, content_length,
+                                 strlen(content_length));
+        if (meta != headers_stop) {
           encoding = length;
           meta += strlen(content_length);
           remaining = strtol(meta, 0, 10);
 
         } else {
-          meta = strstr(response, "\nTransfer-Encoding: chunked");
-          if (meta) {
+          char *chunked_encoding = "\nTransfer-Encoding: chunked";
+          meta = (char *)scan_find(response, headers_stop, chunked_encoding,
+                                   strlen(chunked_encoding));
+          if (meta != headers_stop) {
             encoding = chunked;
             remaining = 0;
           } else {
@@ -164,7 +181,7 @@ int main(int argc, char *argv[]) {
         }
         printf("\nReceived Body:\n");
 
-      } // if (!body && (body = strstr(response, "\r\n\r\n")))
+      } // if (meta)
 
       if (body) {
         if (encoding == length) {
@@ -176,7 +193,7 @@ int main(int argc, char *argv[]) {
         } else if (encoding == chunked) {
           do {
             if (remaining == 0) {
-              if ((meta = strstr(body, "\r\n"))) {
+              if ((meta = (char *)scan_find(body, pkt, "\r\n", 2)) != pkt) {
                 remaining = strtol(body, 0, 16);
                 if (!remaining)
                   goto finish;
@@ -211,135 +228,6 @@ finish:
   return EXIT_SUCCESS;
 }
 
-/**
- * @brief A function to parse a given URL.
- *
- * The function takes as input as URL, and it returns as output the hostname,
- * the port number, and the document path. To avoid needing to do manual memory
- * management, the outputs are returned as pointers to specific parts of the
- * input URL. The input URL is modified by null-terminating specific positions.
- *
- * @param url The URL to parse.
- * @param hostname A pointer to the start of the hostname.
- * @param port A pointer to the start of the port number (or 0 if not
- * specified).
- * @param path A pointer to the start of the document path.
- */
-void parse_url(char *url, char **hostname, char **port, char **path) {
-  // For debugging purposes, optionally printf the URL.
-  printf("%8s:\t%s\n", "URL", url);
-
-  // parse the protocol
-  char *scheme_separator = "://";
-  char *p;
-  p = strstr(url, scheme_separator);
-  char *protocol = 0;
-  if (p) {
-    protocol = url;
-    *p = 0;
-    p += strlen(scheme_separator);
-  } else {
-    p = url;
-  }
-
-  if (protocol) {
-    if (strcmp(protocol, "http")) {
-      fprintf(stderr, "Unknown protocol '%s'. Only 'http' is supported.\n",
-              protocol);
-      exit(EXIT_FAILURE);
-    }
-  }
-
-  // Return the hostname
-  *hostname = p;
-  while (*p && *p != ':' && *p != '/' && *p != '#')
-    ++p;
-
-  // If set return the port number or return 80
-  *port = "80";
-  if (*p == ':') {
-    *p++ = 0;
-    *port = p;
-  }
-  while (*p && *p != '/' && *p != '#')
-    ++p;
-
-  // Set the path variable: Since we must null-terminate after the hostname and
-  // port (if specified) by replacing ':' or '/' with '\0', unless we want to
-  // indulge in memory allocation, simplicity asks to skip it. All document
-  // paths start with '/', so the function caller can easily prepend that when
-  // the HTTP request is constructed.
-  *path = p;
-  if (*p == '/')
-    *path = p + 1;
-  *p++ = 0;
-
-  // Check for hash and ignore it since it is never sent to the web server
-  while (*p && *p != '#')
-    ++p;
-  if (*p == '#')
-    *p = 0;
-
-  // Print out returned values for debugging purposes
-  printf("%8s:\t%s\n", "Hostname", *hostname);
-  printf("%8s:\t%s\n", "Port", *port);
-  printf("%8s:\t%s\n\n", "Path", *path);
-}
-
-/**
- * @brief A function to connect to a remote host and return the socket.
- *
- * This function takes a hostname and port number and attempts to connect to
- * the remote host using a TCP socket. If the connection is successful, the
- * socket is returned; otherwise, the program exits with an error message.
- *
- * @param hostname The hostname or IP address of the remote host.
- * @param port The port number of the remote host.
- * @return The socket used to connect to the remote host.
- */
-SOCKET connect_to_host(char *hostname, char *port) {
-  // Configure remote address
-  printf("Configuring remote address...\n");
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_socktype = SOCK_STREAM;
-  struct addrinfo *peer_address;
-  if (getaddrinfo(hostname, port, &hints, &peer_address)) {
-    fprintf(stderr, "getaddrinfo() failed. (%d)\n", GETSOCKETERRNO());
-    exit(EXIT_FAILURE);
-  }
-
-  // Print hostname resolution result for debugging purposes
-  printf("Remote address is: ");
-  char address_buffer[100];
-  char service_buffer[100];
-  getnameinfo(peer_address->ai_addr, peer_address->ai_addrlen, address_buffer,
-              sizeof(address_buffer), service_buffer, sizeof(service_buffer),
-              NI_NUMERICHOST);
-  printf("%s %s\n", address_buffer, service_buffer);
-
-  // Create a new socket to establish the TCP connection
-  printf("Creating socket...\n");
-  SOCKET server;
-  server = socket(peer_address->ai_family, peer_address->ai_socktype,
-                  peer_address->ai_protocol);
-  if (!ISVALIDSOCKET(server)) {
-    fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
-    exit(EXIT_FAILURE);
-  }
-
-  printf("Connecting...\n");
-  if (connect(server, peer_address->ai_addr, peer_address->ai_addrlen)) {
-    fprintf(stderr, "connect() failed. (%d)\n", GETSOCKETERRNO());
-    exit(EXIT_FAILURE);
-  }
-  freeaddrinfo(peer_address);
-
-  printf("Connected.\n\n");
-
-  return server;
-}
-
 /**
  * @brief A function to send a GET request to a server.
  *
@@ -356,16 +244,22 @@ SOCKET connect_to_host(char *hostname, char *port) {
 void send_request(SOCKET server, char *hostname, char *port, char *path) {
   // Construct the HTTP request. GET request only needs headers.
   char buffer[2048];
-  sprintf(buffer, "GET /%s HTTP/1.1\r\n", path);
-  sprintf(buffer + strlen(buffer), "Host: %s:%s\r\n", hostname, port);
-  sprintf(buffer + strlen(buffer), "Connection: close\r\n");
+  http_builder request;
+  http_builder_init(&request, buffer, sizeof(buffer), NULL, 0);
+  http_builder_format(&request, "GET /%s HTTP/1.1\r\n", path);
+  http_builder_format(&request, "Host: %s:%s\r\n", hostname, port);
+  http_builder_header(&request, "Connection", "close");
   // This User-Agent stands for: Book_Title This_Program_Title Version
-  sprintf(buffer + strlen(buffer), "User-Agent: honpwc web_get 1.0\r\n");
-  sprintf(buffer + strlen(buffer), "\r\n");
+  http_builder_header(&request, "User-Agent", "honpwc web_get 1.0");
+  http_builder_end(&request);
+  if (request.failed) {
+    fprintf(stderr, "URL too long.\n");
+    exit(EXIT_FAILURE);
+  }
 
   // Send the request
-  send(server, buffer, strlen(buffer), 0);
+  send(server, buffer, (int)request.length, 0);
 
   // Print out the request for debugging purposes
-  printf("Sent Headers:\n%s", buffer);
+  printf("Sent Headers:\n%.*s", (int)request.length, buffer);
 }
@@ -0,0 +1,294 @@
+/* access_log.c */
+
+#include "access_log.h"
+#include "date_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void *run_log_thread(void *arg);
+static void append_text(char *text, size_t size, size_t *length,
+                        const char *format, ...);
+static void append_escaped(char *text, size_t size, size_t *length,
+                           http_slice field, enum log_format format);
+
+/**
+ * @brief Set up an empty ring over a buffer.
+ *
+ * @param ring The ring.
+ * @param data The buffer, which the ring does not own.
+ * @param size The size of the buffer, a power of two.
+ */
+void log_ring_init(log_ring *ring, char *data, size_t size) {
+  ring->data = data;
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+/**
+ * @brief Append an entry to a ring, from its producer.
+ *
+ * The entry is not appended if the consumer is too far behind for the ring
+ * to hold it: the producer never waits.
+ *
+ * @param ring The ring.
+ * @param entry The entry.
+ * @param length The length of the entry.
+ * @return 1 if the entry was appended, 0 if there was no room for it.
+ */
+int log_ring_append(log_ring *ring, const char *entry, size_t length) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (ring->head + length - tail > ring->size)
+    return 0;
+  size_t start = ring->head & (ring->size - 1);
+  size_t first = ring->size - start;
+  if (first > length)
+    first = length;
+  memcpy(ring->data + start, entry, first);
+  memcpy(ring->data, entry + first, length - first);
+  __atomic_store_n(&ring->head, ring->head + length, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * @brief Look at what a ring holds, from its consumer.
+ *
+ * @param ring The ring.
+ * @param parts Receive the bytes held, up to the end of the ring then from
+ * its start, the second part being empty unless they wrap around.
+ * @return The number of bytes held.
+ */
+size_t log_ring_peek(log_ring *ring, struct iovec parts[2]) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  size_t held = head - ring->tail;
+  size_t start = ring->tail & (ring->size - 1);
+  size_t first = ring->size - start;
+  if (first > held)
+    first = held;
+  parts[0].iov_base = ring->data + start;
+  parts[0].iov_len = first;
+  parts[1].iov_base = ring->data;
+  parts[1].iov_len = held - first;
+  return held;
+}
+
+/**
+ * @brief Give bytes taken from a ring back to its producer.
+ *
+ * @param ring The ring.
+ * @param length The number of bytes, no more than log_ring_peek() returned.
+ */
+void log_ring_consume(log_ring *ring, size_t length) {
+  __atomic_store_n(&ring->tail, ring->tail + length, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Open the file of an access log, and allocate its ring.
+ *
+ * Called before any worker is forked: the file being opened for appending,
+ * the workers can share it, while each gets its own copy of the ring.
+ *
+ * @param log The access log.
+ * @param name The path of the file.
+ * @param format The format of the entries.
+ * @return 0 on success, -1 on error, with errno set.
+ */
+int access_log_open(access_log *log, const char *name,
+                    enum log_format format) {
+  char *data = (char *)malloc(LOG_RING_SIZE);
+  if (!data)
+    return -1;
+  log->fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (log->fd < 0) {
+    free(data);
+    return -1;
+  }
+  log->format = format;
+  log_ring_init(&log->ring, data, LOG_RING_SIZE);
+  return 0;
+}
+
+/**
+ * @brief Start the thread writing out an access log, if there is one.
+ *
+ * Called by each worker after it is forked, like start_io_threads(): each
+ * worker has its own ring and thread, and they share the file.
+ *
+ * @param log The access log, whose file may be -1.
+ */
+void access_log_start(access_log *log) {
+  if (log->fd < 0)
+    return;
+
+  pthread_t thread;
+  int error = pthread_create(&thread, NULL, run_log_thread, log);
+  if (error) {
+    fprintf(stderr, "pthread_create() failed. (%d)\n", error);
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+}
+
+/**
+ * @brief Write the ring of an access log out to its file, forever.
+ *
+ * Every LOG_FLUSH_INTERVAL, whatever the event loop appended meanwhile is
+ * written with a single writev(), one part up to the end of the ring and one
+ * from its start. The file being opened for appending, the batches of the
+ * workers never overwrite one another, and entries never straddle batches.
+ *
+ * @param arg The access log.
+ * @return Never returns.
+ */
+static void *run_log_thread(void *arg) {
+  access_log *log = (access_log *)arg;
+  struct timespec interval = {0, LOG_FLUSH_INTERVAL * 1000000L};
+  while (1) {
+    nanosleep(&interval, NULL);
+    struct iovec parts[2];
+    size_t held;
+    while ((held = log_ring_peek(&log->ring, parts))) {
+      ssize_t written = writev(log->fd, parts, 2);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written < 0) {
+        // The batch is lost, the event loop must not wait for the disk
+        fprintf(stderr, "writev() failed. (%d)\n", errno);
+        log_ring_consume(&log->ring, held);
+        break;
+      }
+      log_ring_consume(&log->ring, written);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Log a response sent in full to an access log.
+ *
+ * The entry is formatted on the stack and appended to the ring, without a
+ * system call: the client address was formatted once accepted, and the date
+ * is formatted once a second. The Common Log Format entry reads
+ *
+ *   127.0.0.1 - - [17/Oct/2026:13:55:36 +0000] "GET / HTTP/1.1" 200 2326
+ *
+ * and the JSON one holds the same fields, and the duration. Bytes are those
+ * sent, headers included. The fields of a request too malformed to tell
+ * them are empty, or "-" for the Common Log Format request line.
+ *
+ * @param log The access log.
+ * @param request The request answered.
+ * @param host The address of the client.
+ * @param status The status code of the response.
+ * @param sent The bytes of the response sent.
+ * @param duration Microseconds from the complete request to the last byte
+ * sent.
+ * @return 1 if the entry was logged, 0 if it was dropped, the log thread
+ * being too far behind for the ring to hold it.
+ */
+int access_log_append(access_log *log, const http_request *request,
+                      const char *host, int status, long long sent,
+                      uint64_t duration) {
+  enum log_format format = log->format;
+  const char *date =
+      format == LOG_JSON ? date_cache_iso() : date_cache_common_log();
+
+  char entry[LOG_ENTRY_SIZE];
+  size_t length = 0;
+  if (format == LOG_JSON) {
+    append_text(entry, sizeof(entry), &length,
+                "{\"time\":\"%s\",\"remote\":\"%s\",\"method\":\"", date,
+                host);
+    append_escaped(entry, sizeof(entry), &length, request->method_name,
+                   format);
+    append_text(entry, sizeof(entry), &length, "\",\"path\":\"");
+    append_escaped(entry, sizeof(entry), &length, request->path, format);
+    append_text(entry, sizeof(entry), &length, "\",\"version\":\"");
+    append_escaped(entry, sizeof(entry), &length, request->version, format);
+    append_text(entry, sizeof(entry), &length,
+                "\",\"status\":%d,\"bytes\":%lld,\"duration_us\":%ju}\n",
+                status, sent, (uintmax_t)duration);
+  } else {
+    append_text(entry, sizeof(entry), &length, "%s - - [%s] \"", host, date);
+    if (request->method_name.length) {
+      append_escaped(entry, sizeof(entry), &length, request->method_name,
+                     format);
+      append_text(entry, sizeof(entry), &length, " ");
+      append_escaped(entry, sizeof(entry), &length, request->path, format);
+      append_text(entry, sizeof(entry), &length, " ");
+      append_escaped(entry, sizeof(entry), &length, request->version, format);
+    } else
+      append_text(entry, sizeof(entry), &length, "-");
+    append_text(entry, sizeof(entry), &length, "\" %d %lld\n", status, sent);
+  }
+  if (length >= sizeof(entry))
+    return 1; // Cannot happen, the fields being cut: not worth counting
+  return log_ring_append(&log->ring, entry, length);
+}
+
+/**
+ * @brief Append formatted text to a buffer, as long as there is room.
+ *
+ * @param text The buffer.
+ * @param size The size of the buffer.
+ * @param length The length of the text so far, which grows by the length
+ * of the formatted text even where it does not fit.
+ * @param format The printf() format of the text.
+ */
+static void append_text(char *text, size_t size, size_t *length,
+                        const char *format, ...) {
+  if (*length >= size)
+    return;
+  va_list args;
+  va_start(args, format);
+  int added = vsnprintf(text + *length, size - *length, format, args);
+  va_end(args);
+  if (added > 0)
+    *length += added;
+}
+
+/**
+ * @brief Append a field of the request to an access log entry, escaped.
+ *
+ * Quotes, backslashes and bytes that are not printable ASCII are escaped,
+ * as \xHH for the Common Log Format and \u00HH for JSON, so that a request
+ * can neither break an entry nor write to the terminal of whoever reads the
+ * log. The field is cut past LOG_FIELD_SIZE bytes.
+ *
+ * @param text The entry.
+ * @param size The size of the entry.
+ * @param length The length of the entry so far, which grows by the length
+ * of the escaped field.
+ * @param field The field.
+ * @param format The format of the entry.
+ */
+static void append_escaped(char *text, size_t size, size_t *length,
+                           http_slice field, enum log_format format) {
+  size_t end = *length + LOG_FIELD_SIZE;
+  if (end > size)
+    end = size;
+  for (size_t i = 0; i < field.length; ++i) {
+    unsigned char c = (unsigned char)field.data[i];
+    char escaped[8];
+    int count = 1;
+    if (c == '"' || c == '\\')
+      count = snprintf(escaped, sizeof(escaped), "\\%c", c);
+    else if (c < 0x20 || c >= 0x7f)
+      count = snprintf(escaped, sizeof(escaped),
+                       format == LOG_JSON ? "\\u%04x" : "\\x%02x", c);
+    else
+      escaped[0] = (char)c;
+    if (*length + count >= end)
+      return;
+    memcpy(text + *length, escaped, count);
+    *length += count;
+  }
+}
@@ -0,0 +1,55 @@
+/* access_log.h */
+
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include "http_parser.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Bytes of the access log ring of each worker, a power of two
+#define LOG_RING_SIZE (1024 * 1024)
+// Longest access log entry
+#define LOG_ENTRY_SIZE 2048
+// Longest method, path or version in an entry once escaped, longer ones are
+// cut
+#define LOG_FIELD_SIZE 512
+// Milliseconds between two writes of the access log ring to the file
+#define LOG_FLUSH_INTERVAL 100
+
+// Access log formats, picked with --log-format
+enum log_format { LOG_COMMON, LOG_JSON };
+
+// Bytes on their way to the file. The ring has a single producer and a
+// single consumer, each only ever moving its own end, so neither takes a
+// lock.
+typedef struct log_ring {
+  char *data;
+  size_t size;   // A power of two
+  uint64_t head; // Bytes appended, moved by the producer
+  uint64_t tail; // Bytes taken, moved by the consumer
+} log_ring;
+
+// Access log: the event loop appends entries to the ring, and the log thread
+// writes them out in batches.
+typedef struct access_log {
+  int fd; // The file, or -1 without one
+  enum log_format format;
+  log_ring ring;
+} access_log;
+
+void log_ring_init(log_ring *ring, char *data, size_t size);
+int log_ring_append(log_ring *ring, const char *entry, size_t length);
+size_t log_ring_peek(log_ring *ring, struct iovec parts[2]);
+void log_ring_consume(log_ring *ring, size_t length);
+
+int access_log_open(access_log *log, const char *name,
+                    enum log_format format);
+void access_log_start(access_log *log);
+int access_log_append(access_log *log, const http_request *request,
+                      const char *host, int status, long long sent,
+                      uint64_t duration);
+
+#endif
@@ -0,0 +1,101 @@
+/* client_table.c */
+
+#include "client_table.h"
+
+#include <stddef.h>
+
+/**
+ * @brief Add a client to the table, after the live ones.
+ *
+ * @param table The table, not full.
+ * @param entry The entry of the client, not in the table.
+ * @param socket The socket of the client, lower than CLIENT_TABLE_SIZE.
+ */
+void client_table_add(client_table *table, table_entry *entry, int socket) {
+  entry->slot = table->count;
+  entry->next = NULL;
+  table->live[table->count++] = entry;
+  table->by_socket[socket] = entry;
+}
+
+/**
+ * @brief Look up the client connected on a socket.
+ *
+ * @param table The table.
+ * @param socket The socket, lower than CLIENT_TABLE_SIZE.
+ * @return The entry of the client, or NULL if there is none.
+ */
+table_entry *client_table_find(client_table *table, int socket) {
+  return table->by_socket[socket];
+}
+
+/**
+ * @brief Tell whether a client is still in the table.
+ *
+ * An entry removed during the current turn of the event loop has not been
+ * reused yet, so that an event harvested for it before it was removed is
+ * told apart from one for a live client.
+ *
+ * @param table The table.
+ * @param entry The entry of the client.
+ * @return 1 if so, 0 if it was removed.
+ */
+int client_table_contains(const client_table *table,
+                          const table_entry *entry) {
+  return entry->slot >= 0 && entry->slot < table->count &&
+         table->live[entry->slot] == entry;
+}
+
+/**
+ * @brief Take a client out of the table.
+ *
+ * Its slot is refilled by the last live client. The entry is set aside
+ * until client_table_recycle() is called.
+ *
+ * @param table The table.
+ * @param entry The entry of the client, which the table contains.
+ * @param socket The socket of the client.
+ */
+void client_table_remove(client_table *table, table_entry *entry,
+                         int socket) {
+  table_entry *last = table->live[--table->count];
+  table->live[entry->slot] = last;
+  last->slot = entry->slot;
+  table->live[table->count] = NULL;
+  table->by_socket[socket] = NULL;
+
+  entry->slot = -1;
+  entry->next = table->removed;
+  table->removed = entry;
+}
+
+/**
+ * @brief Take an entry removed before the current turn, to be reused for a
+ *        new client.
+ *
+ * @param table The table.
+ * @return The entry, or NULL if there is none.
+ */
+table_entry *client_table_reuse(client_table *table) {
+  table_entry *entry = table->free;
+  if (entry)
+    table->free = entry->next;
+  return entry;
+}
+
+/**
+ * @brief Make the entries removed during the turn of the event loop that
+ *        ends reusable.
+ *
+ * Called once the events harvested in the turn have all been handled.
+ *
+ * @param table The table.
+ */
+void client_table_recycle(client_table *table) {
+  while (table->removed) {
+    table_entry *entry = table->removed;
+    table->removed = entry->next;
+    entry->next = table->free;
+    table->free = entry;
+  }
+}
@@ -0,0 +1,39 @@
+/* client_table.h */
+
+#ifndef CLIENT_TABLE_H
+#define CLIENT_TABLE_H
+
+// Size of the client table: bounds both the number of simultaneous clients
+// and the socket descriptor values the table can be indexed with
+#define CLIENT_TABLE_SIZE 65536
+
+// A place in the client table, embedded in each client
+typedef struct table_entry {
+  int slot; // Position in live while in the table, -1 once removed
+  struct table_entry *next; // Link in the removed or free entries
+} table_entry;
+
+// Connected clients, packed at the front of live so that loops only ever
+// visit them, and indexed by their socket. A removed entry's slot is refilled
+// by the last one. Removed entries are only reused once the turn of the
+// event loop ends, see client_table_recycle(): an event harvested earlier in
+// the turn finds its client removed, rather than a client accepted since in
+// the same storage.
+typedef struct client_table {
+  table_entry *live[CLIENT_TABLE_SIZE];
+  int count;
+  table_entry *by_socket[CLIENT_TABLE_SIZE];
+  table_entry *removed; // During the current turn
+  table_entry *free;    // Before it, ready to be reused
+} client_table;
+
+void client_table_add(client_table *table, table_entry *entry, int socket);
+table_entry *client_table_find(client_table *table, int socket);
+int client_table_contains(const client_table *table,
+                          const table_entry *entry);
+void client_table_remove(client_table *table, table_entry *entry,
+                         int socket);
+table_entry *client_table_reuse(client_table *table);
+void client_table_recycle(client_table *table);
+
+#endif
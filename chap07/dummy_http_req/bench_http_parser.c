@@ -0,0 +1,111 @@
+/* bench_http_parser.c */
+
+#include "../http_parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ITERATIONS 200000
+
+// A request as a browser would send it
+static const char request_text[] =
+    "GET /style.css HTTP/1.1\r\n"
+    "Host: 127.0.0.1:3157\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 "
+    "Firefox/128.0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://127.0.0.1:3157/\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-Modified-Since: Tue, 01 Oct 2024 10:00:00 GMT\r\n"
+    "If-None-Match: \"5e1f-66fbc8a0\"\r\n"
+    "Priority: u=2\r\n"
+    "\r\n";
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Parse the request ITERATIONS times, delivered in pieces of a given
+ * size, the way the server did before: searching the whole buffer for the
+ * blank line after each piece.
+ *
+ * @return Nanoseconds per request.
+ */
+double bench_rescan(size_t piece) {
+  size_t length = sizeof(request_text) - 1;
+  char buffer[sizeof(request_text)];
+  volatile size_t found = 0;
+
+  double start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    for (size_t received = 0; received < length;) {
+      size_t n = length - received < piece ? length - received : piece;
+      memcpy(buffer + received, request_text + received, n);
+      received += n;
+      buffer[received] = 0;
+      const char *q = strstr(buffer, "\r\n\r\n");
+      if (q) {
+        found += q - buffer;
+        break;
+      }
+    }
+  }
+  return (now_ns() - start) / ITERATIONS;
+}
+
+/**
+ * @brief Same as bench_rescan(), with the incremental parser.
+ *
+ * @return Nanoseconds per request.
+ */
+double bench_parser(size_t piece) {
+  size_t length = sizeof(request_text) - 1;
+  char buffer[sizeof(request_text)];
+  volatile int headers = 0;
+
+  double start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    http_request request;
+    http_request_init(&request);
+    for (size_t received = 0; received < length;) {
+      size_t n = length - received < piece ? length - received : piece;
+      memcpy(buffer + received, request_text + received, n);
+      received += n;
+      if (http_parse_request(&request, buffer, received) !=
+          HTTP_PARSE_INCOMPLETE)
+        break;
+    }
+    headers += request.header_count;
+  }
+  return (now_ns() - start) / ITERATIONS;
+}
+
+int main(void) {
+  printf("Request of %zu bytes, %d iterations\n\n", sizeof(request_text) - 1,
+         ITERATIONS);
+  printf("%-12s %16s %16s\n", "piece size", "rescan (ns)", "parser (ns)");
+
+  size_t pieces[] = {sizeof(request_text), 64, 16, 1};
+  for (size_t i = 0; i < sizeof(pieces) / sizeof(pieces[0]); ++i) {
+    double rescan = bench_rescan(pieces[i]);
+    double parser = bench_parser(pieces[i]);
+    if (pieces[i] == sizeof(request_text))
+      printf("%-12s %16.1f %16.1f\n", "whole", rescan, parser);
+    else
+      printf("%-12zu %16.1f %16.1f\n", pieces[i], rescan, parser);
+  }
+
+  // The parser extracts method, path and every header, rescan only finds the
+  // end of the headers: compare the totals with that in mind.
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,110 @@
+/* bench_scan.c */
+
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ITERATIONS 200000
+
+static const char *backend_names[] = {"avx2", "sse2", "scalar"};
+
+// A response header block as web_get receives it, followed by some body
+static char response[4096];
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Build a response whose headers end after a given number of bytes.
+ */
+static size_t build_response(size_t header_size) {
+  static const char line[] =
+      "X-Filler: abcdefghijklmnopqrstuvwxyz0123456789\r\n";
+  size_t length = 0;
+  length += sprintf(response, "HTTP/1.1 200 OK\r\nContent-Length: 100\r\n");
+  while (length + sizeof(line) - 1 + 2 <= header_size) {
+    memcpy(response + length, line, sizeof(line) - 1);
+    length += sizeof(line) - 1;
+  }
+  memcpy(response + length, "\r\n\r\n", 4);
+  length += 4;
+  memset(response + length, 'x', 100);
+  response[length + 100] = 0;
+  return length + 100;
+}
+
+/**
+ * @brief Find the end of the headers with strstr(), as web_get did.
+ *
+ * @return Nanoseconds per search.
+ */
+double bench_strstr(void) {
+  volatile size_t found = 0;
+  double start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i)
+    found += strstr(response, "\r\n\r\n") - response;
+  return (now_ns() - start) / ITERATIONS;
+}
+
+/**
+ * @brief Find the end of the headers with scan_find().
+ *
+ * @return Nanoseconds per search.
+ */
+double bench_find(size_t length) {
+  volatile size_t found = 0;
+  double start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i)
+    found += scan_find(response, response + length, "\r\n\r\n", 4) - response;
+  return (now_ns() - start) / ITERATIONS;
+}
+
+/**
+ * @brief Walk the header lines one CR at a time with scan_delimiters(), as
+ * the request parser does for header values.
+ *
+ * @return Nanoseconds per walk.
+ */
+double bench_delimiters(size_t length) {
+  volatile size_t lines = 0;
+  const char *end = response + length;
+  double start = now_ns();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    const char *p = response;
+    while ((p = scan_delimiters(p, end, SCAN_CTL)) < end) {
+      if (*p != '\r')
+        break;
+      lines++;
+      if (p[2] == '\r')
+        break;
+      p += 2;
+    }
+  }
+  return (now_ns() - start) / ITERATIONS;
+}
+
+int main(void) {
+  size_t sizes[] = {64, 256, 1024, 3000};
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    size_t length = build_response(sizes[s]);
+    printf("Headers of %zu bytes, %d iterations\n", sizes[s], ITERATIONS);
+    printf("  %-10s %16s %16s\n", "backend", "find (ns)", "lines (ns)");
+    printf("  %-10s %16.1f %16s\n", "strstr", bench_strstr(), "-");
+    for (size_t b = 0; b < sizeof(backend_names) / sizeof(backend_names[0]);
+         ++b) {
+      if (!scan_use(backend_names[b]))
+        continue;
+      printf("  %-10s %16.1f %16.1f\n", backend_names[b], bench_find(length),
+             bench_delimiters(length));
+    }
+    printf("\n");
+  }
+  return EXIT_SUCCESS;
+}
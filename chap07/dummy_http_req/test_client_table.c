@@ -0,0 +1,109 @@
+/* test_client_table.c */
+
+#include "../client_table.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// A client as the event loop sees it, the slab it comes from and the table
+typedef struct client {
+  int socket;
+  int handled; // Events dispatched to it
+  table_entry entry;
+} client;
+
+static client slab[16];
+static int slab_used = 0;
+static client_table table;
+
+static client *table_client(table_entry *entry) {
+  return (client *)((char *)entry - offsetof(client, entry));
+}
+
+/**
+ * @brief Connect a client, reusing a dropped one if any, as get_client()
+ *        does.
+ */
+static client *connect_client(int socket) {
+  table_entry *entry = client_table_reuse(&table);
+  client *c = entry ? table_client(entry) : &slab[slab_used++];
+  c->socket = socket;
+  c->handled = 0;
+  client_table_add(&table, &c->entry, socket);
+  return c;
+}
+
+static void drop(client *c) {
+  client_table_remove(&table, &c->entry, c->socket);
+}
+
+/**
+ * @brief Tell whether the live clients are packed and indexed by socket.
+ */
+static int is_consistent(void) {
+  for (int i = 0; i < table.count; ++i) {
+    table_entry *entry = table.live[i];
+    if (entry->slot != i || !client_table_contains(&table, entry) ||
+        client_table_find(&table, table_client(entry)->socket) != entry)
+      return 0;
+  }
+  return 1;
+}
+
+int main(void) {
+  int failures = 0;
+
+  // A client dropped while an earlier event of a batch is handled, as when
+  // its file job completes, is skipped by its own event later in the batch,
+  // and a client accepted in between does not take its storage
+  int batch_failures = 0;
+  client *x = connect_client(7);
+  client *y = connect_client(8);
+  client *events[] = {NULL, x, y};
+  client *accepted = NULL;
+  for (int i = 0; i < 3; ++i) {
+    client *c = events[i];
+    if (!c) {
+      drop(x);
+      accepted = connect_client(9);
+    } else if (!client_table_contains(&table, &c->entry))
+      continue;
+    else
+      c->handled++;
+  }
+  if (x->handled || y->handled != 1 || accepted == x ||
+      client_table_find(&table, 7) || table.count != 2 || !is_consistent())
+    batch_failures++;
+  // Once the turn ends, the storage of the dropped client is reused
+  client_table_recycle(&table);
+  client *reused = connect_client(7);
+  if (reused != x || !client_table_contains(&table, &x->entry) ||
+      !is_consistent())
+    batch_failures++;
+  printf("%-28s %s\n", "drop within a batch",
+         batch_failures ? "FAILED" : "ok");
+  failures += batch_failures;
+
+  // Dropping in any order keeps the live clients packed, none reused before
+  // the turn ends
+  int pack_failures = 0;
+  client *z = connect_client(10);
+  drop(accepted);
+  drop(z);
+  drop(y);
+  if (client_table_reuse(&table) || table.count != 1 ||
+      table.live[0] != &reused->entry || !is_consistent())
+    pack_failures++;
+  client_table_recycle(&table);
+  int reused_count = 0;
+  while (client_table_reuse(&table))
+    reused_count++;
+  if (reused_count != 3)
+    pack_failures++;
+  printf("%-28s %s\n", "packing", pack_failures ? "FAILED" : "ok");
+  failures += pack_failures;
+
+  printf("\n%d failure(s)\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
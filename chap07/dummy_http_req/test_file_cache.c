@@ -0,0 +1,104 @@
+/* test_file_cache.c */
+
+#include "../file_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Paths cached and changed, with their precompressed siblings, nested
+// directories and names that are prefixes of one another
+static const char *const paths[] = {
+    "public", "public/a", "public/a/b", "public/a/b/c.css",
+    "public/a/b/c.css.gz", "public/a/b/c.css.br", "public/a/x", "public/ab",
+    "public/ab/c", "public/a/bc", "public/a/b/c", "public/a/b/c/d",
+    "public/z.gz", "public/z", "z", "public/a.br"};
+#define PATHS (int)(sizeof(paths) / sizeof(paths[0]))
+
+static file_cache cache = {.watch_fd = -1};
+
+/**
+ * @brief Tell whether a change to a path makes the entries of a file stale,
+ * the way the whole cache used to be walked to find out.
+ */
+static int is_stale(const char *file, const char *path) {
+  size_t length = strlen(path);
+  size_t file_length = strlen(file);
+  if (strncmp(file, path, length) == 0 &&
+      (file[length] == 0 || file[length] == '/'))
+    return 1;
+  return strncmp(path, file, file_length) == 0 &&
+         (strcmp(path + file_length, ".gz") == 0 ||
+          strcmp(path + file_length, ".br") == 0);
+}
+
+static void cache_path(int path, enum content_encoding encoding) {
+  cache_entry *entry = (cache_entry *)calloc(1, sizeof(cache_entry));
+  strcpy(entry->path, paths[path]);
+  entry->encoding = encoding;
+  entry->body = (char *)malloc(1);
+  entry->file = -1;
+  entry->size = 1;
+  file_cache_insert(&cache, entry);
+}
+
+int main(void) {
+  int failures = 0;
+  int cached[PATHS][ENCODING_BR + 1];
+  memset(cached, 0, sizeof(cached));
+
+  // Files cached and changes reported at random, the cache holding exactly
+  // the entries no change made stale
+  int forget_failures = 0;
+  for (int i = 0; i < 100000 && forget_failures < 5; ++i) {
+    int path = rand() % PATHS;
+    enum content_encoding encoding = rand() % (ENCODING_BR + 1);
+    if (rand() % 3) {
+      if (!cached[path][encoding])
+        cache_path(path, encoding);
+      cached[path][encoding] = 1;
+    } else {
+      file_cache_forget(&cache, paths[path]);
+      for (int j = 0; j < PATHS; ++j)
+        if (is_stale(paths[j], paths[path]))
+          memset(cached[j], 0, sizeof(cached[j]));
+    }
+    for (int j = 0; j < PATHS; ++j)
+      for (int k = 0; k <= ENCODING_BR; ++k)
+        if ((file_cache_find(&cache, paths[j], k) != NULL) != cached[j][k]) {
+          printf("  %s (%d) %s after %d changes\n", paths[j], k,
+                 cached[j][k] ? "missing" : "still cached", i);
+          forget_failures++;
+        }
+  }
+  printf("%-28s %s\n", "forget", forget_failures ? "FAILED" : "ok");
+  failures += forget_failures;
+
+  // Once every file is gone, so are the directories that held them
+  int empty_failures = 0;
+  file_cache_forget(&cache, "public");
+  file_cache_forget(&cache, "z");
+  for (int i = 0; i < FILE_CACHE_BUCKETS; ++i)
+    if (cache.buckets[i] || cache.directories[i])
+      empty_failures++;
+  if (cache.newest || cache.oldest || cache.used != 0)
+    empty_failures++;
+  printf("%-28s %s\n", "empty", empty_failures ? "FAILED" : "ok");
+  failures += empty_failures;
+
+  // An entry evicted while it is being sent lives on until released
+  int release_failures = 0;
+  cache_path(3, ENCODING_IDENTITY);
+  cache_entry *entry = file_cache_find(&cache, paths[3], ENCODING_IDENTITY);
+  entry->references++;
+  file_cache_forget(&cache, "public/a");
+  if (entry->cached || strcmp(entry->path, paths[3]) != 0 ||
+      file_cache_find(&cache, paths[3], ENCODING_IDENTITY))
+    release_failures++;
+  file_cache_release(entry);
+  printf("%-28s %s\n", "release", release_failures ? "FAILED" : "ok");
+  failures += release_failures;
+
+  printf("\n%d failure(s)\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/* test_http_builder.c */
+
+#include "http_builder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Tell whether a part holds the given text.
+ */
+static int part_is(const struct iovec *part, const char *text) {
+  return part->iov_len == strlen(text) &&
+         memcmp(part->iov_base, text, part->iov_len) == 0;
+}
+
+int main(void) {
+  int failures = 0;
+  char arena[128];
+  struct iovec parts[3];
+  http_builder builder;
+  static const char body[] = "Not Found";
+
+  // Header lines make a single part, a body added by reference its own,
+  // pointing to the body rather than to a copy
+  int parts_failures = 0;
+  http_builder_init(&builder, arena, sizeof(arena), parts, 3);
+  http_builder_status(&builder, 404, "Not Found");
+  http_builder_header(&builder, "Connection", "close");
+  http_builder_header_number(&builder, "Content-Length", sizeof(body) - 1);
+  http_builder_end(&builder);
+  http_builder_reference(&builder, body, sizeof(body) - 1);
+  if (builder.failed || builder.part_count != 2 ||
+      !part_is(&parts[0], "HTTP/1.1 404 Not Found\r\n"
+                          "Connection: close\r\n"
+                          "Content-Length: 9\r\n\r\n") ||
+      parts[1].iov_base != body || parts[1].iov_len != sizeof(body) - 1 ||
+      builder.length != parts[0].iov_len)
+    parts_failures++;
+  printf("%-28s %s\n", "parts", parts_failures ? "FAILED" : "ok");
+  failures += parts_failures;
+
+  // Text appended after a reference starts a new part
+  int after_failures = 0;
+  http_builder_init(&builder, arena, sizeof(arena), parts, 3);
+  http_builder_text(&builder, "a");
+  http_builder_reference(&builder, body, 3);
+  http_builder_format(&builder, "%d", 42);
+  if (builder.failed || builder.part_count != 3 ||
+      !part_is(&parts[0], "a") || !part_is(&parts[1], "Not") ||
+      !part_is(&parts[2], "42"))
+    after_failures++;
+  printf("%-28s %s\n", "text after reference",
+         after_failures ? "FAILED" : "ok");
+  failures += after_failures;
+
+  // Without a list of parts, a reference is gathered in the arena
+  int gather_failures = 0;
+  http_builder_init(&builder, arena, sizeof(arena), NULL, 0);
+  http_builder_header_number(&builder, "Content-Length", -12);
+  http_builder_reference(&builder, body, sizeof(body) - 1);
+  if (builder.failed || builder.length != 30 ||
+      memcmp(arena, "Content-Length: -12\r\nNot Found", 30) != 0)
+    gather_failures++;
+  printf("%-28s %s\n", "gathered", gather_failures ? "FAILED" : "ok");
+  failures += gather_failures;
+
+  // Running out of parts or of arena fails the builder for good
+  int full_failures = 0;
+  http_builder_init(&builder, arena, sizeof(arena), parts, 2);
+  http_builder_text(&builder, "a");
+  http_builder_reference(&builder, body, 1);
+  http_builder_text(&builder, "b");
+  if (!builder.failed || builder.part_count != 2)
+    full_failures++;
+  http_builder_init(&builder, arena, 8, parts, 3);
+  http_builder_text(&builder, "12345");
+  http_builder_text(&builder, "6789");
+  http_builder_text(&builder, "a");
+  if (!builder.failed || builder.length != 5)
+    full_failures++;
+  http_builder_init(&builder, arena, 8, NULL, 0);
+  http_builder_format(&builder, "%s", "12345678");
+  if (!builder.failed || builder.length != 0)
+    full_failures++;
+  printf("%-28s %s\n", "full", full_failures ? "FAILED" : "ok");
+  failures += full_failures;
+
+  printf("\n%d failure(s)\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,363 @@
+/* test_http_parser.c */
+
+#include "../http_parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A request and what the parser is expected to make of it
+typedef struct parser_case {
+  const char *name;
+  const char *text;
+  enum http_parse_result result;
+  enum http_method method;
+  const char *path;
+  int header_count;
+  long long content_length;
+  int keep_alive;
+} parser_case;
+
+// clang-format off
+static const parser_case cases[] = {
+  {"simple GET", "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n",
+   HTTP_PARSE_DONE, HTTP_GET, "/", 1, -1, 1},
+  {"HTTP/1.0", "GET /index.html HTTP/1.0\r\n\r\n",
+   HTTP_PARSE_DONE, HTTP_GET, "/index.html", 0, -1, 0},
+  {"HTTP/1.0 keep-alive", "GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n",
+   HTTP_PARSE_DONE, HTTP_GET, "/", 1, -1, 1},
+  {"Connection list", "GET / HTTP/1.1\r\nconnection: foo , close\r\n\r\n",
+   HTTP_PARSE_DONE, HTTP_GET, "/", 1, -1, 0},
+  {"HEAD", "HEAD /style.css?v=2 HTTP/1.1\r\nA: 1\r\nB:2\r\nC:  3  \r\n\r\n",
+   HTTP_PARSE_DONE, HTTP_HEAD, "/style.css?v=2", 3, -1, 1},
+  {"POST with body", "POST /form HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello",
+   HTTP_PARSE_DONE, HTTP_POST, "/form", 1, 5, 1},
+  {"POST body pending", "POST /form HTTP/1.1\r\nContent-Length: 6\r\n\r\nhello",
+   HTTP_PARSE_INCOMPLETE, HTTP_POST, "/form", 1, 6, 1},
+  {"other method", "DELETE /x HTTP/1.1\r\n\r\n",
+   HTTP_PARSE_DONE, HTTP_OTHER, "/x", 0, -1, 1},
+  {"lower case method", "get / HTTP/1.1\r\n\r\n",
+   HTTP_PARSE_DONE, HTTP_OTHER, "/", 0, -1, 1},
+  {"headers pending", "GET / HTTP/1.1\r\nHost: localhost\r\n",
+   HTTP_PARSE_INCOMPLETE, HTTP_GET, "/", 1, -1, 1},
+  {"bare LF", "GET / HTTP/1.1\n\n",
+   HTTP_PARSE_ERROR, HTTP_GET, "/", 0, -1, 1},
+  {"bad version", "GET / HTTP/2.0\r\n\r\n",
+   HTTP_PARSE_ERROR, HTTP_GET, "/", 0, -1, 0},
+  {"space in path", "GET /a b HTTP/1.1\r\n\r\n",
+   HTTP_PARSE_ERROR, HTTP_GET, "/a", 0, -1, 0},
+  {"bad header name", "GET / HTTP/1.1\r\nBad Name: x\r\n\r\n",
+   HTTP_PARSE_ERROR, HTTP_GET, "/", 0, -1, 1},
+  {"folded header", "GET / HTTP/1.1\r\nA: 1\r\n 2\r\n\r\n",
+   HTTP_PARSE_ERROR, HTTP_GET, "/", 1, -1, 1},
+  {"bad Content-Length", "POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+   HTTP_PARSE_ERROR, HTTP_POST, "/", 0, -1, 1},
+  {"conflicting Content-Length",
+   "POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\nab",
+   HTTP_PARSE_ERROR, HTTP_POST, "/", 1, 1, 1},
+  {"chunked", "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+   HTTP_PARSE_ERROR, HTTP_POST, "/", 0, -1, 1},
+};
+// A Range header, the size of the file, and the ranges expected from it
+typedef struct range_case {
+  const char *value;
+  long long size;
+  int count; // As returned by http_parse_ranges()
+  http_range ranges[2];
+} range_case;
+
+static const range_case range_cases[] = {
+  {"bytes=0-99", 1000, 1, {{0, 99}}},
+  {"bytes=500-", 1000, 1, {{500, 999}}},
+  {"bytes=-100", 1000, 1, {{900, 999}}},
+  {"bytes=-5000", 1000, 1, {{0, 999}}},
+  {"bytes=900-5000", 1000, 1, {{900, 999}}},
+  {"Bytes=0-0, 10-19", 1000, 2, {{0, 0}, {10, 19}}},
+  {"bytes=2000-, 0-9", 1000, 1, {{0, 9}}},
+  {"bytes=1000-", 1000, -1, {{0, 0}}},
+  {"bytes=-0", 1000, -1, {{0, 0}}},
+  {"bytes=0-", 0, -1, {{0, 0}}},
+  {"bytes=9-5", 1000, 0, {{0, 0}}},
+  {"bytes=a-5", 1000, 0, {{0, 0}}},
+  {"bytes=-", 1000, 0, {{0, 0}}},
+  {"items=0-5", 1000, 0, {{0, 0}}},
+  {"bytes=0-1,2-3,4-5,6-7,8-9,10-11,12-13", 1000, 0, {{0, 0}}},
+  {"bytes=99999999999999999999-", 1000, -1, {{0, 0}}},
+};
+
+// An If-None-Match header, and whether it matches "\"abc\""
+typedef struct etag_case {
+  const char *list;
+  int matches;
+} etag_case;
+
+static const etag_case etag_cases[] = {
+  {"\"abc\"", 1},
+  {"W/\"abc\"", 1},
+  {"*", 1},
+  {"\"x\", \"abc\"", 1},
+  {"\"a,b\", \"abc\"", 1},
+  {"\"abcd\"", 0},
+  {"abc", 0},
+  {"", 0},
+};
+
+// An Accept-Encoding header, and whether it accepts gzip and br
+typedef struct encoding_case {
+  const char *header;
+  int gzip;
+  int br;
+} encoding_case;
+
+static const encoding_case encoding_cases[] = {
+  {"Accept-Encoding: gzip, deflate, br, zstd\r\n", 1, 1},
+  {"Accept-Encoding: GZIP\r\n", 1, 0},
+  {"Accept-Encoding: gzip;q=0, br;q=0.5\r\n", 0, 1},
+  {"Accept-Encoding: br ; q=0.000, *\r\n", 1, 0},
+  {"Accept-Encoding: *;q=0\r\n", 0, 0},
+  {"Accept-Encoding: identity\r\n", 0, 0},
+  {"Accept-Encoding: gzip;level=1;q=0.\r\n", 0, 0},
+  {"Accept-Encoding: x-gzip\r\nAccept-Encoding: br\r\n", 0, 1},
+  {"", 0, 0},
+};
+
+// A request target, and the path made of it, or NULL if it is rejected
+typedef struct path_case {
+  const char *target;
+  const char *path;
+} path_case;
+
+static const path_case path_cases[] = {
+  {"/", "/"},
+  {"/index.html?v=2#top", "/index.html"},
+  {"//css///site.css", "/css/site.css"},
+  {"/a/./b/../c", "/a/c"},
+  {"/a/b/..", "/a/"},
+  {"/a/%2E%2e/b", "/b"},
+  {"/a%2fb", "/a/b"},
+  {"/my%20file.txt", "/my file.txt"},
+  {"/.../..foo", "/.../..foo"},
+  {"/a/../..", NULL},
+  {"/%2e%2e/etc/passwd", NULL},
+  {"/a%2f..%2f..%2fetc", NULL},
+  {"/a%00.html", NULL},
+  {"/a%0a", NULL},
+  {"/a%2", NULL},
+  {"/a%zz", NULL},
+  {"a/b", NULL},
+  {"/0123456789abcdef", NULL}, // Longer than the 16 bytes given
+};
+// clang-format on
+
+static http_slice slice_of(const char *text) {
+  http_slice slice = {text, strlen(text)};
+  return slice;
+}
+
+/**
+ * @brief Check the parsing of headers, and the normalizing of request paths.
+ *
+ * @return The number of failures, each of them printed.
+ */
+int check_headers(void) {
+  int failures = 0;
+
+  for (size_t i = 0; i < sizeof(range_cases) / sizeof(range_cases[0]); ++i) {
+    const range_case *c = &range_cases[i];
+    http_range ranges[HTTP_MAX_RANGES];
+    int count = http_parse_ranges(slice_of(c->value), c->size, ranges);
+    int ok = count == c->count;
+    for (int r = 0; ok && r < count; ++r)
+      ok = ranges[r].first == c->ranges[r].first &&
+           ranges[r].last == c->ranges[r].last;
+    if (!ok) {
+      printf("  Range '%s' of %lld bytes: %d range(s)\n", c->value, c->size,
+             count);
+      failures++;
+    }
+  }
+  printf("%-28s %s\n", "Range headers", failures ? "FAILED" : "ok");
+
+  int etag_failures = 0;
+  for (size_t i = 0; i < sizeof(etag_cases) / sizeof(etag_cases[0]); ++i) {
+    const etag_case *c = &etag_cases[i];
+    if (http_etag_matches(slice_of(c->list), slice_of("\"abc\"")) !=
+        c->matches) {
+      printf("  If-None-Match '%s': expected %d\n", c->list, c->matches);
+      etag_failures++;
+    }
+  }
+  printf("%-28s %s\n", "If-None-Match lists", etag_failures ? "FAILED" : "ok");
+  failures += etag_failures;
+
+  // Dates go both ways, including around leap days and before 1970
+  int date_failures = 0;
+  const char *date = "Sun, 06 Nov 1994 08:49:37 GMT";
+  if (http_parse_date(slice_of(date)) != 784111777) {
+    printf("  '%s' parsed as %lld\n", date,
+           (long long)http_parse_date(slice_of(date)));
+    date_failures++;
+  }
+  time_t samples[] = {0, 784111777, 951782400, 951868799, 4107542400,
+                      -86400};
+  for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); ++i) {
+    char text[HTTP_DATE_SIZE];
+    http_format_date(samples[i], text);
+    if (http_parse_date(slice_of(text)) != samples[i]) {
+      printf("  %lld formatted as '%s'\n", (long long)samples[i], text);
+      date_failures++;
+    }
+  }
+  char text[HTTP_DATE_SIZE];
+  http_format_date(784111777, text);
+  if (strcmp(text, date) != 0) {
+    printf("  784111777 formatted as '%s'\n", text);
+    date_failures++;
+  }
+  const char *bad_dates[] = {"Sun, 06 Nov 1994 08:49:37 UTC",
+                             "Sunday, 06-Nov-94 08:49:37 GMT",
+                             "Sun, 06 Nox 1994 08:49:37 GMT",
+                             "Sun, 06 Nov 1994 25:49:37 GMT"};
+  for (size_t i = 0; i < sizeof(bad_dates) / sizeof(bad_dates[0]); ++i) {
+    if (http_parse_date(slice_of(bad_dates[i])) != -1) {
+      printf("  '%s' accepted\n", bad_dates[i]);
+      date_failures++;
+    }
+  }
+  printf("%-28s %s\n", "HTTP dates", date_failures ? "FAILED" : "ok");
+  failures += date_failures;
+
+  int encoding_failures = 0;
+  for (size_t i = 0; i < sizeof(encoding_cases) / sizeof(encoding_cases[0]);
+       ++i) {
+    const encoding_case *c = &encoding_cases[i];
+    char text[256];
+    snprintf(text, sizeof(text), "GET / HTTP/1.1\r\n%s\r\n", c->header);
+    http_request request;
+    http_request_init(&request);
+    if (http_parse_request(&request, text, strlen(text)) != HTTP_PARSE_DONE ||
+        http_accepts_encoding(&request, "gzip") != c->gzip ||
+        http_accepts_encoding(&request, "br") != c->br) {
+      printf("  '%s': expected gzip %d, br %d\n", c->header, c->gzip, c->br);
+      encoding_failures++;
+    }
+  }
+  printf("%-28s %s\n", "Accept-Encoding", encoding_failures ? "FAILED" : "ok");
+  failures += encoding_failures;
+
+  int path_failures = 0;
+  for (size_t i = 0; i < sizeof(path_cases) / sizeof(path_cases[0]); ++i) {
+    const path_case *c = &path_cases[i];
+    char path[17];
+    int length = http_normalize_path(slice_of(c->target), path, sizeof(path));
+    if (c->path ? length != (int)strlen(c->path) || strcmp(path, c->path)
+                : length != -1) {
+      printf("  '%s' normalized as '%s'\n", c->target,
+             length < 0 ? "(rejected)" : path);
+      path_failures++;
+    }
+  }
+  printf("%-28s %s\n", "Request paths", path_failures ? "FAILED" : "ok");
+  failures += path_failures;
+
+  return failures;
+}
+
+/**
+ * @brief Compare a parsed request with what a case expects.
+ *
+ * @return The number of mismatches, each of them printed.
+ */
+int check(const parser_case *c, const http_request *request,
+          enum http_parse_result result, const char *how) {
+  int failures = 0;
+  if (result != c->result) {
+    printf("  %s: result %d, expected %d\n", how, result, c->result);
+    return 1;
+  }
+  if (request->path.data && request->method != c->method) {
+    printf("  %s: method %d, expected %d\n", how, request->method, c->method);
+    failures++;
+  }
+  if (request->path.data && !(request->path.length == strlen(c->path) &&
+                              !memcmp(request->path.data, c->path,
+                                      request->path.length))) {
+    printf("  %s: path '%.*s', expected '%s'\n", how,
+           (int)request->path.length, request->path.data, c->path);
+    failures++;
+  }
+  if (result == HTTP_PARSE_ERROR)
+    return failures;
+  if (request->header_count != c->header_count) {
+    printf("  %s: %d headers, expected %d\n", how, request->header_count,
+           c->header_count);
+    failures++;
+  }
+  if (request->content_length != c->content_length) {
+    printf("  %s: Content-Length %lld, expected %lld\n", how,
+           request->content_length, c->content_length);
+    failures++;
+  }
+  if (result == HTTP_PARSE_DONE && http_keep_alive(request) != c->keep_alive) {
+    printf("  %s: keep-alive %d, expected %d\n", how,
+           http_keep_alive(request), c->keep_alive);
+    failures++;
+  }
+  return failures;
+}
+
+int main(void) {
+  int failures = 0;
+  int count = sizeof(cases) / sizeof(cases[0]);
+
+  for (int i = 0; i < count; ++i) {
+    const parser_case *c = &cases[i];
+    size_t length = strlen(c->text);
+    int case_failures = 0;
+    http_request request;
+
+    // The whole request at once
+    http_request_init(&request);
+    enum http_parse_result result =
+        http_parse_request(&request, c->text, length);
+    case_failures += check(c, &request, result, "whole");
+
+    // One byte at a time, as if each recv() brought a single byte
+    http_request_init(&request);
+    result = HTTP_PARSE_INCOMPLETE;
+    for (size_t received = 1;
+         received <= length && result == HTTP_PARSE_INCOMPLETE; ++received)
+      result = http_parse_request(&request, c->text, received);
+    case_failures += check(c, &request, result, "trickled");
+
+    printf("%-28s %s\n", c->name, case_failures ? "FAILED" : "ok");
+    failures += case_failures;
+  }
+
+  // Pipelined requests: the second one starts where the first one ends
+  const char *pipeline = "GET /a HTTP/1.1\r\n\r\n"
+                         "POST /b HTTP/1.1\r\nContent-Length: 2\r\n\r\nhi"
+                         "GET /c HTTP/1.1\r\n\r\n";
+  size_t offset = 0, length = strlen(pipeline);
+  const char *expected_paths[] = {"/a", "/b", "/c"};
+  int pipeline_ok = 1;
+  for (int i = 0; i < 3; ++i) {
+    http_request request;
+    http_request_init(&request);
+    if (http_parse_request(&request, pipeline + offset, length - offset) !=
+            HTTP_PARSE_DONE ||
+        request.path.length != 2 ||
+        memcmp(request.path.data, expected_paths[i], 2))
+      pipeline_ok = 0;
+    offset += http_request_length(&request);
+  }
+  if (offset != length)
+    pipeline_ok = 0;
+  printf("%-28s %s\n", "pipelined requests", pipeline_ok ? "ok" : "FAILED");
+  failures += !pipeline_ok;
+
+  failures += check_headers();
+
+  printf("\n%d failure(s)\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
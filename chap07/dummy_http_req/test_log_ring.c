@@ -0,0 +1,127 @@
+/* test_log_ring.c */
+
+#include "../access_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_SIZE 64
+
+/**
+ * @brief Take everything a ring holds, as the log thread would.
+ *
+ * @param out Receives the bytes, NUL-terminated.
+ * @return The number of bytes taken.
+ */
+static size_t drain(log_ring *ring, char *out) {
+  struct iovec parts[2];
+  size_t held = log_ring_peek(ring, parts);
+  memcpy(out, parts[0].iov_base, parts[0].iov_len);
+  memcpy(out + parts[0].iov_len, parts[1].iov_base, parts[1].iov_len);
+  out[held] = '\0';
+  log_ring_consume(ring, held);
+  return held;
+}
+
+int main(void) {
+  int failures = 0;
+  char data[RING_SIZE];
+  char out[RING_SIZE + 1];
+  log_ring ring;
+
+  // Entries come out in order, whole, as one batch
+  int order_failures = 0;
+  log_ring_init(&ring, data, sizeof(data));
+  struct iovec parts[2];
+  if (log_ring_peek(&ring, parts) != 0)
+    order_failures++;
+  if (!log_ring_append(&ring, "first\n", 6) ||
+      !log_ring_append(&ring, "second\n", 7))
+    order_failures++;
+  if (drain(&ring, out) != 13 || strcmp(out, "first\nsecond\n") != 0)
+    order_failures++;
+  if (log_ring_peek(&ring, parts) != 0)
+    order_failures++;
+  printf("%-28s %s\n", "order", order_failures ? "FAILED" : "ok");
+  failures += order_failures;
+
+  // An entry across the end of the ring comes out in two parts
+  int wrap_failures = 0;
+  log_ring_init(&ring, data, sizeof(data));
+  char filler[RING_SIZE - 10];
+  memset(filler, 'x', sizeof(filler));
+  log_ring_append(&ring, filler, sizeof(filler));
+  drain(&ring, out);
+  log_ring_append(&ring, "0123456789abcdef\n", 17);
+  size_t held = log_ring_peek(&ring, parts);
+  if (held != 17 || parts[0].iov_len != 10 || parts[1].iov_len != 7 ||
+      memcmp(parts[0].iov_base, "0123456789", 10) != 0 ||
+      memcmp(parts[1].iov_base, "abcdef\n", 7) != 0)
+    wrap_failures++;
+  if (drain(&ring, out) != 17 || strcmp(out, "0123456789abcdef\n") != 0)
+    wrap_failures++;
+  printf("%-28s %s\n", "wrap around", wrap_failures ? "FAILED" : "ok");
+  failures += wrap_failures;
+
+  // Entries the ring has no room for are dropped, the others kept, and room
+  // comes back as the consumer takes bytes
+  int full_failures = 0;
+  log_ring_init(&ring, data, sizeof(data));
+  char entry[RING_SIZE / 4];
+  memset(entry, 'a', sizeof(entry));
+  for (int i = 0; i < 4; ++i)
+    if (!log_ring_append(&ring, entry, sizeof(entry)))
+      full_failures++;
+  if (log_ring_append(&ring, "b", 1))
+    full_failures++;
+  log_ring_peek(&ring, parts);
+  log_ring_consume(&ring, sizeof(entry));
+  if (log_ring_append(&ring, entry, sizeof(entry) + 1) ||
+      !log_ring_append(&ring, entry, sizeof(entry)))
+    full_failures++;
+  if (drain(&ring, out) != RING_SIZE)
+    full_failures++;
+  printf("%-28s %s\n", "full ring", full_failures ? "FAILED" : "ok");
+  failures += full_failures;
+
+  // Random entries against what went in, with a consumer taking partial
+  // batches as a short writev() would
+  int random_failures = 0;
+  log_ring_init(&ring, data, sizeof(data));
+  char expected[RING_SIZE * 2];
+  size_t pending = 0;
+  for (int i = 0; i < 100000 && random_failures < 5; ++i) {
+    size_t length = 1 + rand() % 20;
+    char bytes[20];
+    for (size_t j = 0; j < length; ++j)
+      bytes[j] = (char)('a' + rand() % 26);
+    int room = pending + length <= RING_SIZE;
+    if (log_ring_append(&ring, bytes, length) != room)
+      random_failures++;
+    if (room) {
+      memcpy(expected + pending, bytes, length);
+      pending += length;
+    }
+    if (rand() % 3 == 0) {
+      size_t taken = log_ring_peek(&ring, parts);
+      if (taken != pending) {
+        random_failures++;
+        break;
+      }
+      taken = rand() % (taken + 1);
+      size_t first = taken < parts[0].iov_len ? taken : parts[0].iov_len;
+      if (memcmp(parts[0].iov_base, expected, first) != 0 ||
+          memcmp(parts[1].iov_base, expected + first, taken - first) != 0)
+        random_failures++;
+      log_ring_consume(&ring, taken);
+      pending -= taken;
+      memmove(expected, expected + taken, pending);
+    }
+  }
+  printf("%-28s %s\n", "random entries", random_failures ? "FAILED" : "ok");
+  failures += random_failures;
+
+  printf("\n%d failure(s)\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,116 @@
+/* test_scan.c */
+
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 20000
+#define MAX_LENGTH 200
+
+static const char *backend_names[] = {"avx2", "sse2", "scalar"};
+
+static const int sets[] = {
+    SCAN_CR,
+    SCAN_LF,
+    SCAN_CTL,
+    SCAN_SPACE | SCAN_TAB | SCAN_CTL,
+    SCAN_CR | SCAN_LF | SCAN_SPACE | SCAN_COLON,
+    SCAN_COLON,
+};
+
+static const char *needles[] = {"\r\n\r\n", "\r\n", "\n", "Content-Length:",
+                                "HTTP/1.1 200"};
+
+// What scan_delimiters() should return, one byte at a time
+static const char *expected_delimiter(const char *p, const char *end,
+                                      int set) {
+  for (; p < end; ++p) {
+    unsigned char c = *p;
+    if (((set & SCAN_CR) && c == '\r') || ((set & SCAN_LF) && c == '\n') ||
+        ((set & SCAN_SPACE) && c == ' ') || ((set & SCAN_COLON) && c == ':') ||
+        ((set & SCAN_TAB) && c == '\t') ||
+        ((set & SCAN_CTL) && ((c < 0x20 && c != '\t') || c == 0x7f)))
+      return p;
+  }
+  return end;
+}
+
+// What scan_find() should return, one position at a time
+static const char *expected_find(const char *p, const char *end,
+                                 const char *needle, size_t length) {
+  for (; (size_t)(end - p) >= length; ++p)
+    if (memcmp(p, needle, length) == 0)
+      return p;
+  return end;
+}
+
+/**
+ * @brief Fill a buffer with text-like bytes, delimiters and pieces of the
+ * needles, so that matches land anywhere within a block.
+ */
+static void fill(char *buffer, size_t length) {
+  static const char alphabet[] = "abcdefGHIJ-/.0123456789 :\t\r\n\x7f\x01\xe9";
+  for (size_t i = 0; i < length; ++i) {
+    // Mostly plain characters, to leave long runs without a delimiter
+    if (rand() % 8)
+      buffer[i] = alphabet[rand() % 20];
+    else
+      buffer[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+  }
+  if (length > 4 && rand() % 2) {
+    const char *needle = needles[rand() % 5];
+    size_t n = strlen(needle);
+    if (n <= length)
+      memcpy(buffer + rand() % (length - n + 1), needle, n);
+  }
+}
+
+int main(void) {
+  int failures = 0;
+  srand(1);
+
+  for (size_t b = 0; b < sizeof(backend_names) / sizeof(backend_names[0]);
+       ++b) {
+    if (!scan_use(backend_names[b])) {
+      printf("%-28s skipped, not supported\n", backend_names[b]);
+      continue;
+    }
+
+    int backend_failures = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+      // An odd offset so that loads are unaligned
+      char storage[MAX_LENGTH + 1];
+      size_t offset = rand() % 2;
+      size_t length = rand() % (MAX_LENGTH - offset);
+      char *buffer = storage + offset;
+      fill(buffer, length);
+      const char *end = buffer + length;
+
+      for (size_t s = 0; s < sizeof(sets) / sizeof(sets[0]); ++s) {
+        const char *got = scan_delimiters(buffer, end, sets[s]);
+        const char *want = expected_delimiter(buffer, end, sets[s]);
+        if (got != want && backend_failures++ < 5)
+          printf("  %s: delimiters 0x%x in %zu bytes at %td, expected %td\n",
+                 backend_names[b], sets[s], length, got - buffer,
+                 want - buffer);
+      }
+      for (size_t n = 0; n < sizeof(needles) / sizeof(needles[0]); ++n) {
+        size_t needle_length = strlen(needles[n]);
+        const char *got = scan_find(buffer, end, needles[n], needle_length);
+        const char *want =
+            expected_find(buffer, end, needles[n], needle_length);
+        if (got != want && backend_failures++ < 5)
+          printf("  %s: find \"%s\" in %zu bytes at %td, expected %td\n",
+                 backend_names[b], needles[n], length, got - buffer,
+                 want - buffer);
+      }
+    }
+    printf("%-28s %s\n", backend_names[b], backend_failures ? "FAILED" : "ok");
+    failures += backend_failures;
+  }
+
+  printf("\n%d failure(s)\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/* test_timing_wheel.c */
+
+#include "../timing_wheel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIMERS 500
+#define SECONDS 2000
+
+/**
+ * @brief Expire the wheel at a second, and check that exactly the timers
+ * due are returned.
+ *
+ * @param expected The deadline of each timer, 0 if not in the wheel, reset
+ * to 0 for the timers expired.
+ * @return The number of failures.
+ */
+static int expire_at(timing_wheel *wheel, wheel_timer *timers,
+                     time_t *expected, time_t now) {
+  int failures = 0;
+  wheel_timer *timer;
+  while ((timer = timing_wheel_expire(wheel, now))) {
+    int i = (int)(timer - timers);
+    if (!expected[i] || expected[i] > now) {
+      if (failures++ < 5)
+        printf("  timer %d (deadline %lld) expired at %lld\n", i,
+               (long long)expected[i], (long long)now);
+    }
+    if (timer->deadline != 0 && failures++ < 5)
+      printf("  timer %d still in the wheel once expired\n", i);
+    expected[i] = 0;
+  }
+  for (int i = 0; i < TIMERS; ++i)
+    if (expected[i] && expected[i] <= now && failures++ < 5)
+      printf("  timer %d (deadline %lld) not expired at %lld\n", i,
+             (long long)expected[i], (long long)now);
+  return failures;
+}
+
+int main(void) {
+  int failures = 0;
+  static wheel_timer timers[TIMERS];
+  static time_t expected[TIMERS];
+
+  // Timers added, moved and removed at random as the clock ticks, sometimes
+  // jumping ahead by more than a turn of the wheel
+  timing_wheel wheel;
+  memset(&wheel, 0, sizeof(wheel));
+  int random_failures = 0;
+  time_t now = 1000;
+  for (int second = 0; second < SECONDS; ++second) {
+    for (int k = 0; k < 20; ++k) {
+      int i = rand() % TIMERS;
+      if (rand() % 4 == 0) {
+        timing_wheel_remove(&wheel, &timers[i]);
+        expected[i] = 0;
+      } else {
+        expected[i] = now + 1 + rand() % (TIMING_WHEEL_SLOTS - 1);
+        timing_wheel_add(&wheel, &timers[i], expected[i]);
+      }
+    }
+    now += rand() % 50 == 0 ? TIMING_WHEEL_SLOTS + rand() % 100
+                            : rand() % 3;
+    random_failures += expire_at(&wheel, timers, expected, now);
+  }
+  printf("%-28s %s\n", "random deadlines", random_failures ? "FAILED" : "ok");
+  failures += random_failures;
+
+  // A deadline a whole turn ahead lands in the slot just expired: it is due
+  // on the next turn, not before
+  int turn_failures = 0;
+  memset(&wheel, 0, sizeof(wheel));
+  memset(timers, 0, sizeof(timers));
+  memset(expected, 0, sizeof(expected));
+  now = 5000;
+  timing_wheel_expire(&wheel, now);
+  expected[0] = now + TIMING_WHEEL_SLOTS;
+  timing_wheel_add(&wheel, &timers[0], expected[0]);
+  expected[1] = now + 1;
+  timing_wheel_add(&wheel, &timers[1], expected[1]);
+  turn_failures += expire_at(&wheel, timers, expected, now + 1);
+  turn_failures += expire_at(&wheel, timers, expected, expected[0] - 1);
+  if (expected[0] == 0)
+    turn_failures++;
+  turn_failures += expire_at(&wheel, timers, expected, expected[0]);
+  printf("%-28s %s\n", "whole turn", turn_failures ? "FAILED" : "ok");
+  failures += turn_failures;
+
+  // Removing a timer not in the wheel, or twice, is harmless
+  int remove_failures = 0;
+  memset(&wheel, 0, sizeof(wheel));
+  memset(timers, 0, sizeof(timers));
+  timing_wheel_remove(&wheel, &timers[0]);
+  timing_wheel_add(&wheel, &timers[0], 100);
+  timing_wheel_add(&wheel, &timers[1], 100);
+  timing_wheel_remove(&wheel, &timers[0]);
+  timing_wheel_remove(&wheel, &timers[0]);
+  if (timing_wheel_expire(&wheel, 100) != &timers[1] ||
+      timing_wheel_expire(&wheel, 100) != NULL)
+    remove_failures++;
+  printf("%-28s %s\n", "removals", remove_failures ? "FAILED" : "ok");
+  failures += remove_failures;
+
+  printf("\n%d failure(s)\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
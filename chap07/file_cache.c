@@ -0,0 +1,580 @@
+/* file_cache.c */
+
+#include "file_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <sys/inotify.h>
+#endif
+
+// clang-format off
+const content_coding codings[ENCODING_BR + 1] = {
+  [ENCODING_IDENTITY] = {"identity", "", "",
+                         "Vary: Accept-Encoding\r\n"},
+  [ENCODING_GZIP]     = {"gzip", ".gz", "-gz",
+                         "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"},
+  [ENCODING_BR]       = {"br", ".br", "-br",
+                         "Content-Encoding: br\r\nVary: Accept-Encoding\r\n"},
+};
+// clang-format on
+
+// A directory holding cached files, or directories that do, so that a change
+// to a directory evicts the entries below it without a look at the others.
+// Directories go away with their last entry.
+typedef struct cache_directory {
+  char path[128];
+  size_t length;
+  unsigned hash; // Hash of path
+  struct cache_directory *parent; // NULL at the top
+  struct cache_directory *bucket_next;
+  struct cache_directory *children; // Linked by their sibling links
+  struct cache_directory *next_sibling;
+  struct cache_directory *prev_sibling;
+  cache_entry *files; // Linked by their directory links
+} cache_directory;
+
+static void remove_entry(file_cache *cache, cache_entry *entry);
+static void evict_path(file_cache *cache, const char *path, size_t length);
+static cache_directory *find_directory(file_cache *cache, const char *path,
+                                       size_t length);
+static cache_directory *add_directory(file_cache *cache, const char *path,
+                                      size_t length);
+static void evict_tree(file_cache *cache, cache_directory *directory);
+static void prune_directory(file_cache *cache, cache_directory *directory);
+#if defined(__linux__)
+static int watch_tree(file_cache *cache, const char *path);
+#endif
+
+/**
+ * @brief Hash a path for the file cache (FNV-1a).
+ *
+ * @param path The path, NUL-terminated or not.
+ * @param length The length of the path.
+ * @return The hash of path.
+ */
+static unsigned hash_path(const char *path, size_t length) {
+  unsigned hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (unsigned char)path[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief Free an entry out of the cache that nothing refers to anymore.
+ *
+ * @param entry The entry.
+ */
+static void free_entry(cache_entry *entry) {
+  free(entry->body);
+  if (entry->file >= 0)
+    close(entry->file);
+  free(entry);
+}
+
+/**
+ * @brief Find a file in the cache and make it the most recently used.
+ *
+ * The entry is returned whether or not it is still trusted: it is up to the
+ * caller to check it against the disk once it has been held for too long.
+ *
+ * @param cache The cache.
+ * @param path The path of the file, as passed to open().
+ * @param encoding The coding the file is wanted with.
+ * @return The cache entry, or NULL if the file is not cached.
+ */
+cache_entry *file_cache_find(file_cache *cache, const char *path,
+                             enum content_encoding encoding) {
+  unsigned hash = hash_path(path, strlen(path));
+  cache_entry *entry = cache->buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+  while (entry && (entry->hash != hash || entry->encoding != encoding ||
+                   strcmp(entry->path, path)))
+    entry = entry->bucket_next;
+  if (!entry)
+    return NULL;
+
+  // Move the entry to the front of the LRU list
+  if (entry != cache->newest) {
+    entry->newer->older = entry->older;
+    if (entry->older)
+      entry->older->newer = entry->newer;
+    else
+      cache->oldest = entry->newer;
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    cache->newest->newer = entry;
+    cache->newest = entry;
+  }
+  return entry;
+}
+
+/**
+ * @brief Add a new entry to the cache, as the most recently used.
+ *
+ * Least recently used entries are evicted until the file fits in
+ * FILE_CACHE_BUDGET, or, for a file kept open, until fewer than
+ * FILE_CACHE_DESCRIPTORS are.
+ *
+ * @param cache The cache.
+ * @param entry The entry, allocated with malloc(), whose path, encoding,
+ * body, file and size are set, taken over by the cache. Its body, if any,
+ * is no larger than FILE_CACHE_BUDGET.
+ */
+void file_cache_insert(file_cache *cache, cache_entry *entry) {
+  size_t length = strlen(entry->path);
+  entry->hash = hash_path(entry->path, length);
+  if (entry->body) {
+    while (cache->oldest && cache->used + entry->size > FILE_CACHE_BUDGET)
+      file_cache_evict(cache, cache->oldest);
+    cache->used += entry->size;
+  } else {
+    cache_entry *oldest = cache->oldest;
+    while (cache->descriptors == FILE_CACHE_DESCRIPTORS) {
+      while (oldest->file < 0)
+        oldest = oldest->newer;
+      cache_entry *newer = oldest->newer;
+      file_cache_evict(cache, oldest);
+      oldest = newer;
+    }
+    cache->descriptors++;
+  }
+
+  cache_entry **bucket =
+      &cache->buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+  entry->bucket_next = *bucket;
+  *bucket = entry;
+  entry->newer = NULL;
+  entry->older = cache->newest;
+  if (cache->newest)
+    cache->newest->newer = entry;
+  else
+    cache->oldest = entry;
+  cache->newest = entry;
+  entry->cached = 1;
+
+  const char *slash = strrchr(entry->path, '/');
+  cache_directory *directory =
+      add_directory(cache, entry->path, slash ? slash - entry->path : 0);
+  entry->directory = directory;
+  entry->directory_prev = NULL;
+  entry->directory_next = directory->files;
+  if (directory->files)
+    directory->files->directory_prev = entry;
+  directory->files = entry;
+}
+
+/**
+ * @brief Remove an entry from the cache.
+ *
+ * The entry is freed once no write queue refers to it anymore.
+ *
+ * @param cache The cache.
+ * @param entry An entry in the cache.
+ */
+void file_cache_evict(file_cache *cache, cache_entry *entry) {
+  cache_directory *directory = entry->directory;
+  remove_entry(cache, entry);
+  prune_directory(cache, directory);
+}
+
+/**
+ * @brief Unlink an entry from the cache, leaving its directory behind even
+ * if it is left empty.
+ *
+ * @param cache The cache.
+ * @param entry An entry in the cache.
+ */
+static void remove_entry(file_cache *cache, cache_entry *entry) {
+  cache_entry **link =
+      &cache->buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+  while (*link != entry)
+    link = &(*link)->bucket_next;
+  *link = entry->bucket_next;
+
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    cache->newest = entry->older;
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    cache->oldest = entry->newer;
+
+  if (entry->directory_next)
+    entry->directory_next->directory_prev = entry->directory_prev;
+  if (entry->directory_prev)
+    entry->directory_prev->directory_next = entry->directory_next;
+  else
+    entry->directory->files = entry->directory_next;
+
+  if (entry->body)
+    cache->used -= entry->size;
+  else
+    cache->descriptors--;
+  entry->cached = 0;
+  if (entry->references == 0)
+    free_entry(entry);
+}
+
+/**
+ * @brief Drop a reference taken on an entry by a write queue.
+ *
+ * @param entry A cache entry, possibly already evicted.
+ */
+void file_cache_release(cache_entry *entry) {
+  if (--entry->references == 0 && !entry->cached)
+    free_entry(entry);
+}
+
+/**
+ * @brief Evict the cache entries a change to a path may have made stale.
+ *
+ * Those are the entries of the path, in any coding, those of the files below
+ * it if it is a directory, and those of the file it is the br or gzip sibling
+ * of, since a preferred sibling may have appeared. They are found through
+ * the hash tables, whatever else the cache holds.
+ *
+ * @param cache The cache.
+ * @param path The path changed.
+ */
+void file_cache_forget(file_cache *cache, const char *path) {
+  size_t length = strlen(path);
+  evict_path(cache, path, length);
+  for (int i = ENCODING_GZIP; i <= ENCODING_BR; ++i) {
+    size_t suffix = strlen(codings[i].suffix);
+    if (length > suffix &&
+        strcmp(path + length - suffix, codings[i].suffix) == 0)
+      evict_path(cache, path, length - suffix);
+  }
+
+  cache_directory *directory = find_directory(cache, path, length);
+  if (directory) {
+    evict_tree(cache, directory);
+    prune_directory(cache, directory);
+  }
+}
+
+/**
+ * @brief Evict the entries of a file, in every coding.
+ *
+ * @param cache The cache.
+ * @param path The path of the file, NUL-terminated or not.
+ * @param length The length of the path.
+ */
+static void evict_path(file_cache *cache, const char *path, size_t length) {
+  unsigned hash = hash_path(path, length);
+  cache_entry *entry = cache->buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+  while (entry) {
+    cache_entry *next = entry->bucket_next;
+    if (entry->hash == hash && strncmp(entry->path, path, length) == 0 &&
+        entry->path[length] == 0)
+      file_cache_evict(cache, entry);
+    entry = next;
+  }
+}
+
+/**
+ * @brief Find the directory of the cache with the given path.
+ *
+ * @param cache The cache.
+ * @param path The path, NUL-terminated or not.
+ * @param length The length of the path.
+ * @return The directory, or NULL if no cached file is below it.
+ */
+static cache_directory *find_directory(file_cache *cache, const char *path,
+                                       size_t length) {
+  unsigned hash = hash_path(path, length);
+  cache_directory *directory =
+      cache->directories[hash & (FILE_CACHE_BUCKETS - 1)];
+  while (directory &&
+         (directory->hash != hash || directory->length != length ||
+          memcmp(directory->path, path, length) != 0))
+    directory = directory->bucket_next;
+  return directory;
+}
+
+/**
+ * @brief Find a directory of the cache, or add it along with its parents.
+ *
+ * @param cache The cache.
+ * @param path The path, NUL-terminated or not, shorter than the paths of the
+ * entries.
+ * @param length The length of the path.
+ * @return The directory.
+ */
+static cache_directory *add_directory(file_cache *cache, const char *path,
+                                      size_t length) {
+  cache_directory *directory = find_directory(cache, path, length);
+  if (directory)
+    return directory;
+
+  directory = (cache_directory *)calloc(1, sizeof(cache_directory));
+  if (!directory) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(directory->path, path, length);
+  directory->length = length;
+  directory->hash = hash_path(path, length);
+  cache_directory **bucket =
+      &cache->directories[directory->hash & (FILE_CACHE_BUCKETS - 1)];
+  directory->bucket_next = *bucket;
+  *bucket = directory;
+
+  size_t parent_length = length;
+  while (parent_length > 0 && path[parent_length - 1] != '/')
+    parent_length--;
+  if (parent_length > 0) {
+    cache_directory *parent = add_directory(cache, path, parent_length - 1);
+    directory->parent = parent;
+    directory->next_sibling = parent->children;
+    if (parent->children)
+      parent->children->prev_sibling = directory;
+    parent->children = directory;
+  }
+  return directory;
+}
+
+/**
+ * @brief Evict the entries of the files below a directory.
+ *
+ * The directories below it are freed, while the directory itself is left
+ * for prune_directory().
+ *
+ * @param cache The cache.
+ * @param directory The directory.
+ */
+static void evict_tree(file_cache *cache, cache_directory *directory) {
+  while (directory->files)
+    remove_entry(cache, directory->files);
+  while (directory->children) {
+    cache_directory *child = directory->children;
+    evict_tree(cache, child);
+    directory->children = child->next_sibling;
+    if (child->next_sibling)
+      child->next_sibling->prev_sibling = NULL;
+    child->parent = NULL;
+    prune_directory(cache, child);
+  }
+}
+
+/**
+ * @brief Free a directory left without files, and its parents left empty.
+ *
+ * @param cache The cache.
+ * @param directory The directory.
+ */
+static void prune_directory(file_cache *cache, cache_directory *directory) {
+  while (directory && !directory->files && !directory->children) {
+    cache_directory **link =
+        &cache->directories[directory->hash & (FILE_CACHE_BUCKETS - 1)];
+    while (*link != directory)
+      link = &(*link)->bucket_next;
+    *link = directory->bucket_next;
+
+    cache_directory *parent = directory->parent;
+    if (directory->next_sibling)
+      directory->next_sibling->prev_sibling = directory->prev_sibling;
+    if (directory->prev_sibling)
+      directory->prev_sibling->next_sibling = directory->next_sibling;
+    else if (parent)
+      parent->children = directory->next_sibling;
+    free(directory);
+    directory = parent;
+  }
+}
+
+#if defined(__linux__)
+/**
+ * @brief Start watching a directory for changes, if inotify lets us.
+ *
+ * Every directory below it is watched: inotify does not watch a tree as a
+ * whole. If one of them cannot be, changes there would go unseen, so
+ * nothing is watched, and watch_fd is left to -1.
+ *
+ * @param cache The cache, not watching anything yet.
+ * @param root The directory the files are served from.
+ * @param now The current time.
+ */
+void file_cache_watch(file_cache *cache, const char *root, time_t now) {
+  cache->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cache->watch_fd < 0) {
+    fprintf(stderr, "inotify_init1() failed. (%d)\n", errno);
+    return;
+  }
+  if (!watch_tree(cache, root) || cache->watch_count == 0) {
+    file_cache_unwatch(cache);
+    return;
+  }
+  cache->root = root;
+  cache->routes = path_tree_build(root);
+  cache->routes_built = now;
+}
+
+/**
+ * @brief Watch a directory and the directories below it.
+ *
+ * Symbolic links are not followed: the files they lead to are still served,
+ * but their entries have to be checked against the disk now and then.
+ *
+ * @param cache The cache.
+ * @param path The path of the directory, as in the paths of the entries.
+ * @return 1 on success, 0 if the directory could not be watched.
+ */
+static int watch_tree(file_cache *cache, const char *path) {
+  file_watch *watches = cache->watches;
+  if (cache->watch_count == FILE_WATCHES ||
+      strlen(path) >= sizeof(watches[0].path))
+    return 0;
+  int wd = inotify_add_watch(
+      cache->watch_fd, path,
+      IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF |
+          IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO |
+          IN_ONLYDIR | IN_DONT_FOLLOW);
+  // A directory gone already has nothing left to watch
+  if (wd < 0 && (errno == ENOENT || errno == ENOTDIR))
+    return 1;
+  if (wd < 0) {
+    fprintf(stderr, "inotify_add_watch() failed. (%d)\n", errno);
+    return 0;
+  }
+  watches[cache->watch_count].wd = wd;
+  strcpy(watches[cache->watch_count++].path, path);
+
+  DIR *dir = opendir(path);
+  if (!dir)
+    return errno == ENOENT || errno == ENOTDIR;
+  struct dirent *child;
+  int watched = 1;
+  while (watched && (child = readdir(dir))) {
+    if (strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0)
+      continue;
+    char child_path[sizeof(watches[0].path)];
+    if (snprintf(child_path, sizeof(child_path), "%s/%s", path,
+                 child->d_name) >= (int)sizeof(child_path))
+      continue; // Too long to be cached anyway
+    struct stat child_stat;
+    if (child->d_type == DT_DIR ||
+        (child->d_type == DT_UNKNOWN && lstat(child_path, &child_stat) == 0 &&
+         S_ISDIR(child_stat.st_mode)))
+      watched = watch_tree(cache, child_path);
+  }
+  closedir(dir);
+  return watched;
+}
+
+/**
+ * @brief Stop watching for changes, for good.
+ *
+ * The cached files are no longer trusted to be reported changed. Whoever
+ * polls watch_fd must stop before, since it is closed.
+ *
+ * @param cache The cache.
+ */
+void file_cache_unwatch(file_cache *cache) {
+  close(cache->watch_fd);
+  cache->watch_fd = -1;
+  cache->watch_count = 0;
+  for (cache_entry *entry = cache->newest; entry; entry = entry->older)
+    entry->watched = 0;
+  path_tree_free(cache->routes);
+  cache->routes = NULL;
+}
+
+/**
+ * @brief Evict the cache entries of the files reported changed.
+ *
+ * If events were lost, every entry is evicted. Files or directories that
+ * appeared or went away leave the tree of routes stale.
+ *
+ * @param cache The cache, watching for changes.
+ * @return 0 on success, -1 if changes can no longer be watched, in which
+ * case the caller is to stop polling watch_fd and call file_cache_unwatch().
+ */
+int file_cache_read_events(file_cache *cache) {
+  // Aligned as the events it holds
+  union {
+    struct inotify_event event;
+    char bytes[4096];
+  } buffer;
+
+  file_watch *watches = cache->watches;
+  ssize_t length;
+  while ((length = read(cache->watch_fd, buffer.bytes, sizeof(buffer))) > 0) {
+    cache->events++;
+    for (char *next = buffer.bytes; next < buffer.bytes + length;) {
+      struct inotify_event *event = (struct inotify_event *)next;
+      next += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        while (cache->oldest)
+          file_cache_evict(cache, cache->oldest);
+        cache->routes_stale = 1;
+        continue;
+      }
+      int i = 0;
+      while (i < cache->watch_count && watches[i].wd != event->wd)
+        i++;
+      if (i == cache->watch_count)
+        continue;
+      if ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) &&
+          strcmp(watches[i].path, cache->root) == 0)
+        return -1; // Whatever takes the place of the root would go unwatched
+      if (event->mask & IN_IGNORED) {
+        watches[i] = watches[--cache->watch_count];
+        continue;
+      }
+      if (!event->len)
+        continue;
+
+      char path[sizeof(watches[0].path)];
+      if (snprintf(path, sizeof(path), "%s/%s", watches[i].path,
+                   event->name) >= (int)sizeof(path))
+        continue;
+      file_cache_forget(cache, path);
+      if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+        cache->routes_stale = 1;
+      if ((event->mask & IN_ISDIR) &&
+          (event->mask & (IN_CREATE | IN_MOVED_TO)) &&
+          !watch_tree(cache, path))
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Tell what a path below the root leads to, as far as is known.
+ *
+ * The tree of routes is built again if files came or went since it was,
+ * unless it already was this second: until then, paths are looked for on
+ * disk.
+ *
+ * @param cache The cache.
+ * @param path The normalized path below the root.
+ * @param now The current time.
+ * @return What the tree holds for the path, PATH_UNKNOWN if the root is not
+ * watched or the tree is stale.
+ */
+enum path_kind file_cache_find_route(file_cache *cache, const char *path,
+                                     time_t now) {
+  if (cache->watch_fd < 0)
+    return PATH_UNKNOWN;
+  if (cache->routes_stale && now != cache->routes_built) {
+    path_tree_free(cache->routes);
+    cache->routes = path_tree_build(cache->root);
+    cache->routes_built = now;
+    cache->routes_stale = 0;
+  }
+  if (cache->routes_stale || !cache->routes)
+    return PATH_UNKNOWN;
+  return path_tree_lookup(cache->routes, path, strlen(path));
+}
+#endif
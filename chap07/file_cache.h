@@ -0,0 +1,132 @@
+/* file_cache.h */
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include "http_parser.h"
+#include "mime_types.h"
+#include "path_tree.h"
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Bytes of file content the file cache may hold in total
+#define FILE_CACHE_BUDGET (64 * 1024 * 1024)
+// Number of hash buckets of the file cache, a power of two
+#define FILE_CACHE_BUCKETS 1024
+// Most files too large to hold that the cache keeps open, to send from disk
+#define FILE_CACHE_DESCRIPTORS 256
+// Most directories watched for changes, past which none are
+#define FILE_WATCHES 1024
+
+// Content codings a file may be sent with. With --compress, compressible
+// types are sent gzip or br encoded to the clients that accept it.
+enum content_encoding { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_BR };
+
+typedef struct content_coding {
+  const char *name;   // As listed in Accept-Encoding
+  const char *suffix; // Of precompressed siblings, as in foo.css.gz
+  const char *etag;   // Appended to the ETag, so that each coding has its own
+  const char *header; // Lines describing the coding of a negotiated type
+} content_coding;
+
+extern const content_coding codings[ENCODING_BR + 1];
+
+// Identity and version of a file on disk, which tell whether it has been
+// replaced or modified since it was read
+typedef struct file_version {
+  dev_t device;
+  ino_t inode;
+  time_t mtime;
+  off_t size;
+} file_version;
+
+// Headers identifying the version of a file, which conditional and range
+// requests are checked against
+typedef struct file_validators {
+  char text[128]; // ETag and Last-Modified header lines
+  int length;
+  http_slice etag;          // Quoted ETag, within text
+  http_slice last_modified; // Date of Last-Modified, within text
+} file_validators;
+
+struct cache_directory;
+
+// A file held in memory, or kept open if too large, along with the headers
+// describing it. Entries are reference counted since an evicted entry may
+// still be in the middle of being sent to slow clients.
+typedef struct cache_entry {
+  char path[128];        // Key: the path of the file, as passed to open()
+  enum content_encoding encoding; // Key: the coding body is sent with
+  unsigned hash;         // Hash of path
+  char *body;            // Content of the file, encoded, or NULL
+  int file;              // The open file if body is NULL, or -1
+  off_t size;            // Size of body, or of the file
+  const mime_type *type;
+  char header[384]; // Headers following the status and Connection lines
+  int header_length;
+  file_validators validators;
+  file_version version; // Of the file body was read, or compressed, from
+  time_t checked;  // Last time the file was checked against the disk
+  int watched;     // Whether inotify has reported its changes since
+  int references;  // Write queues sending body
+  int cached;      // Whether the entry is still in the cache
+  struct cache_entry *bucket_next;
+  struct cache_entry *newer; // LRU list links
+  struct cache_entry *older;
+  struct cache_directory *directory;  // Where the file is
+  struct cache_entry *directory_next; // Links in the files of directory
+  struct cache_entry *directory_prev;
+} cache_entry;
+
+// A directory watched with inotify
+typedef struct file_watch {
+  int wd;
+  char path[128]; // As in the paths of the cache entries
+} file_watch;
+
+// Hash table of the cached files, also linked from the most to the least
+// recently used, and from the directories they are in, which are hashed
+// too, so that a change only ever looks at the entries it concerns.
+// Changes to the directory the files are served from are reported through
+// watch_fd, the entries they concern being evicted right away, so that hot
+// files need not be checked against the disk every second.
+typedef struct file_cache {
+  cache_entry *buckets[FILE_CACHE_BUCKETS];
+  struct cache_directory *directories[FILE_CACHE_BUCKETS];
+  cache_entry *newest;
+  cache_entry *oldest;
+  size_t used;     // Bytes of file content cached
+  int descriptors; // Files kept open
+  int watch_fd;    // Unused while -1
+  file_watch watches[FILE_WATCHES];
+  int watch_count;
+  // Changes reported so far, so that file jobs tell whether their file may
+  // have changed while they ran
+  unsigned events;
+  // What is below the directory, while it is watched, so that files that
+  // are not there are not looked for on disk. Changes leave it stale until
+  // it is built again, at most once a second.
+  const char *root;
+  path_tree *routes;
+  int routes_stale;
+  time_t routes_built;
+} file_cache;
+
+cache_entry *file_cache_find(file_cache *cache, const char *path,
+                             enum content_encoding encoding);
+void file_cache_insert(file_cache *cache, cache_entry *entry);
+void file_cache_evict(file_cache *cache, cache_entry *entry);
+void file_cache_release(cache_entry *entry);
+void file_cache_forget(file_cache *cache, const char *path);
+#if defined(__linux__)
+void file_cache_watch(file_cache *cache, const char *root, time_t now);
+void file_cache_unwatch(file_cache *cache);
+int file_cache_read_events(file_cache *cache);
+enum path_kind file_cache_find_route(file_cache *cache, const char *path,
+                                     time_t now);
+#endif
+
+#endif
@@ -0,0 +1,670 @@
+/* http_parser.c */
+
+#include "http_parser.h"
+#include "scan.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// Where http_parse_request() stands in the request
+enum parse_state {
+  S_METHOD,
+  S_PATH,
+  S_VERSION,
+  S_REQUEST_LINE_LF,
+  S_HEADER_START,
+  S_HEADER_NAME,
+  S_HEADER_VALUE_START,
+  S_HEADER_VALUE,
+  S_HEADER_LF,
+  S_HEADERS_LF,
+  S_BODY,
+  S_DONE,
+  S_ERROR
+};
+
+// Content-Length values past this are rejected rather than risking overflow
+#define MAX_CONTENT_LENGTH 1000000000000000LL
+
+// Character classes, indexed by byte value
+#define C_TOKEN 1 // May appear in a method or a header name ("tchar")
+#define C_PATH 2  // May appear in a request target: visible, not a space
+
+static unsigned char char_class[256];
+
+/**
+ * @brief Fill in char_class on first use.
+ *
+ * Scanning runs of characters through a table keeps the inner loops of the
+ * parser down to a load and a test per byte.
+ */
+static void init_char_class(void) {
+  static int initialized = 0;
+  if (initialized)
+    return;
+
+  for (int c = 0; c < 256; ++c) {
+    int token = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') ||
+                (c && strchr("!#$%&'*+-.^_`|~", c) != NULL);
+    int visible = (c > 0x20 && c != 0x7f);
+    char_class[c] = (token ? C_TOKEN : 0) | (visible ? C_PATH : 0);
+  }
+  initialized = 1;
+}
+
+// Advance i past the characters of a class, up to length
+#define SKIP_CLASS(buffer, i, length, class)                                   \
+  while ((i) < (length) && (char_class[(unsigned char)(buffer)[i]] & (class))) \
+  ++(i)
+
+static char to_lower(char c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+static http_slice make_slice(const char *buffer, size_t start, size_t end) {
+  http_slice slice = {buffer + start, end - start};
+  return slice;
+}
+
+// Methods are case-sensitive, unlike header names
+static enum http_method method_of(http_slice name) {
+  if (name.length == 3 && memcmp(name.data, "GET", 3) == 0)
+    return HTTP_GET;
+  if (name.length == 4 && memcmp(name.data, "HEAD", 4) == 0)
+    return HTTP_HEAD;
+  if (name.length == 4 && memcmp(name.data, "POST", 4) == 0)
+    return HTTP_POST;
+  return HTTP_OTHER;
+}
+
+static enum http_parse_result fail(http_request *request, size_t offset) {
+  request->state = S_ERROR;
+  request->offset = offset;
+  return HTTP_PARSE_ERROR;
+}
+
+/**
+ * @brief Check the header just parsed for the ones that frame the body.
+ *
+ * @param request The request being parsed.
+ * @param header The header.
+ * @return 1 if the header is acceptable, 0 if the request must be rejected.
+ */
+static int check_header(http_request *request, const http_header *header) {
+  // Most headers are told apart by their length alone
+  if (header->name.length != 14 && header->name.length != 17)
+    return 1;
+
+  if (http_slice_equals(header->name, "Content-Length")) {
+    if (header->value.length == 0)
+      return 0;
+    long long value = 0;
+    for (size_t i = 0; i < header->value.length; ++i) {
+      char c = header->value.data[i];
+      if (c < '0' || c > '9' || value > MAX_CONTENT_LENGTH / 10)
+        return 0;
+      value = value * 10 + (c - '0');
+    }
+    // Repeated Content-Length headers must agree
+    if (request->content_length >= 0 && request->content_length != value)
+      return 0;
+    request->content_length = value;
+  } else if (http_slice_equals(header->name, "Transfer-Encoding")) {
+    return 0; // Chunked bodies are not supported
+  }
+  return 1;
+}
+
+/**
+ * @brief Reset a request before parsing a new one.
+ *
+ * @param request The request to reset.
+ */
+void http_request_init(http_request *request) {
+  // Everything but the headers array, only read up to header_count
+  memset(request, 0, offsetof(http_request, headers));
+  request->header_count = 0;
+  request->header_length = 0;
+  request->content_length = -1;
+  request->body.data = NULL;
+  request->body.length = 0;
+  request->state = S_METHOD;
+}
+
+/**
+ * @brief Parse as much of a request as has been received.
+ *
+ * The parser is a state machine that resumes where the previous call left
+ * off, so each byte is looked at once however the request is split across
+ * recv() calls. The request line and header lines end with CRLF. Method,
+ * path, version and headers are returned as slices of buffer. A body is
+ * expected only if there is a Content-Length header.
+ *
+ * Once the request is complete, bytes past http_request_length() belong to
+ * the next request and are left alone.
+ *
+ * @param request The request, initialized with http_request_init() before
+ * the first call.
+ * @param buffer The bytes received so far, from the start of the request.
+ * @param length The number of bytes in buffer.
+ * @return Whether the request is complete, incomplete or invalid.
+ */
+enum http_parse_result http_parse_request(http_request *request,
+                                          const char *buffer, size_t length) {
+  size_t i = request->offset;
+  init_char_class();
+
+  // Each state consumes as many bytes as it can before handing over, so runs
+  // of plain characters are skipped in tight loops.
+  while (i < length && request->state < S_BODY) {
+    switch (request->state) {
+    case S_METHOD:
+      SKIP_CLASS(buffer, i, length, C_TOKEN);
+      if (i == length)
+        break;
+      if (buffer[i] != ' ' || i == request->mark)
+        return fail(request, i);
+      request->method_name = make_slice(buffer, request->mark, i);
+      request->method = method_of(request->method_name);
+      request->mark = ++i;
+      request->state = S_PATH;
+      break;
+
+    case S_PATH:
+      // Paths and header values are the long runs, scanned a block at a time
+      i = scan_delimiters(buffer + i, buffer + length,
+                          SCAN_SPACE | SCAN_TAB | SCAN_CTL) -
+          buffer;
+      if (i == length)
+        break;
+      if (buffer[i] != ' ' || i == request->mark)
+        return fail(request, i);
+      request->path = make_slice(buffer, request->mark, i);
+      request->mark = ++i;
+      request->state = S_VERSION;
+      break;
+
+    case S_VERSION:
+      SKIP_CLASS(buffer, i, length, C_PATH);
+      if (i - request->mark > 8)
+        return fail(request, i);
+      if (i == length)
+        break;
+      request->version = make_slice(buffer, request->mark, i);
+      const char *v = request->version.data;
+      if (buffer[i] != '\r' || request->version.length != 8 ||
+          memcmp(v, "HTTP/1.", 7) || v[7] < '0' || v[7] > '9')
+        return fail(request, i);
+      request->minor_version = v[7] - '0';
+      ++i;
+      request->state = S_REQUEST_LINE_LF;
+      break;
+
+    case S_REQUEST_LINE_LF:
+      if (buffer[i++] != '\n')
+        return fail(request, i - 1);
+      request->state = S_HEADER_START;
+      break;
+
+    case S_HEADER_START:
+      if (buffer[i] == '\r') {
+        ++i;
+        request->state = S_HEADERS_LF;
+        break;
+      }
+      // Anything else than a header name, obsolete line folding included
+      if (!(char_class[(unsigned char)buffer[i]] & C_TOKEN) ||
+          request->header_count == HTTP_MAX_HEADERS)
+        return fail(request, i);
+      request->mark = i;
+      request->state = S_HEADER_NAME;
+      break;
+
+    case S_HEADER_NAME:
+      SKIP_CLASS(buffer, i, length, C_TOKEN);
+      if (i == length)
+        break;
+      if (buffer[i] != ':')
+        return fail(request, i);
+      request->headers[request->header_count].name =
+          make_slice(buffer, request->mark, i);
+      ++i;
+      request->state = S_HEADER_VALUE_START;
+      break;
+
+    case S_HEADER_VALUE_START:
+      while (i < length && (buffer[i] == ' ' || buffer[i] == '\t'))
+        ++i;
+      if (i == length)
+        break;
+      request->mark = i;
+      request->state = S_HEADER_VALUE;
+      break;
+
+    case S_HEADER_VALUE:
+      i = scan_delimiters(buffer + i, buffer + length, SCAN_CTL) - buffer;
+      if (i == length)
+        break;
+      if (buffer[i] != '\r')
+        return fail(request, i);
+      size_t end = i;
+      while (end > request->mark &&
+             (buffer[end - 1] == ' ' || buffer[end - 1] == '\t'))
+        --end;
+      request->headers[request->header_count].value =
+          make_slice(buffer, request->mark, end);
+      ++i;
+      request->state = S_HEADER_LF;
+      break;
+
+    case S_HEADER_LF:
+      if (buffer[i] != '\n' ||
+          !check_header(request, &request->headers[request->header_count]))
+        return fail(request, i);
+      ++i;
+      request->header_count++;
+      request->state = S_HEADER_START;
+      break;
+
+    case S_HEADERS_LF:
+      if (buffer[i] != '\n')
+        return fail(request, i);
+      request->header_length = ++i;
+      request->state = request->content_length > 0 ? S_BODY : S_DONE;
+      break;
+    }
+  }
+  request->offset = i;
+
+  if (request->state == S_BODY &&
+      (long long)(length - request->header_length) >=
+          request->content_length)
+    request->state = S_DONE;
+
+  if (request->state == S_DONE) {
+    request->body = make_slice(buffer, request->header_length,
+                               http_request_length(request));
+    return HTTP_PARSE_DONE;
+  }
+  return request->state == S_ERROR ? HTTP_PARSE_ERROR : HTTP_PARSE_INCOMPLETE;
+}
+
+/**
+ * @brief Return the size of a complete request, body included.
+ *
+ * @param request A request for which http_parse_request() returned
+ * HTTP_PARSE_DONE.
+ * @return The offset of the next request in the buffer.
+ */
+size_t http_request_length(const http_request *request) {
+  size_t length = request->header_length;
+  if (request->content_length > 0)
+    length += request->content_length;
+  return length;
+}
+
+/**
+ * @brief Find the first header with a given name.
+ *
+ * @param request A parsed request.
+ * @param name The header name, compared regardless of case.
+ * @return The value of the header, or NULL if the request does not have it.
+ */
+const http_slice *http_find_header(const http_request *request,
+                                   const char *name) {
+  for (int i = 0; i < request->header_count; ++i)
+    if (http_slice_equals(request->headers[i].name, name))
+      return &request->headers[i].value;
+  return NULL;
+}
+
+/**
+ * @brief Compare a slice with a string regardless of case.
+ *
+ * @param slice The slice.
+ * @param text A NUL-terminated string.
+ * @return Nonzero if both hold the same characters, case aside.
+ */
+int http_slice_equals(http_slice slice, const char *text) {
+  size_t i = 0;
+  for (; i < slice.length; ++i)
+    if (!text[i] || to_lower(slice.data[i]) != to_lower(text[i]))
+      return 0;
+  return text[i] == 0;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c = to_lower(c);
+  return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/**
+ * @brief Turn a request target into the path of the resource, in one pass.
+ *
+ * The query and fragment are dropped, percent-encoded bytes are decoded,
+ * repeated slashes are collapsed and "." and ".." segments are removed, as
+ * RFC 3986 does. Dot segments are recognized once decoded, so that "%2e%2e"
+ * cannot climb out of the root any more than ".." can. An encoded slash
+ * separates segments like a plain one.
+ *
+ * @param target The request target, starting with '/'.
+ * @param path Receives the path, NUL-terminated, starting with '/'.
+ * @param size The size of path.
+ * @return The length of the path, or -1 if the target is malformed, decodes
+ * to control characters, climbs above the root or does not fit in path.
+ */
+int http_normalize_path(http_slice target, char *path, size_t size) {
+  if (target.length == 0 || target.data[0] != '/' || size < 2)
+    return -1;
+
+  size_t length = 1;
+  size_t segment = 1; // Where the last segment of path starts
+  path[0] = '/';
+  for (size_t i = 1;; ++i) {
+    int end = i == target.length || target.data[i] == '?' ||
+              target.data[i] == '#';
+    unsigned char c = end ? '/' : (unsigned char)target.data[i];
+    if (c == '%') {
+      int high, low;
+      if (i + 2 >= target.length ||
+          (high = hex_digit(target.data[i + 1])) < 0 ||
+          (low = hex_digit(target.data[i + 2])) < 0)
+        return -1;
+      c = (unsigned char)(high << 4 | low);
+      i += 2;
+    }
+    if (c < 0x20 || c == 0x7f)
+      return -1;
+
+    if (c != '/') {
+      if (length == size - 1)
+        return -1;
+      path[length++] = (char)c;
+      continue;
+    }
+
+    // A segment ends: drop it if it is a dot segment, keep it otherwise
+    size_t segment_length = length - segment;
+    if (segment_length == 1 && path[segment] == '.') {
+      length = segment;
+    } else if (segment_length == 2 && path[segment] == '.' &&
+               path[segment + 1] == '.') {
+      if (segment == 1)
+        return -1;
+      length = segment - 1;
+      while (path[length - 1] != '/')
+        --length;
+      segment = length;
+    } else if (segment_length && !end) {
+      if (length == size - 1)
+        return -1;
+      path[length++] = '/';
+      segment = length;
+    }
+    if (end)
+      break;
+  }
+  path[length] = 0;
+  return (int)length;
+}
+
+/**
+ * @brief Tell whether a client asks for its connection to be kept open.
+ *
+ * HTTP/1.1 connections are persistent unless the client sends
+ * "Connection: close", HTTP/1.0 ones only if it sends
+ * "Connection: keep-alive". The Connection header holds a comma-separated
+ * list of options, and may be repeated.
+ *
+ * @param request A parsed request.
+ * @return 1 if the connection should be kept open, 0 otherwise.
+ */
+int http_keep_alive(const http_request *request) {
+  int keep_alive = request->minor_version >= 1;
+
+  for (int i = 0; i < request->header_count; ++i) {
+    if (!http_slice_equals(request->headers[i].name, "Connection"))
+      continue;
+
+    const char *p = request->headers[i].value.data;
+    const char *end = p + request->headers[i].value.length;
+    while (p < end) {
+      const char *comma = memchr(p, ',', end - p);
+      const char *option_end = comma ? comma : end;
+      while (p < option_end && (*p == ' ' || *p == '\t'))
+        ++p;
+      const char *q = option_end;
+      while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+        --q;
+
+      http_slice option = {p, (size_t)(q - p)};
+      if (http_slice_equals(option, "close"))
+        keep_alive = 0;
+      else if (http_slice_equals(option, "keep-alive"))
+        keep_alive = 1;
+      p = option_end + 1;
+    }
+  }
+
+  return keep_alive;
+}
+
+static const char *skip_spaces(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t'))
+    ++p;
+  return p;
+}
+
+/**
+ * @brief Tell whether a qvalue of an Accept-Encoding element is zero.
+ *
+ * @param p The parameters of the element, after the coding.
+ * @param end The end of the element.
+ * @return 1 if the element has "q=0", "q=0.0" or the like, 0 otherwise.
+ */
+static int has_zero_quality(const char *p, const char *end) {
+  while (p < end) {
+    const char *semicolon = memchr(p, ';', end - p);
+    if (!semicolon)
+      return 0;
+    p = skip_spaces(semicolon + 1, end);
+    if (end - p < 2 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=')
+      continue;
+    p += 2;
+    if (p == end || *p++ != '0')
+      return 0;
+    if (p < end && *p == '.')
+      ++p;
+    while (p < end && *p == '0')
+      ++p;
+    p = skip_spaces(p, end);
+    return p == end || *p == ';';
+  }
+  return 0;
+}
+
+/**
+ * @brief Tell whether a client accepts a content coding for the response.
+ *
+ * The Accept-Encoding header lists codings, each possibly followed by a
+ * quality. A coding is accepted if it is listed with a non-zero quality, or
+ * if "*" is and the coding is not listed otherwise. Without the header, only
+ * the identity coding is assumed to be accepted.
+ *
+ * @param request A parsed request.
+ * @param coding The coding, such as "gzip".
+ * @return 1 if the coding is accepted, 0 otherwise.
+ */
+int http_accepts_encoding(const http_request *request, const char *coding) {
+  int wildcard = 0;
+
+  for (int i = 0; i < request->header_count; ++i) {
+    if (!http_slice_equals(request->headers[i].name, "Accept-Encoding"))
+      continue;
+
+    const char *p = request->headers[i].value.data;
+    const char *end = p + request->headers[i].value.length;
+    while (p < end) {
+      const char *comma = memchr(p, ',', end - p);
+      const char *element_end = comma ? comma : end;
+      p = skip_spaces(p, element_end);
+      const char *name_end = p;
+      while (name_end < element_end && *name_end != ';' && *name_end != ' ' &&
+             *name_end != '\t')
+        ++name_end;
+
+      http_slice name = {p, (size_t)(name_end - p)};
+      int accepted = !has_zero_quality(name_end, element_end);
+      if (http_slice_equals(name, coding))
+        return accepted;
+      if (name.length == 1 && *p == '*')
+        wildcard = accepted;
+      p = element_end + 1;
+    }
+  }
+  return wildcard;
+}
+
+/**
+ * @brief Parse a decimal number, saturating rather than overflowing.
+ *
+ * @param p The position to parse from, advanced past the digits.
+ * @param end The end of the text.
+ * @param number Receives the number.
+ * @return 1 on success, 0 if there is no digit at p.
+ */
+static int parse_number(const char **p, const char *end, long long *number) {
+  const char *start = *p;
+  long long value = 0;
+  for (; *p < end && **p >= '0' && **p <= '9'; ++*p)
+    if (value <= MAX_CONTENT_LENGTH)
+      value = value * 10 + (**p - '0');
+  *number = value;
+  return *p > start;
+}
+
+/**
+ * @brief Parse the value of a Range header against the size of a file.
+ *
+ * Ranges are kept in the order listed. Those starting past the end of the
+ * file are dropped and the others are clamped to it. A header that is
+ * malformed, uses another unit than bytes or lists more than HTTP_MAX_RANGES
+ * ranges is to be ignored, and the whole file sent instead.
+ *
+ * @param value The value of the Range header.
+ * @param size The size of the file.
+ * @param ranges Receives up to HTTP_MAX_RANGES ranges.
+ * @return The number of ranges stored, 0 if the header is to be ignored, or
+ * -1 if none of the ranges is satisfiable.
+ */
+int http_parse_ranges(http_slice value, long long size, http_range *ranges) {
+  http_slice unit = {value.data, 5};
+  if (value.length < 6 || !http_slice_equals(unit, "bytes") ||
+      value.data[5] != '=')
+    return 0;
+
+  const char *p = value.data + 6;
+  const char *end = value.data + value.length;
+  int count = 0;
+  for (int listed = 1;; ++listed) {
+    long long first = -1, last = -1;
+    p = skip_spaces(p, end);
+    if (p < end && *p != '-' && !parse_number(&p, end, &first))
+      return 0;
+    if (p == end || *p++ != '-')
+      return 0;
+    if (!parse_number(&p, end, &last))
+      last = -1;
+    p = skip_spaces(p, end);
+    if ((first < 0 && last < 0) || (first >= 0 && last >= 0 && last < first) ||
+        listed > HTTP_MAX_RANGES)
+      return 0;
+
+    if (first < 0) {
+      // The last bytes of the file
+      if (last > 0 && size > 0) {
+        ranges[count].first = last >= size ? 0 : size - last;
+        ranges[count++].last = size - 1;
+      }
+    } else if (first < size) {
+      ranges[count].first = first;
+      ranges[count++].last = (last < 0 || last >= size) ? size - 1 : last;
+    }
+
+    if (p == end)
+      break;
+    if (*p++ != ',')
+      return 0;
+  }
+  return count ? count : -1;
+}
+
+/**
+ * @brief Tell whether an entity tag is in the list of an If-None-Match
+ * header.
+ *
+ * Tags are compared the weak way: a W/ prefix is not significant.
+ *
+ * @param list The value of the header: "*" or a comma-separated list of
+ * quoted entity tags.
+ * @param etag The quoted entity tag of the file.
+ * @return 1 if the tag is listed or the list is "*", 0 otherwise.
+ */
+int http_etag_matches(http_slice list, http_slice etag) {
+  if (etag.length >= 2 && etag.data[0] == 'W' && etag.data[1] == '/') {
+    etag.data += 2;
+    etag.length -= 2;
+  }
+
+  const char *p = list.data;
+  const char *end = list.data + list.length;
+  while (p < end) {
+    if (*p == ' ' || *p == '\t' || *p == ',') {
+      ++p;
+      continue;
+    }
+    if (*p == '*')
+      return 1;
+    if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+      p += 2;
+    // Tags are quoted and may hold commas
+    if (p == end || *p != '"')
+      return 0;
+    const char *close = memchr(p + 1, '"', end - p - 1);
+    if (!close)
+      return 0;
+    if ((size_t)(close + 1 - p) == etag.length &&
+        memcmp(p, etag.data, etag.length) == 0)
+      return 1;
+    p = close + 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Parse a date in the preferred format of HTTP, such as
+ * "Sun, 06 Nov 1994 08:49:37 GMT", see date_parse_http().
+ *
+ * The obsolete RFC 850 and asctime() formats are not recognized: a
+ * conditional header holding one of them is simply ignored.
+ *
+ * @param value The date.
+ * @return The date in seconds since the Epoch, or -1 if it is not valid.
+ */
+time_t http_parse_date(http_slice value) {
+  return date_parse_http(value.data, value.length);
+}
+
+/**
+ * @brief Format a date the way HTTP expects it, in GMT, see
+ * date_format_http().
+ *
+ * @param date The date in seconds since the Epoch.
+ * @param text Receives the date, NUL-terminated.
+ */
+void http_format_date(time_t date, char text[HTTP_DATE_SIZE]) {
+  date_format_http(date, text);
+}
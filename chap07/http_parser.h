@@ -0,0 +1,81 @@
+/* http_parser.h */
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include "date_cache.h"
+
+#include <stddef.h>
+#include <time.h>
+
+// Most header lines kept per request, further ones make the request invalid
+#define HTTP_MAX_HEADERS 32
+
+// Most ranges answered from one Range header, a longer list gets the whole
+// file instead
+#define HTTP_MAX_RANGES 6
+// Size of a formatted HTTP date, its terminating NUL included
+#define HTTP_DATE_SIZE DATE_HTTP_SIZE
+
+// A piece of the receive buffer: nothing is copied nor NUL-terminated
+typedef struct http_slice {
+  const char *data;
+  size_t length;
+} http_slice;
+
+typedef struct http_header {
+  http_slice name;
+  http_slice value;
+} http_header;
+
+enum http_method { HTTP_OTHER, HTTP_GET, HTTP_HEAD, HTTP_POST };
+
+// Bytes first to last of a file, both included
+typedef struct http_range {
+  long long first;
+  long long last;
+} http_range;
+
+enum http_parse_result {
+  HTTP_PARSE_INCOMPLETE, // More bytes are needed, call again once received
+  HTTP_PARSE_DONE,       // The request, body included, is complete
+  HTTP_PARSE_ERROR       // The request is malformed or not supported
+};
+
+// State of the parser and description of the request parsed so far. The
+// slices point into the buffer passed to http_parse_request(), which must
+// stay in place between calls and only grow at its end.
+typedef struct http_request {
+  // Where the parser stands, kept between calls
+  int state;
+  size_t offset; // Bytes of the buffer scanned so far
+  size_t mark;   // Start of the token being scanned
+
+  enum http_method method;
+  http_slice method_name;
+  http_slice path;
+  http_slice version;
+  int minor_version; // The x in HTTP/1.x
+  http_header headers[HTTP_MAX_HEADERS];
+  int header_count;
+  size_t header_length;  // Request line and headers, blank line included
+  long long content_length; // -1 without a Content-Length header
+  http_slice body;
+} http_request;
+
+void http_request_init(http_request *request);
+enum http_parse_result http_parse_request(http_request *request,
+                                          const char *buffer, size_t length);
+size_t http_request_length(const http_request *request);
+const http_slice *http_find_header(const http_request *request,
+                                   const char *name);
+int http_slice_equals(http_slice slice, const char *text);
+int http_normalize_path(http_slice target, char *path, size_t size);
+int http_keep_alive(const http_request *request);
+int http_accepts_encoding(const http_request *request, const char *coding);
+int http_parse_ranges(http_slice value, long long size, http_range *ranges);
+int http_etag_matches(http_slice list, http_slice etag);
+time_t http_parse_date(http_slice value);
+void http_format_date(time_t date, char text[HTTP_DATE_SIZE]);
+
+#endif
@@ -0,0 +1,263 @@
+/* io_ring.c */
+
+#include "io_ring.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Set up an io_uring instance and map its queues.
+ *
+ * The C library has no wrapper for io_uring, so this goes through syscall().
+ * Kernels too old for a single mapping of both queues are refused: they lack
+ * most of what the server relies on anyway.
+ *
+ * @param ring Receives the instance.
+ * @param entries The size of the submission queue, a power of two.
+ * @return 0 on success, -1 with errno set if io_uring is not available.
+ */
+int io_ring_init(io_ring *ring, unsigned entries) {
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return -1;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->rings == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    munmap(ring->rings, ring->rings_size);
+    close(fd);
+    return -1;
+  }
+
+  char *rings = (char *)ring->rings;
+  ring->fd = fd;
+  ring->features = params.features;
+  ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(rings + params.sq_off.array);
+  ring->sq_next = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+  // Entry i of the submission queue is always submission i, so the array
+  // that may reorder them is filled once
+  for (unsigned i = 0; i < params.sq_entries; ++i)
+    ring->sq_array[i] = i;
+  return 0;
+}
+
+/**
+ * @brief Tear an io_uring instance down, with its provided buffers.
+ *
+ * @param ring An instance set up by io_ring_init().
+ */
+void io_ring_exit(io_ring *ring) {
+  if (ring->buffer_ring) {
+    munmap(ring->buffer_ring,
+           ring->buffer_count * sizeof(struct io_uring_buf));
+    free(ring->buffers);
+  }
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->rings, ring->rings_size);
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+/**
+ * @brief Hand out the next free submission queue entry.
+ *
+ * The entry is cleared, and submitted by the next call to
+ * io_ring_submit_and_wait(). If the queue is full, what it holds is
+ * submitted first.
+ *
+ * @param ring The instance.
+ * @return The entry, or NULL if the queue cannot be submitted.
+ */
+struct io_uring_sqe *io_ring_get_sqe(io_ring *ring) {
+  if (ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+      ring->sq_mask) {
+    io_ring_submit_and_wait(ring, -1);
+    if (ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+        ring->sq_mask)
+      return NULL;
+  }
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sq_next++ & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/**
+ * @brief Submit the pending entries and wait for a completion.
+ *
+ * A single io_uring_enter() does both, however many entries are submitted.
+ *
+ * @param ring The instance.
+ * @param timeout_ms How long to wait for a completion at most, or -1 to only
+ * submit.
+ * @return The number of entries submitted, or -1 with errno set on failure.
+ * Running out of time is not a failure.
+ */
+int io_ring_submit_and_wait(io_ring *ring, int timeout_ms) {
+  __atomic_store_n(ring->sq_tail, ring->sq_next, __ATOMIC_RELEASE);
+  unsigned pending =
+      ring->sq_next - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  struct __kernel_timespec timeout;
+  struct io_uring_getevents_arg arg;
+  unsigned flags = 0;
+  unsigned wait = 0;
+  if (timeout_ms >= 0) {
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&timeout;
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    wait = 1;
+  }
+
+  int submitted;
+  do {
+    submitted = (int)syscall(__NR_io_uring_enter, ring->fd, pending, wait,
+                             flags, timeout_ms >= 0 ? &arg : NULL,
+                             sizeof(arg));
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted < 0 && (errno == ETIME || errno == EBUSY || errno == EAGAIN))
+    return 0; // Timed out, or completions to reap before submitting more
+  return submitted;
+}
+
+/**
+ * @brief Take the next completion off the completion queue.
+ *
+ * The completion is copied out and its slot given back to the kernel at
+ * once, so that handling it may submit and complete more.
+ *
+ * @param ring The instance.
+ * @param cqe Receives the completion.
+ * @return 1 if a completion was taken, 0 if the queue is empty.
+ */
+int io_ring_next_cqe(io_ring *ring, struct io_uring_cqe *cqe) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  *cqe = ring->cqes[head & ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * @brief Register a ring of buffers for receive operations to pick from.
+ *
+ * Receives submitted with IOSQE_BUFFER_SELECT in the group take a buffer
+ * only once data arrives, so an idle connection holds no memory. Their
+ * completions carry the id of the buffer, to be given back with
+ * io_ring_recycle_buffer() once its data is consumed.
+ *
+ * @param ring The instance.
+ * @param group The id of the buffer group.
+ * @param count The number of buffers, a power of two.
+ * @param size The size of each buffer.
+ * @return 0 on success, -1 with errno set if the kernel does not support
+ * buffer rings.
+ */
+int io_ring_provide_buffers(io_ring *ring, unsigned short group,
+                            unsigned count, unsigned size) {
+  size_t ring_size = count * sizeof(struct io_uring_buf);
+  void *buffer_ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer_ring == MAP_FAILED)
+    return -1;
+  char *buffers = (char *)malloc((size_t)count * size);
+  if (!buffers) {
+    munmap(buffer_ring, ring_size);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  struct io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = (uint64_t)(uintptr_t)buffer_ring;
+  registration.ring_entries = count;
+  registration.bgid = group;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+              &registration, 1) < 0) {
+    int error = errno;
+    free(buffers);
+    munmap(buffer_ring, ring_size);
+    errno = error;
+    return -1;
+  }
+
+  ring->buffer_ring = (struct io_uring_buf_ring *)buffer_ring;
+  ring->buffers = buffers;
+  ring->buffer_count = count;
+  ring->buffer_size = size;
+  ring->buffer_group = group;
+  ring->buffer_tail = 0;
+  for (unsigned i = 0; i < count; ++i)
+    io_ring_recycle_buffer(ring, (unsigned short)i);
+  return 0;
+}
+
+/**
+ * @brief Return the memory of a provided buffer.
+ *
+ * @param ring The instance.
+ * @param id The id of the buffer, from a completion.
+ * @return The start of the buffer.
+ */
+char *io_ring_buffer(io_ring *ring, unsigned short id) {
+  return ring->buffers + (size_t)id * ring->buffer_size;
+}
+
+/**
+ * @brief Give a provided buffer back to the kernel.
+ *
+ * @param ring The instance.
+ * @param id The id of the buffer, whose data is no longer needed.
+ */
+void io_ring_recycle_buffer(io_ring *ring, unsigned short id) {
+  struct io_uring_buf *buffer =
+      &ring->buffer_ring->bufs[ring->buffer_tail & (ring->buffer_count - 1)];
+  buffer->addr = (uint64_t)(uintptr_t)io_ring_buffer(ring, id);
+  buffer->len = ring->buffer_size;
+  buffer->bid = id;
+  ring->buffer_tail++;
+  __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail,
+                   __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,54 @@
+/* io_ring.h */
+
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+// An io_uring instance, driven through the raw system calls: submissions are
+// written to the shared submission queue and completions read from the
+// shared completion queue, both mapped from the kernel.
+typedef struct io_ring {
+  int fd;
+  unsigned features; // IORING_FEAT_ flags of the kernel
+  // Submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_next; // Tail once the entries handed out are submitted
+  // Completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  // Mappings, for io_ring_exit()
+  void *rings;
+  size_t rings_size;
+  size_t sqes_size;
+  // Ring of provided buffers, which receive operations pick from
+  struct io_uring_buf_ring *buffer_ring;
+  char *buffers;
+  unsigned buffer_count; // A power of two
+  unsigned buffer_size;
+  unsigned short buffer_group;
+  unsigned short buffer_tail;
+} io_ring;
+
+int io_ring_init(io_ring *ring, unsigned entries);
+void io_ring_exit(io_ring *ring);
+struct io_uring_sqe *io_ring_get_sqe(io_ring *ring);
+int io_ring_submit_and_wait(io_ring *ring, int timeout_ms);
+int io_ring_next_cqe(io_ring *ring, struct io_uring_cqe *cqe);
+int io_ring_provide_buffers(io_ring *ring, unsigned short group,
+                            unsigned count, unsigned size);
+char *io_ring_buffer(io_ring *ring, unsigned short id);
+void io_ring_recycle_buffer(io_ring *ring, unsigned short id);
+
+#endif
+
+#endif
@@ -0,0 +1,195 @@
+/* metrics.c */
+
+#include "metrics.h"
+#include "http_builder.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Counters of every worker
+static server_metrics *metrics_table = NULL;
+static int metrics_count = 0;
+
+/**
+ * @brief Allocate the counters of the server, one set per worker.
+ *
+ * They are mapped shared before the workers are forked, so that each worker
+ * sees the counters of the others. The process starts with the first set,
+ * which a worker swaps for its own, see metrics_worker().
+ *
+ * @param workers The number of worker processes, 1 without workers.
+ * @return The counters of the first worker.
+ */
+server_metrics *metrics_init(int workers) {
+  metrics_table = (server_metrics *)mmap(
+      NULL, workers * sizeof(server_metrics), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (metrics_table == MAP_FAILED) {
+    fprintf(stderr, "mmap() failed. (%d)\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  metrics_count = workers;
+  return metrics_table;
+}
+
+/**
+ * @brief Get the counters of a worker.
+ *
+ * @param worker The index of the worker, from 0.
+ * @return Its counters, which only it should write.
+ */
+server_metrics *metrics_worker(int worker) { return &metrics_table[worker]; }
+
+/**
+ * @brief Add to a counter of this worker.
+ *
+ * Only this worker writes its counters, so there is no need for an atomic
+ * read-modify-write: a relaxed store is enough for the other workers never to
+ * read a torn value, and costs no more than a plain one.
+ *
+ * @param counter The counter, in the set of this worker.
+ * @param amount What to add.
+ */
+void metrics_add(uint64_t *counter, uint64_t amount) {
+  __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Count the duration of a response in the histogram.
+ *
+ * @param metrics The counters of this worker.
+ * @param duration Microseconds from the complete request to the last byte of
+ * the response.
+ */
+void metrics_add_latency(server_metrics *metrics, uint64_t duration) {
+  // Upper bounds of the buckets of the histogram
+  static const uint64_t bounds[METRICS_LATENCY_BUCKETS] = {
+      100,   250,    500,    1000,   2500,    5000,    10000,  25000,
+      50000, 100000, 250000, 500000, 1000000, 2500000, 5000000};
+
+  int bucket = 0;
+  while (bucket < METRICS_LATENCY_BUCKETS && duration > bounds[bucket])
+    bucket++;
+  metrics_add(&metrics->latency[bucket], 1);
+  metrics_add(&metrics->latency_sum, duration);
+}
+
+/**
+ * @brief Add up the counters of all the workers.
+ *
+ * Each counter is read on its own while the workers go on, so the totals may
+ * be a few requests apart from one another, as with any scrape.
+ *
+ * @param total Receives the totals.
+ */
+void metrics_sum(server_metrics *total) {
+  memset(total, 0, sizeof(*total));
+  uint64_t *sum = (uint64_t *)total;
+  size_t words = sizeof(server_metrics) / sizeof(uint64_t);
+  for (int i = 0; i < metrics_count; ++i) {
+    const uint64_t *counters = (const uint64_t *)&metrics_table[i];
+    for (size_t j = 0; j < words; ++j)
+      sum[j] += __atomic_load_n(&counters[j], __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @brief Render the counters of the server in the Prometheus text format.
+ *
+ * @param text The buffer receiving the text.
+ * @param size The size of the buffer.
+ * @return The length of the text, or size if it does not fit.
+ */
+size_t metrics_format(char *text, size_t size) {
+  // clang-format off
+  static const char *const timeouts[METRICS_TIMEOUTS] = {
+    "idle", "header", "body", "write"
+  };
+  static const char *const bounds[METRICS_LATENCY_BUCKETS] = {
+    "0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01",
+    "0.025",  "0.05",    "0.1",    "0.25",  "0.5",    "1",     "2.5", "5"
+  };
+  // clang-format on
+  server_metrics total;
+  metrics_sum(&total);
+  http_builder body;
+  http_builder_init(&body, text, size, NULL, 0);
+
+  http_builder_format(&body,
+                      "# HELP web_server_connections_accepted_total "
+                      "Connections accepted.\n"
+                      "# TYPE web_server_connections_accepted_total counter\n"
+                      "web_server_connections_accepted_total %ju\n"
+                      "# HELP web_server_connections_active Connections "
+                      "open.\n"
+                      "# TYPE web_server_connections_active gauge\n"
+                      "web_server_connections_active %ju\n",
+                      (uintmax_t)total.accepted,
+                      (uintmax_t)(total.accepted - total.closed));
+
+  http_builder_text(&body,
+                    "# HELP web_server_responses_total Responses sent in "
+                    "full.\n"
+                    "# TYPE web_server_responses_total counter\n");
+  for (int code = 0; code < 600; ++code)
+    if (total.responses[code])
+      http_builder_format(&body,
+                          "web_server_responses_total{code=\"%d\"} %ju\n",
+                          code, (uintmax_t)total.responses[code]);
+
+  http_builder_format(
+      &body,
+      "# HELP web_server_response_bytes_total Response bytes sent.\n"
+      "# TYPE web_server_response_bytes_total counter\n"
+      "web_server_response_bytes_total %ju\n"
+      "# HELP web_server_file_cache_hits_total Files sent from the "
+      "file cache.\n"
+      "# TYPE web_server_file_cache_hits_total counter\n"
+      "web_server_file_cache_hits_total %ju\n"
+      "# HELP web_server_file_cache_misses_total Files looked for on "
+      "disk.\n"
+      "# TYPE web_server_file_cache_misses_total counter\n"
+      "web_server_file_cache_misses_total %ju\n"
+      "# HELP web_server_disconnects_total Connections lost amid a "
+      "request or a response.\n"
+      "# TYPE web_server_disconnects_total counter\n"
+      "web_server_disconnects_total %ju\n"
+      "# HELP web_server_access_log_dropped_total Access log entries "
+      "dropped for want of room.\n"
+      "# TYPE web_server_access_log_dropped_total counter\n"
+      "web_server_access_log_dropped_total %ju\n",
+      (uintmax_t)total.bytes_sent, (uintmax_t)total.cache_hits,
+      (uintmax_t)total.cache_misses, (uintmax_t)total.disconnects,
+      (uintmax_t)total.log_dropped);
+
+  http_builder_text(&body,
+                    "# HELP web_server_timeouts_total Connections timed "
+                    "out.\n"
+                    "# TYPE web_server_timeouts_total counter\n");
+  for (int i = 0; i < METRICS_TIMEOUTS; ++i)
+    http_builder_format(&body, "web_server_timeouts_total{kind=\"%s\"} %ju\n",
+                        timeouts[i], (uintmax_t)total.timeouts[i]);
+
+  http_builder_text(&body,
+                    "# HELP web_server_request_duration_seconds Time from a "
+                    "complete request to the last byte of its response.\n"
+                    "# TYPE web_server_request_duration_seconds histogram\n");
+  uint64_t count = 0;
+  for (int i = 0; i <= METRICS_LATENCY_BUCKETS; ++i) {
+    count += total.latency[i];
+    http_builder_format(
+        &body, "web_server_request_duration_seconds_bucket{le=\"%s\"} %ju\n",
+        i < METRICS_LATENCY_BUCKETS ? bounds[i] : "+Inf", (uintmax_t)count);
+  }
+  http_builder_format(&body,
+                      "web_server_request_duration_seconds_sum %ju.%06ju\n"
+                      "web_server_request_duration_seconds_count %ju\n",
+                      (uintmax_t)(total.latency_sum / 1000000),
+                      (uintmax_t)(total.latency_sum % 1000000),
+                      (uintmax_t)count);
+  return body.failed ? size : body.length;
+}
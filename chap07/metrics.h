@@ -0,0 +1,42 @@
+/* metrics.h */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Buckets of the request duration histogram, besides the +Inf one
+#define METRICS_LATENCY_BUCKETS 15
+// Kinds of timeouts counted, in the order of enum client_timeout
+#define METRICS_TIMEOUTS 4
+
+// Counters of an event loop. Each worker only ever writes its own, with
+// plain relaxed stores, in memory shared with the other workers so that any
+// of them can report the totals without a lock. Made of uint64_t alone, so
+// that metrics_sum() can add them up word by word, and aligned on cache
+// lines so that no two workers write to the same line.
+typedef struct server_metrics {
+  _Alignas(64) uint64_t accepted; // Connections accepted
+  uint64_t closed;                // Connections closed, whatever the reason
+  uint64_t responses[600];        // Responses sent in full, by status code
+  uint64_t bytes_sent;            // Response bytes, headers included
+  uint64_t cache_hits;   // Files sent from the cache without a file job
+  uint64_t cache_misses; // File jobs, which look for the file on disk
+  uint64_t timeouts[METRICS_TIMEOUTS]; // Clients dropped, by timeout
+  uint64_t disconnects; // Connections lost amid a request or a response
+  // Responses by request duration, from the complete request to the last
+  // byte sent, non-cumulative: the last bucket is the +Inf one
+  uint64_t latency[METRICS_LATENCY_BUCKETS + 1];
+  uint64_t latency_sum; // Microseconds
+  uint64_t log_dropped; // Access log entries the ring had no room for
+} server_metrics;
+
+server_metrics *metrics_init(int workers);
+server_metrics *metrics_worker(int worker);
+void metrics_add(uint64_t *counter, uint64_t amount);
+void metrics_add_latency(server_metrics *metrics, uint64_t duration);
+void metrics_sum(server_metrics *total);
+size_t metrics_format(char *text, size_t size);
+
+#endif
@@ -0,0 +1,286 @@
+/* mime_types.c */
+
+#include "mime_types.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Longest extension looked up, longer ones are served as octet-stream
+#define MAX_EXTENSION 31
+// Longest type accepted from a file, so that header lines stay bounded
+#define MAX_TYPE 127
+// Slots of the table of types loaded by mime_load(), a power of two
+#define LOADED_SLOTS 4096
+#define MAX_LOADED (LOADED_SLOTS / 4 * 3)
+
+// Extensions of up to 8 bytes packed into an integer, first byte lowest, to
+// switch on them
+#define EXT2(a, b) ((uint64_t)(a) | (uint64_t)(b) << 8)
+#define EXT3(a, b, c) (EXT2(a, b) | (uint64_t)(c) << 16)
+#define EXT4(a, b, c, d) (EXT3(a, b, c) | (uint64_t)(d) << 24)
+
+// A type with its header line, put together by the compiler
+#define MIME(type)                                                             \
+  {type, "Content-Type: " type "\r\n",                                         \
+   sizeof("Content-Type: " type "\r\n") - 1, 0}
+// The same for a type whose files are compressible
+#define TEXT(type)                                                             \
+  {type, "Content-Type: " type "\r\n",                                         \
+   sizeof("Content-Type: " type "\r\n") - 1, 1}
+
+enum builtin {
+  T_OCTET_STREAM,
+  T_CSS,
+  T_CSV,
+  T_HTML,
+  T_PLAIN,
+  T_GIF,
+  T_ICON,
+  T_JPEG,
+  T_PNG,
+  T_SVG,
+  T_JAVASCRIPT,
+  T_JSON,
+  T_PDF,
+  T_XML
+};
+
+// clang-format off
+static const mime_type builtin_types[] = {
+  [T_OCTET_STREAM] = MIME("application/octet-stream"),
+  [T_CSS]          = TEXT("text/css"),
+  [T_CSV]          = TEXT("text/csv"),
+  [T_HTML]         = TEXT("text/html"),
+  [T_PLAIN]        = TEXT("text/plain"),
+  [T_GIF]          = MIME("image/gif"),
+  [T_ICON]         = TEXT("image/x-icon"),
+  [T_JPEG]         = MIME("image/jpeg"),
+  [T_PNG]          = MIME("image/png"),
+  [T_SVG]          = TEXT("image/svg+xml"),
+  [T_JAVASCRIPT]   = TEXT("application/javascript"),
+  [T_JSON]         = TEXT("application/json"),
+  [T_PDF]          = MIME("application/pdf"),
+  [T_XML]          = TEXT("application/xml"),
+};
+// clang-format on
+
+// An extension read from a mime.types file
+typedef struct loaded_type {
+  char *extension; // Lower case
+  const mime_type *type;
+} loaded_type;
+
+static loaded_type loaded[LOADED_SLOTS];
+static int loaded_count = 0;
+
+/**
+ * @brief Look an extension up among the types known at compile time.
+ *
+ * The compiler turns the switch into a jump table or a binary search over
+ * the packed extensions, so no string is compared.
+ *
+ * @param key The lower case extension, packed.
+ * @return The type, or NULL if the extension is not known.
+ */
+static const mime_type *builtin_lookup(uint64_t key) {
+  enum builtin type;
+  switch (key) {
+  // clang-format off
+  case EXT3('c', 's', 's'):      type = T_CSS;        break;
+  case EXT3('c', 's', 'v'):      type = T_CSV;        break;
+  case EXT3('h', 't', 'm'):      type = T_HTML;       break;
+  case EXT4('h', 't', 'm', 'l'): type = T_HTML;       break;
+  case EXT3('t', 'x', 't'):      type = T_PLAIN;      break;
+  case EXT3('g', 'i', 'f'):      type = T_GIF;        break;
+  case EXT3('i', 'c', 'o'):      type = T_ICON;       break;
+  case EXT4('j', 'p', 'e', 'g'): type = T_JPEG;       break;
+  case EXT3('j', 'p', 'g'):      type = T_JPEG;       break;
+  case EXT3('p', 'n', 'g'):      type = T_PNG;        break;
+  case EXT3('s', 'v', 'g'):      type = T_SVG;        break;
+  case EXT2('j', 's'):           type = T_JAVASCRIPT; break;
+  case EXT4('j', 's', 'o', 'n'): type = T_JSON;       break;
+  case EXT3('p', 'd', 'f'):      type = T_PDF;        break;
+  case EXT3('x', 'm', 'l'):      type = T_XML;        break;
+  // clang-format on
+  default:
+    return NULL;
+  }
+  return &builtin_types[type];
+}
+
+/**
+ * @brief Copy an extension in lower case.
+ *
+ * @param extension The extension, without its dot.
+ * @param lower Receives the extension, NUL-terminated.
+ * @return The length of the extension, or 0 if it is empty or too long.
+ */
+static size_t lower_extension(const char *extension,
+                              char lower[MAX_EXTENSION + 1]) {
+  size_t length = 0;
+  for (; extension[length]; ++length) {
+    if (length == MAX_EXTENSION)
+      return 0;
+    char c = extension[length];
+    lower[length] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+  }
+  lower[length] = 0;
+  return length;
+}
+
+// FNV-1a, like the file cache
+static unsigned hash_extension(const char *extension) {
+  unsigned hash = 2166136261u;
+  while (*extension) {
+    hash ^= (unsigned char)*extension++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * @brief Find the slot of an extension in the loaded table.
+ *
+ * @return The slot holding the extension, or the empty slot where it goes.
+ */
+static loaded_type *loaded_slot(const char *extension) {
+  unsigned i = hash_extension(extension) & (LOADED_SLOTS - 1);
+  while (loaded[i].extension && strcmp(loaded[i].extension, extension) != 0)
+    i = (i + 1) & (LOADED_SLOTS - 1);
+  return &loaded[i];
+}
+
+/**
+ * @brief Return the MIME type of a file given its path.
+ *
+ * The extension is compared regardless of case. Types loaded with
+ * mime_load() take precedence over the built-in ones. If the file type is
+ * not recognized, the type is "application/octet-stream".
+ *
+ * @param path The path of the file.
+ * @return The MIME type of the file, never NULL.
+ */
+const mime_type *mime_lookup(const char *path) {
+  const char *last_dot = strrchr(path, '.');
+  char extension[MAX_EXTENSION + 1];
+  size_t length;
+  if (!last_dot || !(length = lower_extension(last_dot + 1, extension)))
+    return &builtin_types[T_OCTET_STREAM];
+
+  if (loaded_count) {
+    loaded_type *slot = loaded_slot(extension);
+    if (slot->extension)
+      return slot->type;
+  }
+
+  if (length <= 8) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < length; ++i)
+      key |= (uint64_t)(unsigned char)extension[i] << (8 * i);
+    const mime_type *type = builtin_lookup(key);
+    if (type)
+      return type;
+  }
+  return &builtin_types[T_OCTET_STREAM];
+}
+
+/**
+ * @brief Tell whether files of a type read from a file are compressible.
+ *
+ * Text and the structured formats written as text are, whereas most other
+ * types are compressed formats already.
+ *
+ * @param name The type, such as "text/css".
+ * @return 1 if compressing them is worth it, 0 otherwise.
+ */
+static int is_compressible(const char *name) {
+  static const char *const text_types[] = {
+      "text/", "application/javascript", "application/json",
+      "application/xml", "application/wasm", "image/svg+xml"};
+  for (size_t i = 0; i < sizeof(text_types) / sizeof(text_types[0]); ++i)
+    if (strncmp(name, text_types[i], strlen(text_types[i])) == 0)
+      return 1;
+
+  // Structured syntax suffixes, as in application/atom+xml
+  const char *plus = strrchr(name, '+');
+  return plus && (strcmp(plus, "+xml") == 0 || strcmp(plus, "+json") == 0);
+}
+
+/**
+ * @brief Render the header line of a type read from a file.
+ *
+ * @return The type, or NULL if out of memory.
+ */
+static mime_type *make_type(const char *name) {
+  size_t header_length = strlen("Content-Type: \r\n") + strlen(name);
+  mime_type *type = malloc(sizeof(mime_type) + header_length + 1);
+  if (!type)
+    return NULL;
+  char *header = (char *)(type + 1);
+  snprintf(header, header_length + 1, "Content-Type: %s\r\n", name);
+  type->type = header + strlen("Content-Type: ");
+  type->header = header;
+  type->header_length = header_length;
+  type->compressible = is_compressible(name);
+  return type;
+}
+
+/**
+ * @brief Load extensions from a file in the format of /etc/mime.types.
+ *
+ * Each line holds a MIME type followed by its extensions, separated by
+ * spaces or tabs. Lines starting with '#' are comments. An extension listed
+ * again replaces the earlier type, built-in ones included. Call this at
+ * startup, before serving: lookups are not synchronized with loading.
+ *
+ * @param file_name The path of the file.
+ * @return The number of extensions loaded, or -1 if the file cannot be read
+ * or memory runs out.
+ */
+int mime_load(const char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  if (!file)
+    return -1;
+
+  int count = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), file)) {
+    if (line[0] == '#')
+      continue;
+    char *name = strtok(line, " \t\r\n");
+    // The type itself is the Content-Type value: keep it to one token
+    if (!name || !strchr(name, '/') || strlen(name) > MAX_TYPE)
+      continue;
+
+    mime_type *type = NULL;
+    char *token;
+    while ((token = strtok(NULL, " \t\r\n"))) {
+      char extension[MAX_EXTENSION + 1];
+      if (!lower_extension(token, extension))
+        continue;
+      if (!type && !(type = make_type(name)))
+        break;
+
+      loaded_type *slot = loaded_slot(extension);
+      if (!slot->extension) {
+        if (loaded_count == MAX_LOADED)
+          continue;
+        if (!(slot->extension = strdup(extension)))
+          break;
+        loaded_count++;
+      }
+      // Types replaced this way are not freed: they may still be shared
+      slot->type = type;
+      count++;
+    }
+    if (token) {
+      fclose(file);
+      return -1;
+    }
+  }
+
+  fclose(file);
+  return count;
+}
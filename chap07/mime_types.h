@@ -0,0 +1,20 @@
+/* mime_types.h */
+
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#include <stddef.h>
+
+// A MIME type along with its Content-Type header line, rendered once so that
+// responses copy it as is
+typedef struct mime_type {
+  const char *type;   // "text/css"
+  const char *header; // "Content-Type: text/css\r\n"
+  size_t header_length;
+  int compressible; // Whether it is worth compressing: text, scripts, XML...
+} mime_type;
+
+const mime_type *mime_lookup(const char *path);
+int mime_load(const char *file_name);
+
+#endif
@@ -0,0 +1,283 @@
+/* path_tree.c */
+
+#include "path_tree.h"
+
+#if !defined(_WIN32)
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// A path found while walking the directory
+typedef struct tree_entry {
+  size_t offset; // Of the path in the text, while it may still move
+  const char *path;
+  unsigned short length;
+  unsigned char kind;
+} tree_entry;
+
+// What path_tree_build() puts together
+typedef struct tree_builder {
+  char *text;
+  size_t text_length;
+  size_t text_size;
+  tree_entry *entries;
+  unsigned entry_count;
+  unsigned entry_size;
+  path_node *nodes;
+  unsigned node_count;
+  int failed; // Out of memory, or too many entries
+} tree_builder;
+
+/**
+ * @brief Record a path below the root.
+ *
+ * @return The index of its entry, or -1 if it cannot be recorded.
+ */
+static int add_entry(tree_builder *builder, const char *path, size_t length,
+                     enum path_kind kind) {
+  if (builder->entry_count == PATH_TREE_MAX_ENTRIES) {
+    builder->failed = 1;
+    return -1;
+  }
+  if (builder->entry_count == builder->entry_size) {
+    unsigned size = builder->entry_size ? builder->entry_size * 2 : 256;
+    tree_entry *entries = realloc(builder->entries, size * sizeof(*entries));
+    if (!entries) {
+      builder->failed = 1;
+      return -1;
+    }
+    builder->entries = entries;
+    builder->entry_size = size;
+  }
+  if (builder->text_length + length + 1 > builder->text_size) {
+    size_t size = builder->text_size ? builder->text_size * 2 : 16384;
+    while (size < builder->text_length + length + 1)
+      size *= 2;
+    char *text = realloc(builder->text, size);
+    if (!text) {
+      builder->failed = 1;
+      return -1;
+    }
+    builder->text = text;
+    builder->text_size = size;
+  }
+
+  tree_entry *entry = &builder->entries[builder->entry_count];
+  entry->offset = builder->text_length;
+  entry->length = (unsigned short)length;
+  entry->kind = (unsigned char)kind;
+  memcpy(builder->text + builder->text_length, path, length);
+  builder->text[builder->text_length + length] = 0;
+  builder->text_length += length + 1;
+  return (int)builder->entry_count++;
+}
+
+/**
+ * @brief Record a directory and everything below it.
+ *
+ * Links to files count as files. Links to directories are not followed, so
+ * that a loop cannot trap the walk: what is below them is left unknown, as
+ * is what is below a directory that cannot be read.
+ *
+ * @param builder The tree being built.
+ * @param path The path of the directory, in a buffer that has room for
+ * PATH_TREE_MAX_PATH more bytes and a NUL.
+ * @param root_length The length of the root in path.
+ * @param length The length of path.
+ */
+static void walk_directory(tree_builder *builder, char *path,
+                           size_t root_length, size_t length) {
+  int index = add_entry(builder, path + root_length, length - root_length,
+                        PATH_DIRECTORY);
+  if (index < 0)
+    return;
+  DIR *dir = opendir(path);
+  if (!dir) {
+    builder->entries[index].kind = PATH_UNKNOWN;
+    return;
+  }
+
+  struct dirent *child;
+  while (!builder->failed && (child = readdir(dir))) {
+    if (strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0)
+      continue;
+    size_t name_length = strlen(child->d_name);
+    size_t child_length = length + 1 + name_length;
+    if (child_length - root_length > PATH_TREE_MAX_PATH)
+      continue; // Never looked up
+    path[length] = '/';
+    memcpy(path + length + 1, child->d_name, name_length + 1);
+
+    // The type in the entry saves a stat() on most file systems
+    enum path_kind kind = PATH_MISSING;
+    int directory = child->d_type == DT_DIR;
+    struct stat child_stat;
+    if (child->d_type == DT_REG)
+      kind = PATH_FILE;
+    else if (!directory && lstat(path, &child_stat) == 0 &&
+             S_ISDIR(child_stat.st_mode))
+      directory = 1;
+    else if (!directory && stat(path, &child_stat) == 0)
+      kind = S_ISREG(child_stat.st_mode)   ? PATH_FILE
+             : S_ISDIR(child_stat.st_mode) ? PATH_UNKNOWN
+                                           : PATH_MISSING;
+
+    if (directory)
+      walk_directory(builder, path, root_length, child_length);
+    else if (kind != PATH_MISSING)
+      add_entry(builder, path + root_length, child_length - root_length, kind);
+  }
+  closedir(dir);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  return strcmp(((const tree_entry *)a)->path, ((const tree_entry *)b)->path);
+}
+
+/**
+ * @brief Make the node of a run of sorted paths, and those below it.
+ *
+ * The node takes the longest prefix the paths share past depth as its
+ * label. The paths that go on past it are split by their next byte into
+ * the children.
+ *
+ * @param builder The tree being built.
+ * @param entries The paths, sorted, sharing their first depth bytes.
+ * @param count The number of paths, at least 1.
+ * @param depth The length of the path of the parent node.
+ * @return The index of the node.
+ */
+static unsigned build_node(tree_builder *builder, const tree_entry *entries,
+                           unsigned count, size_t depth) {
+  // Sorted paths share as much with each other as the first with the last
+  const tree_entry *first = &entries[0], *last = &entries[count - 1];
+  size_t end = depth;
+  while (end < first->length && end < last->length &&
+         first->path[end] == last->path[end])
+    end++;
+
+  // Never reallocated: the nodes are at most twice the entries
+  unsigned index = builder->node_count++;
+  path_node *node = &builder->nodes[index];
+  node->label = (unsigned)(first->path - builder->text + depth);
+  node->length = (unsigned short)(end - depth);
+  node->kind = PATH_MISSING;
+  node->first_child = 0;
+  node->next_sibling = 0;
+
+  unsigned i = 0, previous = 0;
+  if (first->length == end)
+    node->kind = entries[i++].kind;
+  while (i < count) {
+    unsigned j = i + 1;
+    while (j < count && entries[j].path[end] == entries[i].path[end])
+      j++;
+    unsigned child = build_node(builder, entries + i, j - i, end);
+    if (previous)
+      builder->nodes[previous].next_sibling = child;
+    else
+      builder->nodes[index].first_child = child;
+    previous = child;
+    i = j;
+  }
+  return index;
+}
+
+/**
+ * @brief Build the tree of the files and directories below a directory.
+ *
+ * This walks the whole directory, so it is meant to be called again only
+ * when something below it is known to have changed.
+ *
+ * @param root The path of the directory.
+ * @return The tree, to be freed with path_tree_free(), or NULL if the
+ * directory cannot be read, holds more than PATH_TREE_MAX_ENTRIES paths or
+ * memory runs out.
+ */
+path_tree *path_tree_build(const char *root) {
+  size_t root_length = strlen(root);
+  char *path = malloc(root_length + PATH_TREE_MAX_PATH + 1);
+  if (!path)
+    return NULL;
+  tree_builder builder;
+  memset(&builder, 0, sizeof(builder));
+  memcpy(path, root, root_length + 1);
+  walk_directory(&builder, path, root_length, root_length);
+  free(path);
+
+  // Each node but the root adds a path or splits a run in two
+  path_tree *tree = NULL;
+  if (!builder.failed && builder.entries[0].kind != PATH_UNKNOWN &&
+      (builder.nodes = malloc(2 * builder.entry_count * sizeof(path_node))) &&
+      (tree = malloc(sizeof(path_tree)))) {
+    // The text has stopped moving: the paths can be sorted in place
+    for (unsigned i = 0; i < builder.entry_count; ++i)
+      builder.entries[i].path = builder.text + builder.entries[i].offset;
+    qsort(builder.entries, builder.entry_count, sizeof(tree_entry),
+          compare_entries);
+    build_node(&builder, builder.entries, builder.entry_count, 0);
+    tree->nodes = builder.nodes;
+    tree->node_count = builder.node_count;
+    tree->text = builder.text;
+  } else {
+    free(builder.nodes);
+    free(builder.text);
+  }
+  free(builder.entries);
+  return tree;
+}
+
+/**
+ * @brief Free a tree made by path_tree_build().
+ *
+ * @param tree The tree, or NULL.
+ */
+void path_tree_free(path_tree *tree) {
+  if (!tree)
+    return;
+  free(tree->nodes);
+  free(tree->text);
+  free(tree);
+}
+
+/**
+ * @brief Tell what a path leads to, without touching the file system.
+ *
+ * Each byte of the path is compared once, on the way down from the root.
+ *
+ * @param tree The tree.
+ * @param path The path below the root of the tree, starting with '/', as
+ * normalized by http_normalize_path(): "." and ".." are not resolved.
+ * @param length The length of path.
+ * @return What the path leads to, PATH_UNKNOWN if it is too long to be in
+ * the tree.
+ */
+enum path_kind path_tree_lookup(const path_tree *tree, const char *path,
+                                size_t length) {
+  if (length > PATH_TREE_MAX_PATH)
+    return PATH_UNKNOWN;
+
+  const path_node *node = tree->nodes;
+  size_t matched = 0; // The root has an empty label
+  for (;;) {
+    if (matched == length)
+      return (enum path_kind)node->kind;
+    if (node->kind == PATH_UNKNOWN && path[matched] == '/')
+      return PATH_UNKNOWN;
+
+    unsigned child = node->first_child;
+    while (child && tree->text[tree->nodes[child].label] != path[matched])
+      child = tree->nodes[child].next_sibling;
+    if (!child)
+      return PATH_MISSING;
+    node = &tree->nodes[child];
+    if (length - matched < node->length ||
+        memcmp(tree->text + node->label, path + matched, node->length) != 0)
+      return PATH_MISSING;
+    matched += node->length;
+  }
+}
+
+#endif
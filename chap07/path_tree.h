@@ -0,0 +1,49 @@
+/* path_tree.h */
+
+#ifndef PATH_TREE_H
+#define PATH_TREE_H
+
+#if !defined(_WIN32)
+
+#include <stddef.h>
+
+// Longest path looked up, longer ones are not in the tree
+#define PATH_TREE_MAX_PATH 255
+// Most files and directories held, a larger tree is not built
+#define PATH_TREE_MAX_ENTRIES 100000
+
+// What a path leads to, according to the tree
+enum path_kind {
+  PATH_MISSING,   // Nothing, or nothing that could be served
+  PATH_FILE,      // A regular file, or a link to one
+  PATH_DIRECTORY, // A directory
+  PATH_UNKNOWN    // Below a link to a directory: ask the file system
+};
+
+// A node of the tree: its label is the part of the path it adds to the one
+// of its parent. The children of a node start with different bytes.
+typedef struct path_node {
+  unsigned label; // Offset of the label in the text of the tree
+  unsigned short length;
+  unsigned char kind;    // enum path_kind of the path ending with the label
+  unsigned first_child;  // Index of the first child, 0 without any
+  unsigned next_sibling; // Index of the next child of the parent, 0 if last
+} path_node;
+
+// A radix tree of the paths below a directory, the root of the tree being
+// the directory itself. It is built in one go and only read afterwards:
+// lookups allocate nothing.
+typedef struct path_tree {
+  path_node *nodes; // The root first
+  unsigned node_count;
+  char *text; // The paths, NUL-terminated, which labels point into
+} path_tree;
+
+path_tree *path_tree_build(const char *root);
+void path_tree_free(path_tree *tree);
+enum path_kind path_tree_lookup(const path_tree *tree, const char *path,
+                                size_t length);
+
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+/* timing_wheel.c */
+
+#include "timing_wheel.h"
+
+#include <stddef.h>
+
+/**
+ * @brief Give a timer a deadline, replacing the one it had.
+ *
+ * @param wheel The wheel.
+ * @param timer The timer, in the wheel or not.
+ * @param deadline When it expires, within TIMING_WHEEL_SLOTS seconds of the
+ * last call to timing_wheel_expire().
+ */
+void timing_wheel_add(timing_wheel *wheel, wheel_timer *timer,
+                      time_t deadline) {
+  timing_wheel_remove(wheel, timer);
+  timer->deadline = deadline;
+  wheel_timer **slot = &wheel->slots[deadline & (TIMING_WHEEL_SLOTS - 1)];
+  timer->prev = NULL;
+  timer->next = *slot;
+  if (*slot)
+    (*slot)->prev = timer;
+  *slot = timer;
+}
+
+/**
+ * @brief Take a timer out of the wheel, if it is in.
+ *
+ * @param wheel The wheel.
+ * @param timer The timer.
+ */
+void timing_wheel_remove(timing_wheel *wheel, wheel_timer *timer) {
+  if (!timer->deadline)
+    return;
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else
+    wheel->slots[timer->deadline & (TIMING_WHEEL_SLOTS - 1)] = timer->next;
+  if (timer->next)
+    timer->next->prev = timer->prev;
+  timer->deadline = 0;
+}
+
+/**
+ * @brief Take the next timer whose deadline has passed out of the wheel.
+ *
+ * Only the slots of the seconds elapsed since the previous calls are
+ * visited, so the cost does not depend on the number of timers but on the
+ * number expiring. Called in a loop until it returns NULL, the timers
+ * returned being free to be added again or forgotten.
+ *
+ * @param wheel The wheel.
+ * @param now The current second.
+ * @return A timer whose deadline is now or earlier, or NULL if there is none
+ * left.
+ */
+wheel_timer *timing_wheel_expire(timing_wheel *wheel, time_t now) {
+  if (wheel->tick == 0 || now - wheel->tick > TIMING_WHEEL_SLOTS)
+    wheel->tick = now - TIMING_WHEEL_SLOTS; // Each slot is visited once at most
+
+  while (wheel->tick < now) {
+    // Timers a whole turn later share the slot
+    wheel_timer *timer =
+        wheel->slots[(wheel->tick + 1) & (TIMING_WHEEL_SLOTS - 1)];
+    while (timer && timer->deadline > now)
+      timer = timer->next;
+    if (timer) {
+      timing_wheel_remove(wheel, timer);
+      return timer;
+    }
+    wheel->tick++;
+  }
+  return NULL;
+}
@@ -0,0 +1,32 @@
+/* timing_wheel.h */
+
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <time.h>
+
+// Slots of a timing wheel, one per second, a power of two: deadlines must
+// fall within one turn of the wheel
+#define TIMING_WHEEL_SLOTS 64
+
+// A deadline, embedded in whatever it times out
+typedef struct wheel_timer {
+  time_t deadline; // 0 while not in a wheel
+  struct wheel_timer *next; // Links in the slot of the deadline
+  struct wheel_timer *prev;
+} wheel_timer;
+
+// Hashed timing wheel: the timers that expire at second t are linked from
+// slot t % TIMING_WHEEL_SLOTS, so that adding, removing and expiring one
+// costs the same however many there are.
+typedef struct timing_wheel {
+  wheel_timer *slots[TIMING_WHEEL_SLOTS];
+  time_t tick; // The last second whose slot was expired, 0 before any
+} timing_wheel;
+
+void timing_wheel_add(timing_wheel *wheel, wheel_timer *timer,
+                      time_t deadline);
+void timing_wheel_remove(timing_wheel *wheel, wheel_timer *timer);
+wheel_timer *timing_wheel_expire(timing_wheel *wheel, time_t now);
+
+#endif
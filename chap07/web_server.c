@@ -1,32 +1,474 @@
 /* web_server.c */
 
+// Unlike the other servers of this chapter, web_server only builds on POSIX
+// systems: it is made of threads, mappings, worker processes and
+// non-blocking descriptors. It is meant for Linux, where it runs on epoll or
+// io_uring, sendfile() and inotify, and falls back on select(), mmap() and
+// revalidation elsewhere.
+#if defined(_WIN32)
+#error "web_server needs a POSIX system, see web_server2.c for Windows"
+#endif
+
+#if defined(__linux__)
+#define _GNU_SOURCE // For accept4()
+#endif
+
 #include "chap07.h"
+#include "access_log.h"
+#include "client_table.h"
+#include "date_cache.h"
+#include "file_cache.h"
+#include "http_builder.h"
+#include "http_parser.h"
+#include "metrics.h"
+#include "mime_types.h"
+#include "path_tree.h"
+#include "timing_wheel.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#endif
+#include <sys/wait.h>
+
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#endif
+#if defined(USE_IO_URING)
+#include "io_ring.h"
+#include <poll.h>
+#endif
+#if defined(USE_ZLIB)
+#include <zlib.h>
+#endif
 
 #define MAX_REQUEST_SIZE 2047
+// Longest path accepted in a request, once normalized
+#define MAX_PATH_LENGTH 100
+// Seconds a connection may sit without sending a byte of its next request,
+// its first one included, before it is closed
+#define KEEP_ALIVE_TIMEOUT 5
+// Seconds a client has to send the rest of the request line and headers once
+// their first byte arrived, however slowly they trickle in
+#define HEADER_TIMEOUT 10
+// Seconds a client may pause while sending a request body
+#define BODY_TIMEOUT 10
+// Seconds a client may go without taking any of its response
+#define WRITE_TIMEOUT 30
+// Requests answered on one connection before it is closed anyway
+#define MAX_KEEP_ALIVE_REQUESTS 100
+// Clients connected at once at most, see client_table.h
+#define MAX_CLIENTS CLIENT_TABLE_SIZE
+// Connections accepted per wakeup of the event loop at most: a connection
+// storm is drained in batches, without starving the clients already there
+#define MAX_ACCEPTS 64
+// Size of the pooled buffers. A request buffer starts with the state of the
+// request parser, followed by up to MAX_REQUEST_SIZE bytes of request.
+#define BUFFER_SIZE 4096
+// Buffers are carved out of chunks holding this many of them
+#define REQUEST_BUFFERS_PER_CHUNK 64
+
+#if defined(USE_EPOLL)
+// Upper bound of readiness events harvested per epoll_wait() call
+#define MAX_EVENTS 256
+#endif
+
+#if defined(USE_IO_URING)
+// Size of the io_uring submission queue, a power of two
+#define RING_ENTRIES 1024
+// Provided buffers receives pick from: a connection only holds one while its
+// data does not fit in its request buffer
+#define RING_BUFFERS 1024
+#define RING_BUFFER_SIZE 2048
+#define RING_BUFFER_GROUP 0
+// Most bytes of a file range spliced through a pipe at once, the default size
+// of a pipe
+#define RING_SPLICE_SIZE 65536
+// Empty pipes kept for the next responses
+#define RING_PIPES 64
+// The low bits of the user data of an io_uring operation tell what it is, the
+// others which client it is for
+#define RING_OP_BITS 3
+#endif
+
+// Most pieces a response is made of, such as its headers and its body, or
+// the parts of a multipart/byteranges body and the headers between them
+#define MAX_SEGMENTS 16
+// Separates the parts of multipart/byteranges bodies
+#define MULTIPART_BOUNDARY "3157_byteranges_7e1c9a4f"
 
-// Struct to store information about each connected client in linked list
+// Larger files are always sent from disk with sendfile()
+#define FILE_CACHE_MAX_FILE (1024 * 1024)
+// Seconds a cached file is trusted before it is checked against the disk again
+#define FILE_CACHE_REVALIDATE 1
+// The same for a file whose changes inotify reports: this only bounds how
+// stale a change it cannot see leaves it, one made through a link from
+// outside public/
+#define FILE_CACHE_WATCHED_REVALIDATE 60
+// Threads doing the blocking file system calls of each event loop, unless
+// --io-threads says otherwise
+#define IO_THREADS 4
+// Most files that may answer a request: its br and gzip siblings, itself
+// gzipped on the fly, and itself
+#define MAX_CANDIDATES 4
+// Path the counters of the server are exposed at, see send_metrics()
+#define METRICS_PATH "/metrics"
+// Bytes of the /metrics response body at most
+#define METRICS_SIZE 16384
+
+// CLIENT_READING clients hold a request buffer. CLIENT_WAITING and
+// CLIENT_WRITING clients keep it, since pipelined requests may follow the one
+// being answered. CLIENT_WAITING clients wait for an I/O thread to find the
+// file they asked for, CLIENT_WRITING ones also hold a second buffer for the
+// write queue of the response.
+enum client_state {
+  CLIENT_IDLE,
+  CLIENT_READING,
+  CLIENT_WAITING,
+  CLIENT_WRITING
+};
+
+// What a client is given time for, see set_timeout()
+enum client_timeout {
+  TIMEOUT_KEEP_ALIVE, // Sending the first byte of its next request
+  TIMEOUT_HEADER,     // Sending the rest of the request line and headers
+  TIMEOUT_BODY,       // Sending more of the request body
+  TIMEOUT_WRITE       // Taking more of the response
+};
+_Static_assert(KEEP_ALIVE_TIMEOUT < TIMING_WHEEL_SLOTS &&
+                   HEADER_TIMEOUT < TIMING_WHEEL_SLOTS &&
+                   BODY_TIMEOUT < TIMING_WHEEL_SLOTS &&
+                   WRITE_TIMEOUT < TIMING_WHEEL_SLOTS,
+               "a timeout must expire within one turn of the timing wheel");
+_Static_assert(TIMEOUT_WRITE + 1 == METRICS_TIMEOUTS,
+               "each timeout must have its own counter");
+
+// One piece of a response: bytes in memory, or a range of a file
+typedef struct segment {
+  const char *data; // Next bytes to send, NULL for a file range left unmapped
+  int file;         // File the range comes from, or -1
+  off_t offset;     // Next byte of the file to send
+  off_t remaining;  // Bytes still to send
+  char *map;        // Mapping of the file range, if any
+  size_t map_length;
+  struct cache_entry *entry; // Cached file data belongs to, if any
+} segment;
+
+// Outbound queue of a response. It sits at the front of a pooled buffer,
+// followed by the text of the response headers, so that a client stalled on
+// a slow connection holds one buffer and references to cached files, whatever
+// the size of the response.
+typedef struct write_queue {
+  segment segments[MAX_SEGMENTS];
+  int head;        // First segment not sent in full
+  int count;       // Segments in the queue
+  http_builder text; // Of the text stored after the queue
+  size_t text_queued; // Bytes of that text queued already
+  char *body;      // Body formatted on the heap, owned by the queue, or NULL
+#if defined(USE_IO_URING)
+  // The operation in flight reads its arguments from here until it completes
+  struct msghdr message;
+  struct iovec parts[MAX_SEGMENTS];
+  int pipe[2]; // Pipe file ranges are spliced through, or -1
+  off_t piped; // Bytes of the current file range in the pipe
+#endif
+} write_queue;
+#define QUEUE_TEXT_SIZE (BUFFER_SIZE - (int)sizeof(write_queue))
+_Static_assert(sizeof(http_request) + MAX_REQUEST_SIZE <= BUFFER_SIZE,
+               "a request and its parser state must fit in a buffer");
+
+// A file about to be sent, from the file cache
+typedef struct file_view {
+  cache_entry *entry; // The cached file
+  off_t size;
+  time_t mtime;
+  const mime_type *type;
+  enum content_encoding encoding;
+  const file_validators *validators;
+} file_view;
+
+// A file that may answer a request, the candidates of a request being tried
+// in order of preference
+typedef struct file_candidate {
+  char path[128];                 // The file to open
+  enum content_encoding encoding; // The coding the response is in
+  int gzip;             // Whether the file is gzipped on the fly
+  int cached;           // Whether the cache holds a version of the file
+  file_version version; // The version cached, if any
+} file_candidate;
+
+struct client_info;
+
+// Finding and reading the file that answers a request. The event loop hands
+// it to an I/O thread, which does the blocking calls and fills in the
+// results, then gets it back to answer the request.
+typedef struct file_job {
+  struct client_info *client;
+  const mime_type *type;
+  file_candidate candidates[MAX_CANDIDATES];
+  int count; // Candidates in candidates[]
+  int first; // First candidate to look for on disk, the previous ones are not
+             // cached
+  // Results
+  int found;     // The first candidate found, or -1 if there is none
+  int unchanged; // Whether the candidate found is the version cached
+  int file;      // The file, if too large to read, or -1
+  struct stat file_stat;
+  char *body; // The content of the file, encoded, if read
+  off_t size; // Size of body
+  unsigned events;       // watch_events when the job was submitted
+  struct file_job *next; // Link in the queue of pending or done jobs
+} file_job;
+_Static_assert(sizeof(file_job) <= BUFFER_SIZE,
+               "a file job must fit in a buffer");
+
+// Struct to store the per-connection state the event loop touches on every
+// wakeup. It is kept small so that many of them share a cache line.
 typedef struct client_info {
-  socklen_t address_length;
-  struct sockaddr_storage address;
   SOCKET socket;
-  char request[MAX_REQUEST_SIZE + 1];
   int received;
-  struct client_info *next;
+  enum client_state state;
+  table_entry entry; // Place in clients while connected
+  http_request *parsed; // Parser state, from the buffer pool with request
+  char *request; // Bytes received, in the same buffer, NULL if CLIENT_IDLE
+  int request_length; // Size of the request being answered, in request
+  write_queue *queue; // Response being sent, only held while CLIENT_WRITING
+  int keep_alive; // Whether the connection outlives the current response
+  int requests;   // Requests answered so far on this connection
+  int status;     // Status code of the response being sent
+  uint64_t started; // When the request was complete, in microseconds, or 0
+  enum client_timeout timeout; // What the client is timed for
+  wheel_timer timer;           // When it times out, in timeouts
+#if defined(USE_IO_URING)
+  short ring_buffer; // Provided buffer holding data not taken yet, or -1
+  unsigned short ring_offset; // Where that data starts in the buffer
+  unsigned short ring_length; // How much of it there is
+  unsigned char ring_eof;     // Whether the connection was closed or failed
+  unsigned char receiving;    // Whether a receive is in flight
+  unsigned char sending;      // Whether a send or a splice is in flight
+  unsigned char dropping;     // Whether the client is dropped once they end
+#endif
 } client_info;
 
-// Make the head of the linked list globally available
-static client_info *clients = NULL;
+// Struct to store the per-connection data only needed for logging
+typedef struct client_meta {
+  socklen_t address_length;
+  struct sockaddr_storage address;
+  char host[64];  // The address formatted once accepted, see add_client()
+  long long sent; // Bytes of the current response sent so far
+} client_meta;
+
+// Slab of client_info structs, handed out from the front and recycled through
+// the free list. client_metas[] runs parallel to it: a client and its meta
+// data share the same index.
+static client_info client_slab[MAX_CLIENTS];
+static client_meta client_metas[MAX_CLIENTS];
+static int client_slab_used = 0;
+
+// Connected clients, and the dropped ones kept for reuse
+static client_table clients;
+// Unused request and response buffers, linked through their first bytes
+static char *free_buffers = NULL;
+// Coarse monotonic clock in seconds, updated after each wait for events
+static time_t now = 0;
+// The deadlines of the clients
+static timing_wheel timeouts;
+
+// Error responses, formatted once at startup but for the status, Connection
+// and Date lines, see start_headers()
+typedef struct canned_response {
+  char text[128]; // The other headers, then the body
+  const char *reason;
+  int status;
+  int length;
+  int header_length; // What is sent for a HEAD request
+} canned_response;
+static canned_response response_400;
+static canned_response response_404;
+static canned_response response_405;
+
+// Whether compressible types are negotiated, see plan_candidates()
+static int compress_types = 0;
+// Connections the kernel queues until they are accepted, see listen()
+static int listen_backlog = SOMAXCONN;
+// Seconds a connection is kept from being accepted until its request comes,
+// see TCP_DEFER_ACCEPT, or 0
+static int defer_accept = 0;
+// While the process is out of descriptors or memory, connections are left in
+// the accept queue, see pause_accepting(): since when, or 0, and how many
+// clients were connected then
+static time_t accept_paused_at = 0;
+static int accept_paused_clients = 0;
+
+// I/O threads: file jobs are queued for them, and come back on the done list
+// whose first job wakes the event loop up through io_event
+static int io_threads = IO_THREADS;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_pending = PTHREAD_COND_INITIALIZER;
+static file_job *io_queue_head = NULL;
+static file_job *io_queue_tail = NULL;
+static file_job *io_done_head = NULL;
+static file_job *io_done_tail = NULL;
+static int io_event = -1;       // Read by the event loop: an eventfd or a pipe
+static int io_event_write = -1; // Written by the I/O threads
+
+// Worker processes started by run_workers()
+static pid_t *worker_pids = NULL;
+static int worker_count = 0;
+
+// Files served from public/, and the watches reporting their changes
+static file_cache cache = {.watch_fd = -1};
+
+// Counters of this worker
+static server_metrics *metrics = NULL;
+
+// Access log, unused while its file is -1
+static access_log request_log = {.fd = -1};
+
+#if defined(USE_EPOLL)
+// Interest list every socket is registered into once, for its whole lifetime
+static int epoll_fd = -1;
+#endif
+
+#if defined(USE_IO_URING)
+// Operations submitted to io_uring, see complete_ring_op()
+enum ring_op {
+  RING_ACCEPT,
+  RING_EVENT,
+  RING_RECV,
+  RING_SEND,
+  RING_SPLICE_IN, // From a file to the pipe of a write queue
+  RING_SPLICE_OUT, // From that pipe to the socket
+  RING_WATCH      // Changes to public/, see read_file_events()
+};
+
+// The io_uring instance of the event loop, unused while its fd is -1
+static io_ring ring = {.fd = -1};
+static int free_pipes[RING_PIPES][2];
+static int free_pipe_count = 0;
+#endif
 
 // Helper functions prototypes
-SOCKET create_socket(const char *host, const char *port);
-fd_set wait_on_clients(SOCKET socket_listen);
+SOCKET create_socket(const char *host, const char *port, int reuse_port);
+void run_workers(int workers);
+void stop_workers(int signal_number);
+void run_event_loop(SOCKET server);
+void start_io_threads(void);
+void *run_io_thread(void *unused);
+void complete_file_jobs(void);
+#if defined(USE_EPOLL)
+void raise_file_limit(void);
+void init_event_loop(SOCKET socket_listen);
+int wait_on_clients(struct epoll_event *events);
+#else
+void wait_on_clients(SOCKET socket_listen, fd_set *readfds, fd_set *writefds);
+#endif
+#if defined(USE_IO_URING)
+int init_ring(SOCKET server);
+void run_ring_loop(SOCKET server);
+struct io_uring_sqe *get_ring_sqe(client_info *client, enum ring_op op);
+void arm_accept(SOCKET server);
+void arm_event(void);
+void arm_watch(void);
+void arm_recv(client_info *client);
+void complete_ring_op(SOCKET server, const struct io_uring_cqe *cqe);
+void complete_accept(SOCKET server, const struct io_uring_cqe *cqe);
+void complete_recv(client_info *client, const struct io_uring_cqe *cqe);
+void complete_send(client_info *client, enum ring_op op, int result);
+int take_ring_data(client_info *client, char *data, int length);
+int flush_ring(client_info *client);
+int acquire_pipe(int ends[2]);
+void release_pipe(int ends[2], int empty);
+#endif
+void accept_client(SOCKET socket_listen);
+int is_out_of_resources(int error);
+void pause_accepting(SOCKET server, int error);
+void resume_accepting(SOCKET server);
+void add_client(SOCKET socket, const struct sockaddr_storage *address,
+                socklen_t address_length);
+void receive_request(client_info *client);
+int handle_request(client_info *client);
 const char *get_client_address(client_info *client);
+client_meta *get_client_meta(client_info *client);
 client_info *get_client(SOCKET socket);
+client_info *table_client(table_entry *entry);
+char *acquire_buffer(void);
+void release_buffer(char *buffer);
+void release_request_buffer(client_info *client);
+void prepare_response(canned_response *response, int status,
+                      const char *reason, const char *headers);
+void begin_response(client_info *client, int status);
+segment *next_segment(client_info *client);
+void queue_buffer(client_info *client, const char *data, size_t length);
+void queue_format(client_info *client, const char *format, ...);
+http_builder *start_headers(client_info *client, int status,
+                            const char *reason);
+void queue_text(client_info *client);
+int send_error(client_info *client, const canned_response *response);
 void send_400(client_info *client);
-void send_404(client_info *client);
+int send_404(client_info *client);
+int send_405(client_info *client);
 void drop_client(client_info *client);
-const char *get_content_type(const char *path);
-void serve_resource(client_info *client, const char *path);
+void update_clock(void);
+uint64_t precise_clock(void);
+void set_timeout(client_info *client, enum client_timeout timeout);
+void cancel_timeout(client_info *client);
+void expire_timeouts(void);
+void read_version(file_version *version, const struct stat *file_stat);
+int is_same_version(const file_version *version,
+                    const struct stat *file_stat);
+char *read_file(int file, off_t size);
+#if defined(USE_ZLIB)
+char *gzip_body(const char *body, off_t size, off_t *gzip_size);
+#endif
+cache_entry *cache_file(const char *path, enum content_encoding encoding,
+                        const mime_type *type, const struct stat *file_stat,
+                        char *body, int file, off_t size);
+int queue_cached_file(client_info *client, cache_entry *entry);
+int queue_cached_range(client_info *client, cache_entry *entry, off_t first,
+                       off_t length);
+const char *encoding_header(enum content_encoding encoding,
+                            const mime_type *type);
+void make_validators(file_validators *validators,
+                     const struct stat *file_stat,
+                     enum content_encoding encoding);
+void view_cached_file(file_view *view, cache_entry *entry);
+void add_candidate(file_job *job, const char *path, const char *suffix,
+                   enum content_encoding encoding, int gzip);
+void plan_candidates(file_job *job, const http_request *request,
+                     const char *path);
+int resolve_file(client_info *client, file_job *job);
+int submit_file_job(file_job *job);
+void run_file_job(file_job *job);
+int complete_file_job(file_job *job);
+int is_not_modified(const http_request *request, const file_view *view);
+int range_applies(const http_request *request, const file_view *view);
+int queue_ranges(client_info *client, const file_view *view,
+                 const http_range *ranges, int count);
+int send_file(client_info *client, const file_view *view);
+int serve_resource(client_info *client, const char *path);
+int map_segment(segment *range);
+void advance_segments(write_queue *queue, ssize_t sent);
+int flush_queue(client_info *client);
+int finish_response(client_info *client);
+void clear_queue(client_info *client);
+#if defined(__linux__)
+void unwatch_files(void);
+void read_file_events(void);
+#endif
+void record_response(client_info *client);
+int send_metrics(client_info *client);
 
 /**
  * @brief Main entry point for the web server.
@@ -37,113 +479,386 @@ void serve_resource(client_info *client, const char *path);
  * malformed or the resource does not exist, it sends an appropriate HTTP
  * response code.
  *
+ * With --workers N, N worker processes each run their own event loop on their
+ * own listening socket, see run_workers(). With --mime-types FILE, the
+ * extensions listed in FILE, in the format of /etc/mime.types, are served
+ * with their type on top of the built-in ones. With --compress, text assets
+ * are sent compressed to the clients that accept it, see plan_candidates().
+ * With --io-threads N, each event loop has N threads doing its blocking file
+ * system calls, see submit_file_job(), or does them itself if N is 0.
+ * With --backlog N, up to N connections wait to be accepted, SOMAXCONN by
+ * default, and with --defer-accept SECONDS, connections are only accepted
+ * once their first request arrives, see create_socket().
+ *
+ * The counters of the server, summed over the workers, are served at
+ * /metrics in the Prometheus text format, see send_metrics(). With
+ * --access-log FILE, each response is logged to FILE, in the Common Log
+ * Format or, with --log-format json, as JSON lines, see access_log_append().
+ *
+ * Built with BACKEND=io_uring, the event loops run on io_uring where the
+ * kernel supports it, see run_ring_loop(), and on epoll otherwise.
+ *
  * @return EXIT_SUCCESS on success, EXIT_FAILURE on error.
  */
-int main(void) {
+int main(int argc, char *argv[]) {
+  int workers = 1;
+  const char *mime_types = NULL;
+  const char *access_log_name = NULL;
+  enum log_format log_format = LOG_COMMON;
+  for (int i = 1; i < argc && workers > 0; ++i) {
+    if (strcmp(argv[i], "--compress") == 0)
+      compress_types = 1;
+    else if (i + 1 == argc)
+      workers = 0;
+    else if (strcmp(argv[i], "--workers") == 0)
+      workers = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--mime-types") == 0)
+      mime_types = argv[++i];
+    else if (strcmp(argv[i], "--io-threads") == 0)
+      io_threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--backlog") == 0)
+      listen_backlog = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--defer-accept") == 0)
+      defer_accept = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--access-log") == 0)
+      access_log_name = argv[++i];
+    else if (strcmp(argv[i], "--log-format") == 0) {
+      const char *format = argv[++i];
+      if (strcmp(format, "json") == 0)
+        log_format = LOG_JSON;
+      else if (strcmp(format, "common") != 0)
+        workers = 0;
+    }
+    else
+      workers = 0;
+  }
+  if (workers < 1 || io_threads < 0 || listen_backlog < 1 ||
+      defer_accept < 0) {
+    fprintf(stderr, "usage: web_server [--workers N] [--mime-types FILE] "
+                    "[--compress] [--io-threads N] [--access-log FILE] "
+                    "[--log-format common|json] [--backlog N] "
+                    "[--defer-accept SECONDS]\n");
+    return EXIT_FAILURE;
+  }
 
-#if defined(_WIN32)
-  WSADATA d;
-  if (WSAStartup(MAKEWORD(2, 2), &d)) {
-    fprintf(stderr, "Failed to initialize.\n");
+  // Opened before any worker is forked: appending, the workers can share it
+  if (access_log_name &&
+      access_log_open(&request_log, access_log_name, log_format) < 0) {
+    fprintf(stderr, "access_log_open() failed. (%d)\n", errno);
     return EXIT_FAILURE;
   }
-#endif
 
-  SOCKET server = create_socket(0, "3157");
-  // If you want to accept connections from the local system only
-  /* SOCKET server = create_socket("127.0.0.1", "3157"); */
+  // Loaded before any worker is forked, so that they all share the table
+  if (mime_types && mime_load(mime_types) < 0) {
+    fprintf(stderr, "mime_load() failed. (%d)\n", errno);
+    return EXIT_FAILURE;
+  }
 
-  while (1) {
-    fd_set readfds;
-    readfds = wait_on_clients(server);
-
-    if (FD_ISSET(server, &readfds)) {
-      // HACK: -1 being an invalid socket specifier it forces get_client to
-      // return a pointer to a freshly allocated client_info.
-      client_info *client = get_client(-1);
-
-      client->socket = accept(server, (struct sockaddr *)&client->address,
-                              &client->address_length);
-      if (!ISVALIDSOCKET(client->socket)) {
-        fprintf(stderr, "accept() failed. (%d)\n", GETSOCKETERRNO());
-        return EXIT_FAILURE;
-      }
+  // A client closing its end mid-response must not kill the whole server:
+  // sendfile() cannot be told MSG_NOSIGNAL, so ignore SIGPIPE and get EPIPE.
+  signal(SIGPIPE, SIG_IGN);
 
-      printf("New connection from %s.\n", get_client_address(client));
-    } // if (FD_ISSET(server, &readfds))
+  prepare_response(&response_400, 400, "Bad Request", "");
+  prepare_response(&response_404, 404, "Not Found", "");
+  prepare_response(&response_405, 405, "Method Not Allowed",
+                   "Allow: GET, HEAD\r\n");
+  update_clock();
+  metrics = metrics_init(workers);
 
-    client_info *client = clients;
-    while (client) {
-      client_info *next = client->next;
+  if (workers > 1) {
+    run_workers(workers);
+  } else {
+    SOCKET server = create_socket(0, "3157", 0);
+    // If you want to accept connections from the local system only
+    /* SOCKET server = create_socket("127.0.0.1", "3157", 0); */
+    run_event_loop(server);
 
-      if (FD_ISSET(client->socket, &readfds)) {
-        if (MAX_REQUEST_SIZE == client->received) {
-          send_400(client);
-          client = next;
-          continue;
-        }
+    // Cleanup routines
+    printf("\nClosing socket...\n");
+    CLOSESOCKET(server);
+  }
 
-        int bytes_received =
-            recv(client->socket, client->request + client->received,
-                 MAX_REQUEST_SIZE - client->received, 0);
+  printf("Finished.\n");
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Fork worker processes serving the same port, and wait for them.
+ *
+ * Each worker binds its own listening socket with SO_REUSEPORT and runs its
+ * own event loop over its own client table, buffers and file cache: nothing
+ * is shared but the counters, each worker writing its own, so nothing needs a
+ * lock. The kernel spreads incoming connections across the listening
+ * sockets, so that accepting and serving scale with the number of cores.
+ *
+ * @param workers The number of worker processes.
+ */
+void run_workers(int workers) {
+  worker_pids = (pid_t *)calloc(workers, sizeof(pid_t));
+  if (!worker_pids) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
 
-        // TEST: Monitor packets split across multiple recv() calls
-        /* printf("\nReceived Data (%d bytes) ->>\n%.*s\n<<-\n", bytes_received,
-               bytes_received, client->request); */
+  // Anything buffered would otherwise be printed once per worker
+  fflush(stdout);
 
-        if (bytes_received < 1) {
-          printf("Unexpected disconnect from %s.\n",
-                 get_client_address(client));
-          drop_client(client);
-        } else {
-          client->received += bytes_received;
-          client->request[client->received] = 0;
-
-          char *q = strstr(client->request, "\r\n\r\n");
-          if (q) {
-            if (strncmp("GET /", client->request, 5)) {
-              send_400(client);
-            } else {
-              char *path = client->request + 4;
-              char *end_path = strstr(path, " ");
-              if (!end_path) {
-                send_400(client);
-              } else {
-                *end_path = 0;
-                serve_resource(client, path);
-              }
-            } // if request line starts with: "GET /"
-          } // if (q)
-        } // if (bytes_received >= 1)
-      } // if (FD_ISSET(client->socket, &readfds))
-
-      client = next;
-    } // while(client)
+  for (int i = 0; i < workers; ++i) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "fork() failed. (%d)\n", errno);
+      stop_workers(SIGTERM);
+    }
+    if (pid == 0) {
+      metrics = metrics_worker(i);
+      SOCKET server = create_socket(0, "3157", 1);
+      run_event_loop(server);
+      exit(EXIT_SUCCESS);
+    }
+    worker_pids[worker_count++] = pid;
+    printf("Started worker %d.\n", (int)pid);
+  }
+
+  // Stopping the server stops its workers along with it
+  signal(SIGINT, stop_workers);
+  signal(SIGTERM, stop_workers);
+
+  // The workers never return on their own: report them as they die
+  int status;
+  pid_t pid;
+  while ((pid = wait(&status)) > 0)
+    printf("Worker %d exited. (%d)\n", (int)pid, status);
+}
+
+/**
+ * @brief Terminate the workers, then the supervising process itself.
+ *
+ * Installed as the SIGINT and SIGTERM handler of the supervising process.
+ *
+ * @param signal_number The signal received, passed on to the workers.
+ */
+void stop_workers(int signal_number) {
+  for (int i = 0; i < worker_count; ++i)
+    kill(worker_pids[i], signal_number);
+  signal(signal_number, SIG_DFL);
+  raise(signal_number);
+}
+
+/**
+ * @brief Accept clients and serve their requests, forever.
+ *
+ * @param server The socket the server is listening on.
+ */
+void run_event_loop(SOCKET server) {
+  start_io_threads();
+  access_log_start(&request_log);
+#if defined(__linux__)
+  file_cache_watch(&cache, "public", now);
+#endif
+#if defined(USE_IO_URING)
+  if (init_ring(server)) {
+    run_ring_loop(server);
+    return;
+  }
+  printf("io_uring unavailable, using epoll.\n");
+#endif
+  // accept_client() accepts until it would block
+  fcntl(server, F_SETFL, fcntl(server, F_GETFL, 0) | O_NONBLOCK);
+#if defined(USE_EPOLL)
+  init_event_loop(server);
+
+  while (1) {
+    struct epoll_event events[MAX_EVENTS];
+    int ready = wait_on_clients(events);
+    update_clock();
+
+    // Only the sockets that actually have something to say are visited. Once
+    // a response is complete, requests pipelined behind it are answered.
+    for (int i = 0; i < ready; ++i) {
+      client_info *client = events[i].data.ptr;
+      if (!client)
+        accept_client(server);
+      else if (client == (client_info *)&io_event)
+        complete_file_jobs();
+#if defined(__linux__)
+      else if (client == (client_info *)&cache.watch_fd)
+        read_file_events();
+#endif
+      else if (!client_table_contains(&clients, &client->entry))
+        continue; // Dropped while an earlier event of the batch was handled
+      else if (client->state == CLIENT_WAITING)
+        continue; // Resumed by complete_file_jobs(), which reads what is due
+      else if (client->state == CLIENT_WRITING) {
+        if (flush_queue(client))
+          receive_request(client);
+      } else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP |
+                                     EPOLLERR))
+        receive_request(client);
+    }
+
+    expire_timeouts();
+    resume_accepting(server);
+    client_table_recycle(&clients);
   } // while(1)
+#else
+  while (1) {
+    fd_set readfds, writefds;
+    wait_on_clients(server, &readfds, &writefds);
+    update_clock();
+
+    if (FD_ISSET(server, &readfds))
+      accept_client(server);
+    if (io_event >= 0 && FD_ISSET(io_event, &readfds))
+      complete_file_jobs();
+#if defined(__linux__)
+    if (cache.watch_fd >= 0 && FD_ISSET(cache.watch_fd, &readfds))
+      read_file_events();
+#endif
 
-  // Cleanup routines
-  printf("\nClosing socket...\n");
-  CLOSESOCKET(server);
+    // Walk backwards: a client dropped by receive_request() has its slot
+    // refilled by the last client, which has already been visited.
+    for (int i = clients.count - 1; i >= 0; --i) {
+      client_info *client = table_client(clients.live[i]);
+      if (FD_ISSET(client->socket, &writefds)) {
+        if (flush_queue(client))
+          receive_request(client);
+      } else if (FD_ISSET(client->socket, &readfds))
+        receive_request(client);
+    }
 
-#if defined(_WIN32)
-  WSACleanup();
+    expire_timeouts();
+    resume_accepting(server);
+    client_table_recycle(&clients);
+  } // while(1)
 #endif
+}
 
-  printf("Finished.\n");
-  return EXIT_SUCCESS;
+/**
+ * @brief Start the I/O threads of the event loop, if any.
+ *
+ * Called by each worker after it is forked, since threads do not survive
+ * fork(). The threads report completed jobs through an eventfd, or a pipe
+ * where there is none, which the event loop watches like a socket.
+ */
+void start_io_threads(void) {
+  if (io_threads == 0)
+    return;
+
+#if defined(__linux__)
+  io_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  io_event_write = io_event;
+  if (io_event < 0) {
+    fprintf(stderr, "eventfd() failed. (%d)\n", errno);
+    exit(EXIT_FAILURE);
+  }
+#else
+  int ends[2];
+  if (pipe(ends) < 0) {
+    fprintf(stderr, "pipe() failed. (%d)\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  fcntl(ends[0], F_SETFL, fcntl(ends[0], F_GETFL, 0) | O_NONBLOCK);
+  fcntl(ends[1], F_SETFL, fcntl(ends[1], F_GETFL, 0) | O_NONBLOCK);
+  io_event = ends[0];
+  io_event_write = ends[1];
+#endif
+
+  for (int i = 0; i < io_threads; ++i) {
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, run_io_thread, NULL);
+    if (error) {
+      fprintf(stderr, "pthread_create() failed. (%d)\n", error);
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+}
+
+/**
+ * @brief Run file jobs as they are queued, forever.
+ *
+ * The jobs only touch their own memory and the file system: the cache and the
+ * clients are left to the event loop, so nothing else needs a lock.
+ *
+ * @param unused Unused.
+ * @return Never returns.
+ */
+void *run_io_thread(void *unused) {
+  (void)unused;
+  while (1) {
+    pthread_mutex_lock(&io_lock);
+    while (!io_queue_head)
+      pthread_cond_wait(&io_pending, &io_lock);
+    file_job *job = io_queue_head;
+    io_queue_head = job->next;
+    pthread_mutex_unlock(&io_lock);
+
+    run_file_job(job);
+
+    // Only the first job of the done list wakes the event loop up: it takes
+    // the whole list at once
+    job->next = NULL;
+    pthread_mutex_lock(&io_lock);
+    int wake = io_done_head == NULL;
+    if (io_done_tail && !wake)
+      io_done_tail->next = job;
+    else
+      io_done_head = job;
+    io_done_tail = job;
+    pthread_mutex_unlock(&io_lock);
+    if (wake) {
+      uint64_t one = 1;
+      if (write(io_event_write, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "write() failed. (%d)\n", errno);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Answer the requests whose file jobs are done.
+ *
+ * The wakeup is consumed before the done list is taken, so that a job
+ * completed in between wakes the event loop up again. Requests pipelined
+ * behind the answered ones are read on, as when a response is flushed.
+ */
+void complete_file_jobs(void) {
+  uint64_t count;
+  while (read(io_event, &count, sizeof(count)) > 0)
+    ;
+
+  pthread_mutex_lock(&io_lock);
+  file_job *job = io_done_head;
+  io_done_head = io_done_tail = NULL;
+  pthread_mutex_unlock(&io_lock);
+
+  while (job) {
+    file_job *next = job->next;
+    client_info *client = job->client;
+    if (complete_file_job(job))
+      receive_request(client);
+    job = next;
+  }
 }
 
 /**
  * @brief Create a socket and configure it to listen on a given host and port.
  *
  * The function configures a local address and port for the server, binds a
- * socket to it, and puts it into listening mode.
+ * socket to it, and puts it into listening mode. Up to listen_backlog
+ * connections are queued by the kernel until they are accepted, the system
+ * capping it (net.core.somaxconn on Linux). With defer_accept, the kernel
+ * keeps a connection to itself until its first bytes arrive, or
+ * defer_accept seconds pass: the server never wakes up for clients that
+ * have not said anything yet.
  *
  * @param host The host where the server is listening
  * @param port The port where the server is listening
+ * @param reuse_port Whether other sockets may listen on the same port, each
+ * receiving its share of the connections (SO_REUSEPORT)
  * @return The socket that is listening
  */
-SOCKET create_socket(const char *host, const char *port) {
+SOCKET create_socket(const char *host, const char *port, int reuse_port) {
   // Configure local address the server is listening on
   printf("Configuring local address...\n");
   struct addrinfo hints;
@@ -165,6 +880,33 @@ SOCKET create_socket(const char *host, const char *port) {
     exit(EXIT_FAILURE);
   }
 
+  if (reuse_port) {
+#if defined(SO_REUSEPORT)
+    int yes = 1;
+    if (setsockopt(socket_listen, SOL_SOCKET, SO_REUSEPORT, (void *)&yes,
+                   sizeof(yes)) < 0) {
+      fprintf(stderr, "setsockopt() failed. (%d)\n", GETSOCKETERRNO());
+      exit(EXIT_FAILURE);
+    }
+#else
+    fprintf(stderr, "SO_REUSEPORT is not supported.\n");
+    exit(EXIT_FAILURE);
+#endif
+  }
+
+  if (defer_accept) {
+#if defined(TCP_DEFER_ACCEPT)
+    if (setsockopt(socket_listen, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   (void *)&defer_accept, sizeof(defer_accept)) < 0) {
+      fprintf(stderr, "setsockopt() failed. (%d)\n", GETSOCKETERRNO());
+      exit(EXIT_FAILURE);
+    }
+#else
+    fprintf(stderr, "TCP_DEFER_ACCEPT is not supported.\n");
+    exit(EXIT_FAILURE);
+#endif
+  }
+
   // Bind socket to local address
   printf("Bind socket to local address...\n");
   if (bind(socket_listen, bind_address->ai_addr, bind_address->ai_addrlen)) {
@@ -175,7 +917,7 @@ SOCKET create_socket(const char *host, const char *port) {
 
   // Put socket into listening mode
   printf("Listening at http://127.0.0.1:%s/\n", port);
-  if (listen(socket_listen, 10) < 0) {
+  if (listen(socket_listen, listen_backlog) < 0) {
     fprintf(stderr, "listen() failed. (%d)\n", GETSOCKETERRNO());
     exit(EXIT_FAILURE);
   }
@@ -183,282 +925,2438 @@ SOCKET create_socket(const char *host, const char *port) {
   return socket_listen;
 }
 
+#if defined(USE_EPOLL)
 /**
- * @brief Wait for incoming data from any of the existing clients.
+ * @brief Raise the soft limit on open file descriptors to the hard limit.
  *
- * This function will block until an existing client sends data, or a new client
- * attempts to connect. It should be called in a loop to handle incoming data.
- *
- * @param socket_listen The socket to listen on.
- * @return A file descriptor set indicating which sockets have data waiting.
+ * The whole point of epoll, or io_uring, is to go past the 1024 sockets
+ * select() can watch.
  */
-fd_set wait_on_clients(SOCKET socket_listen) {
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(socket_listen, &readfds);
-  SOCKET max_socket = socket_listen;
+void raise_file_limit(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
 
-  client_info *client = clients;
+/**
+ * @brief Set up the epoll instance and register the listening socket.
+ *
+ * The limit on open file descriptors is raised first. The listening socket
+ * stays level-triggered: accept_client() takes up to MAX_ACCEPTS connections
+ * per wakeup and epoll keeps reporting the socket while some are left.
+ *
+ * @param socket_listen The socket the server is listening on.
+ */
+void init_event_loop(SOCKET socket_listen) {
+  raise_file_limit();
 
-  // Add all client sockets to the file descriptor set
-  while (client) {
-    FD_SET(client->socket, &readfds);
-    if (client->socket > max_socket)
-      max_socket = client->socket;
-    client = client->next;
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    fprintf(stderr, "epoll_create1() failed. (%d)\n", GETSOCKETERRNO());
+    exit(EXIT_FAILURE);
   }
 
-  if (select(max_socket + 1, &readfds, 0, 0, 0) < 0) {
-    fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+  // A NULL data pointer tells the listening socket apart from the clients
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_listen, &event) < 0) {
+    fprintf(stderr, "epoll_ctl() failed. (%d)\n", GETSOCKETERRNO());
     exit(EXIT_FAILURE);
   }
 
-  return readfds;
+  // And the address of io_event tells the I/O threads' wakeups apart
+  if (io_event >= 0) {
+    event.data.ptr = &io_event;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, io_event, &event) < 0) {
+      fprintf(stderr, "epoll_ctl() failed. (%d)\n", GETSOCKETERRNO());
+      exit(EXIT_FAILURE);
+    }
+  }
+#if defined(__linux__)
+  // As that of the inotify descriptor tells the changes to public/ apart
+  if (cache.watch_fd >= 0) {
+    event.data.ptr = &cache.watch_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cache.watch_fd, &event) < 0) {
+      fprintf(stderr, "epoll_ctl() failed. (%d)\n", GETSOCKETERRNO());
+      exit(EXIT_FAILURE);
+    }
+  }
+#endif
 }
 
 /**
- * @brief Converts a client_info struct into a string representation of the IP
- *        address.
+ * @brief Wait for incoming data from any of the existing clients.
  *
- * This function is a helper that converts the IP address stored in a
- * client_info struct into a string. The string is stored in a static buffer and
- * is overwritten each time the function is called. Do not use this function
- * concurrently since it is not re-entrant safe.
+ * Unlike the select() version, nothing is rebuilt on each call: sockets are
+ * registered once by accept_client() and removed by drop_client(), so the cost
+ * of a wakeup only depends on the number of ready sockets. The wait is cut
+ * short after a second so that idle connections can be timed out.
  *
- * @param client The client_info pointer to convert.
- * @return A string representation of the client's IP address.
+ * @param events Array of at least MAX_EVENTS entries to fill in.
+ * @return The number of ready entries stored in events.
  */
-const char *get_client_address(client_info *client) {
-  static char address_buffer[100];
-  getnameinfo((struct sockaddr *)&client->address, client->address_length,
-              address_buffer, sizeof(address_buffer), NULL, 0, NI_NUMERICHOST);
-  return address_buffer;
-}
+int wait_on_clients(struct epoll_event *events) {
+  int ready;
+  do {
+    ready = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
+  } while (ready < 0 && errno == EINTR);
+
+  if (ready < 0) {
+    fprintf(stderr, "epoll_wait() failed. (%d)\n", GETSOCKETERRNO());
+    exit(EXIT_FAILURE);
+  }
 
+  return ready;
+}
+#else
 /**
- * @brief Retrieve connected client_info structure for a given socket.
+ * @brief Wait for incoming data from any of the existing clients.
  *
- * This function searches the linked list of connected clients to find the
- * client_info associated with the specified socket. If no such client_info
- * exists, a new one is allocated and added to the list.
+ * This function will block until an existing client sends data, a client in
+ * the middle of a response can take more of it, or a new client attempts to
+ * connect, but no longer than a second so that idle connections can be timed
+ * out. It should be called in a loop to handle incoming data.
  *
- * @param socket The socket associated with the client to retrieve.
- * @return Either a pointer the connected client_info or to an unconnected
- * client_info newly allocated.
+ * @param socket_listen The socket to listen on.
+ * @param readfds Filled with the sockets that have data waiting.
+ * @param writefds Filled with the sockets ready to send more response body.
  */
-client_info *get_client(SOCKET socket) {
-  client_info *client = clients;
-  // Search for the connected client_info in the linked list
-  while (client) {
-    if (client->socket == socket)
-      return client;
-    client = client->next;
+void wait_on_clients(SOCKET socket_listen, fd_set *readfds, fd_set *writefds) {
+  FD_ZERO(readfds);
+  FD_ZERO(writefds);
+  // Left out while accepting is paused, see pause_accepting()
+  if (!accept_paused_at)
+    FD_SET(socket_listen, readfds);
+  SOCKET max_socket = socket_listen;
+  if (io_event >= 0) {
+    FD_SET(io_event, readfds);
+    if (io_event > max_socket)
+      max_socket = io_event;
   }
+#if defined(__linux__)
+  if (cache.watch_fd >= 0) {
+    FD_SET(cache.watch_fd, readfds);
+    if (cache.watch_fd > max_socket)
+      max_socket = cache.watch_fd;
+  }
+#endif
 
-  // NOTE: This section of the function is responsible for giving birth to the
-  // whole linked list from the first node, pointed to by clients, to all
-  // subsequent prepended nodes.
+  // Add all client sockets to the file descriptor sets, but those waiting
+  // for their file: they are not read from until it is sent
+  for (int i = 0; i < clients.count; ++i) {
+    client_info *client = table_client(clients.live[i]);
+    SOCKET socket = client->socket;
+    if (client->state == CLIENT_WRITING)
+      FD_SET(socket, writefds);
+    else if (client->state != CLIENT_WAITING)
+      FD_SET(socket, readfds);
+    if (socket > max_socket)
+      max_socket = socket;
+  }
 
-  // Allocate a new client_info if not found
-  client = (client_info *)calloc(1, sizeof(client_info));
-  if (!client) {
-    fprintf(stderr, "Out of memory.\n");
+  struct timeval timeout;
+  timeout.tv_sec = 1;
+  timeout.tv_usec = 0;
+  if (select(max_socket + 1, readfds, writefds, 0, &timeout) < 0) {
+    fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
     exit(EXIT_FAILURE);
   }
-  // Initialize the new client_info and add it to the list.
-  client->address_length = sizeof(client->address);
-  client->next = clients;
-  clients = client;
-  return client;
 }
+#endif
 
+#if defined(USE_IO_URING)
 /**
- * @brief Send a 400 error response to the client and close the connection.
+ * @brief Set up io_uring for the event loop, if the kernel supports it.
  *
- * This function sends a 400 error response to the client and then closes the
- * connection.
+ * Besides io_uring itself, the loop needs rings of provided buffers and
+ * multishot accepts (Linux 5.19), completions that are never dropped, and
+ * timeouts on waits. If anything is missing, the loop runs on epoll instead.
  *
- * @param client The client to send the error response to.
+ * Sockets are left blocking: io_uring waits for them itself, where it would
+ * fail operations on non-blocking ones with EAGAIN.
+ *
+ * @param server The socket the server is listening on.
+ * @return 1 if the loop runs on io_uring, 0 otherwise.
  */
-void send_400(client_info *client) {
-  const char *buf_400 = "HTTP/1.1 400 Bad Request\r\n"
-                        "Connection: close\r\n"
-                        "Content-Length: 11\r\n\r\n"
-                        "Bad Request";
-  send(client->socket, buf_400, strlen(buf_400), 0);
-  drop_client(client);
+int init_ring(SOCKET server) {
+  if (io_ring_init(&ring, RING_ENTRIES) < 0)
+    return 0;
+  if (!(ring.features & IORING_FEAT_NODROP) ||
+      !(ring.features & IORING_FEAT_EXT_ARG) ||
+      io_ring_provide_buffers(&ring, RING_BUFFER_GROUP, RING_BUFFERS,
+                              RING_BUFFER_SIZE) < 0) {
+    io_ring_exit(&ring);
+    return 0;
+  }
+
+  raise_file_limit();
+  arm_accept(server);
+  if (io_event >= 0)
+    arm_event();
+  if (cache.watch_fd >= 0)
+    arm_watch();
+  return 1;
 }
 
 /**
- * @brief Send a 404 error response to the client and close the connection.
+ * @brief Run the event loop on io_uring, forever.
  *
- * This function sends a 404 error response to the client and then closes the
- * connection.
+ * Instead of being told which sockets are ready, the loop submits the
+ * operations themselves and is told when they are done. The operations
+ * submitted while handling completions are all submitted by the single
+ * io_uring_enter() call that waits for the next ones, so a request costs a
+ * couple of system calls at most, shared with every other request of the
+ * same batch. As with epoll, the wait is cut short after a second so that
+ * idle connections can be timed out.
  *
- * @param client The client to send the error response to.
+ * @param server The socket the server is listening on.
  */
-void send_404(client_info *client) {
-  const char *buf_404 = "HTTP/1.1 404 Not Found\r\n"
-                        "Connection: close\r\n"
-                        "Content-Length: 9\r\n\r\n"
-                        "Not Found";
-  send(client->socket, buf_404, strlen(buf_404), 0);
-  drop_client(client);
+void run_ring_loop(SOCKET server) {
+  while (1) {
+    if (io_ring_submit_and_wait(&ring, 1000) < 0) {
+      fprintf(stderr, "io_uring_enter() failed. (%d)\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    update_clock();
+
+    struct io_uring_cqe cqe;
+    while (io_ring_next_cqe(&ring, &cqe))
+      complete_ring_op(server, &cqe);
+
+    expire_timeouts();
+    resume_accepting(server);
+    client_table_recycle(&clients);
+  } // while(1)
 }
 
 /**
- * @brief Free a client_info struct from the linked list.
+ * @brief Take a submission queue entry for an operation of a client.
  *
- * This function searches for the specified client_info pointer in the linked
- * list and removes it, effectively disconnecting the client. If the client_info
- * is not found, the program exitsiwith an error.
+ * The operation and the index of the client in the slab are packed into the
+ * user data of the entry, which its completion carries back.
  *
- * @param client The pointer to the client_info to remove.
+ * @param client The client, or NULL for the listening socket and io_event.
+ * @param op The operation.
+ * @return The entry, cleared, which the caller fills in.
  */
-void drop_client(client_info *client) {
-  // Close the socket
-  CLOSESOCKET(client->socket);
+struct io_uring_sqe *get_ring_sqe(client_info *client, enum ring_op op) {
+  struct io_uring_sqe *sqe = io_ring_get_sqe(&ring);
+  if (!sqe) {
+    fprintf(stderr, "io_uring_enter() failed. (%d)\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  uint64_t index = client ? (uint64_t)(client - client_slab) : 0;
+  sqe->user_data = index << RING_OP_BITS | op;
+  return sqe;
+}
 
-  // Search the linked list for the client_info
-  client_info **ptr = &clients;
+/**
+ * @brief Submit a multishot accept on the listening socket.
+ *
+ * A single submission completes once per connection accepted, until the
+ * kernel ends it.
+ *
+ * @param server The socket the server is listening on.
+ */
+void arm_accept(SOCKET server) {
+  struct io_uring_sqe *sqe = get_ring_sqe(NULL, RING_ACCEPT);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
 
-  while (*ptr) {
-    if (*ptr == client) {
-      // Client_info was found, remove it from the list
-      *ptr = client->next;
-      free(client);
-      return;
-    }
-    ptr = &(*ptr)->next;
-  }
+/**
+ * @brief Submit a multishot poll on io_event, so that the I/O threads can
+ *        wake the loop up.
+ */
+void arm_event(void) {
+  struct io_uring_sqe *sqe = get_ring_sqe(NULL, RING_EVENT);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = io_event;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+}
 
-  // Client_info was not found, exit with error
-  fprintf(stderr, "drop_client not found.\n");
-  exit(EXIT_FAILURE);
+/**
+ * @brief Submit a multishot poll on the inotify descriptor, so that changes
+ *        are reported to the loop.
+ */
+void arm_watch(void) {
+  struct io_uring_sqe *sqe = get_ring_sqe(NULL, RING_WATCH);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = cache.watch_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
 }
 
 /**
- * @brief Return the MIME type of a file given its path.
+ * @brief Submit a receive for a client.
  *
- * If the file type is not recognized, the function returns
- * "application/octet-stream".
+ * The receive picks a provided buffer once data arrives, so a connection
+ * waiting for its next request holds no memory.
  *
- * @param path The path of the file
- * @return The MIME type of the file
+ * @param client The client, with no receive in flight.
  */
-const char *get_content_type(const char *path) {
-  const char *last_dot = strrchr(path, '.');
-  if (last_dot) {
-    // clang-format off
-    if (strcmp(last_dot, ".css")  == 0) return "text/css";
-    if (strcmp(last_dot, ".csv")  == 0) return "text/csv";
-    if (strcmp(last_dot, ".htm")  == 0) return "text/html";
-    if (strcmp(last_dot, ".html") == 0) return "text/html";
-    if (strcmp(last_dot, ".txt")  == 0) return "text/plain";
-    if (strcmp(last_dot, ".gif")  == 0) return "image/gif";
-    if (strcmp(last_dot, ".ico")  == 0) return "image/x-icon";
-    if (strcmp(last_dot, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(last_dot, ".jpg")  == 0) return "image/jpeg";
-    if (strcmp(last_dot, ".png")  == 0) return "image/png";
-    if (strcmp(last_dot, ".svg")  == 0) return "image/svg+xml";
-    if (strcmp(last_dot, ".js")   == 0) return "application/javascript";
-    if (strcmp(last_dot, ".json") == 0) return "application/json";
-    if (strcmp(last_dot, ".pdf")  == 0) return "application/pdf";
-    if (strcmp(last_dot, ".xml")  == 0) return "application/xml";
-    // clang-format on
-  }
-  return "application/octet-stream";
+void arm_recv(client_info *client) {
+  struct io_uring_sqe *sqe = get_ring_sqe(client, RING_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client->socket;
+  sqe->len = RING_BUFFER_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RING_BUFFER_GROUP;
+  client->receiving = 1;
 }
 
 /**
- * @brief Send a resource to the client.
+ * @brief Handle the completion of an io_uring operation.
  *
- * This function takes a connected client and requested resource path then send
- * the connected client the requested resource. The server expects all hosted
- * files to be in a subdirectory called public. Ideally, the server should not
- * allow access to any files outside of this public directory. However, as we
- * shall see, enforcing this restriction may be more difficult than it first
- * appears.
+ * A client being dropped only waits for its operations to end: the last one
+ * to complete drops it for good.
  *
- * @param client The client to send the resource to.
- * @param path The path of the resource to send.
+ * @param server The socket the server is listening on.
+ * @param cqe The completion.
  */
-void serve_resource(client_info *client, const char *path) {
-  // DEBUG: Production servers would print at least date, time, request method,
-  // client's user-agent string and response code...
-  printf("serve_resource initiated %s %s\n", get_client_address(client), path);
-
-  // Redirect root request and prevent long or obviously malicious requests:
-  if (strcmp(path, "/") == 0)
-    path = "/index.html";
-  if (strlen(path) > 100) {
-    send_400(client);
+void complete_ring_op(SOCKET server, const struct io_uring_cqe *cqe) {
+  enum ring_op op = cqe->user_data & ((1 << RING_OP_BITS) - 1);
+  client_info *client = &client_slab[cqe->user_data >> RING_OP_BITS];
+  switch (op) {
+  case RING_ACCEPT:
+    complete_accept(server, cqe);
     return;
-  }
-  if (strstr(path, "..")) {
-    send_404(client);
+  case RING_EVENT:
+    complete_file_jobs();
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      arm_event();
     return;
+  case RING_WATCH:
+    // Polls go on after unwatch_files() until their removal completes
+    if (cache.watch_fd < 0)
+      return;
+    read_file_events();
+    if (cache.watch_fd >= 0 && !(cqe->flags & IORING_CQE_F_MORE))
+      arm_watch();
+    return;
+  case RING_RECV:
+    client->receiving = 0;
+    break;
+  default:
+    client->sending = 0;
+    break;
   }
 
-  // Parse out the query string
-  char *query_string = strchr(path, '?');
-  if (query_string) {
-    *query_string = '\0';
-    query_string++; // Optionally use the query string
-    // TEST: printf("Query string: %s\n", query_string);
-  }
-
-  // Convert path to refer to files in the public directory
-  char full_path[128];
-  snprintf(full_path, 128, "public%s", path);
-#if defined(_WIN32)
-  char *p = full_path;
-  while (*p) {
-    if (*p == '/')
-      *p = '\\';
-    p++;
-  }
-#endif
+  if (client->dropping) {
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+      io_ring_recycle_buffer(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (!client->receiving && !client->sending) {
+      client->dropping = 0;
+      drop_client(client);
+    }
+  } else if (op == RING_RECV)
+    complete_recv(client, cqe);
+  else
+    complete_send(client, op, cqe->res);
+}
 
-  // Try to open binary stream for the resource, and in case of failure the
-  // server assumes it doesn't exist.
-  FILE *fp = fopen(full_path, "rb");
-  if (!fp) {
-    send_404(client);
+/**
+ * @brief Add the connection a multishot accept completed with.
+ *
+ * A failure ends the multishot accept. If the process ran out of descriptors
+ * or memory, it is submitted again by resume_accepting() once there may be
+ * some: submitted right away, it would only fail again at once. A client
+ * that gave up while it waited in the queue is skipped. Anything else means
+ * the listening socket is unusable, and the program exits.
+ *
+ * @param server The socket the server is listening on.
+ * @param cqe The completion, holding the socket accepted.
+ */
+void complete_accept(SOCKET server, const struct io_uring_cqe *cqe) {
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  if (cqe->res < 0) {
+    int error = -cqe->res;
+    if (is_out_of_resources(error))
+      pause_accepting(server, error);
+    else if (error != ECONNABORTED && error != EINTR) {
+      fprintf(stderr, "accept() failed. (%d)\n", error);
+      exit(EXIT_FAILURE);
+    }
+    if (!more && !accept_paused_at)
+      arm_accept(server);
     return;
   }
+  if (!more)
+    arm_accept(server);
 
-  // Retrieve metadata to populate the Content-Length header
-  fseek(fp, 0L, SEEK_END);
-  size_t cl = ftell(fp);
-  rewind(fp);
-  // Retrieve metadata to populate the Content-Type header
-  const char *ct = get_content_type(full_path);
-
-#define BSIZE 1024
-  char buffer[BSIZE];
-
-  // Send the response headers
-  snprintf(buffer, BSIZE, "HTTP/1.1 200 OK\r\n");
-  send(client->socket, buffer, strlen(buffer), 0);
-  snprintf(buffer, BSIZE, "Connection: close\r\n");
-  send(client->socket, buffer, strlen(buffer), 0);
-  snprintf(buffer, BSIZE, "Content-Length: %zu\r\n", cl);
-  send(client->socket, buffer, strlen(buffer), 0);
-  snprintf(buffer, BSIZE, "Content-Type: %s\r\n", ct);
-  send(client->socket, buffer, strlen(buffer), 0);
-  snprintf(buffer, BSIZE, "\r\n");
-  send(client->socket, buffer, strlen(buffer), 0);
-
-  // Send the body
-  size_t r;
-  while ((r = fread(buffer, 1, BSIZE, fp)) > 0)
-    send(client->socket, buffer, r, 0);
-
-  // TEST:
-  printf("serve_resource completed %s %s\n", get_client_address(client), path);
-
-  // Close file handle and disconnect client
-  fclose(fp);
-  drop_client(client);
+  // Multishot accepts do not return the address of the client
+  struct sockaddr_storage address;
+  socklen_t address_length = sizeof(address);
+  getpeername(cqe->res, (struct sockaddr *)&address, &address_length);
+  add_client(cqe->res, &address, address_length);
 }
+
+/**
+ * @brief Hand the data a receive completed with to receive_request().
+ *
+ * @param client The client.
+ * @param cqe The completion.
+ */
+void complete_recv(client_info *client, const struct io_uring_cqe *cqe) {
+  if (cqe->res > 0) {
+    client->ring_buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    client->ring_offset = 0;
+    client->ring_length = cqe->res;
+  } else if (cqe->res == -ENOBUFS) {
+    fprintf(stderr, "Out of receive buffers.\n");
+    client->ring_eof = 1;
+  } else if (cqe->res != -EINTR && cqe->res != -EAGAIN)
+    client->ring_eof = 1; // Closed by the client, or failed
+  receive_request(client);
+}
+
+/**
+ * @brief Move on with a write queue once a send or a splice completed.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @param op The operation.
+ * @param result The result of the operation: bytes moved, or -errno.
+ */
+void complete_send(client_info *client, enum ring_op op, int result) {
+  write_queue *queue = client->queue;
+  if (result == -EINTR || result == -EAGAIN)
+    result = 0; // Submitted again by flush_ring()
+  else if (op == RING_SPLICE_IN && result == -EINVAL) {
+    // File system without splice() support: fall back on the mapping
+    if (!map_segment(&queue->segments[queue->head])) {
+      drop_client(client);
+      return;
+    }
+    result = 0;
+  } else if (result < 1) {
+    // Connection lost, or the file shrank under our feet
+    metrics_add(&metrics->disconnects, 1);
+    drop_client(client);
+    return;
+  }
+
+  if (result > 0)
+    set_timeout(client, TIMEOUT_WRITE);
+  if (op != RING_SPLICE_IN) {
+    metrics_add(&metrics->bytes_sent, result);
+    get_client_meta(client)->sent += result;
+  }
+  if (op == RING_SEND)
+    advance_segments(queue, result);
+  else if (op == RING_SPLICE_IN) {
+    segment *current = &queue->segments[queue->head];
+    current->offset += result;
+    current->remaining -= result;
+    queue->piped = result;
+  } else
+    queue->piped -= result;
+
+  if (flush_ring(client))
+    receive_request(client);
+}
+
+/**
+ * @brief Take received data from the provided buffer of a client.
+ *
+ * This stands for recv() when the loop runs on io_uring. The buffer is given
+ * back once all of its data is taken. If there is none, a receive is
+ * submitted: the completion calls receive_request() again.
+ *
+ * @param client The client in CLIENT_READING state.
+ * @param data Where to copy the data.
+ * @param length The most bytes to copy.
+ * @return The number of bytes copied, 0 if the connection is closed, or -1
+ * with errno set to EAGAIN if there is no data yet.
+ */
+int take_ring_data(client_info *client, char *data, int length) {
+  if (client->ring_buffer < 0) {
+    if (client->ring_eof)
+      return 0;
+    if (!client->receiving)
+      arm_recv(client);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (length > client->ring_length)
+    length = client->ring_length;
+  memcpy(data,
+         io_ring_buffer(&ring, client->ring_buffer) + client->ring_offset,
+         length);
+  client->ring_offset += length;
+  client->ring_length -= length;
+  if (client->ring_length == 0) {
+    io_ring_recycle_buffer(&ring, client->ring_buffer);
+    client->ring_buffer = -1;
+  }
+  return length;
+}
+#endif
+
+/**
+ * @brief Accept the connections pending on the listening socket.
+ *
+ * The queue is drained up to MAX_ACCEPTS connections per call, rather than
+ * one per wakeup of the loop: a burst of connections is accepted in a few
+ * iterations instead of waiting behind each other. The listening socket is
+ * level-triggered, so the loop is woken up again for those left. On Linux,
+ * accept4() makes the sockets non-blocking and close-on-exec as it creates
+ * them, saving two fcntl() calls per connection.
+ *
+ * Running out of descriptors or memory ends the batch and pauses accepting,
+ * see pause_accepting(): the server keeps serving the clients it has.
+ *
+ * @param socket_listen The socket the server is listening on.
+ */
+void accept_client(SOCKET socket_listen) {
+  for (int i = 0; i < MAX_ACCEPTS; ++i) {
+    struct sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+#if defined(__linux__)
+    SOCKET socket = accept4(socket_listen, (struct sockaddr *)&address,
+                            &address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    SOCKET socket =
+        accept(socket_listen, (struct sockaddr *)&address, &address_length);
+#endif
+    if (!ISVALIDSOCKET(socket)) {
+      // Drained, or a client gave up while it waited in the queue
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      if (is_out_of_resources(errno)) {
+        pause_accepting(socket_listen, errno);
+        return;
+      }
+      if (errno == ECONNABORTED || errno == EINTR)
+        continue;
+      fprintf(stderr, "accept() failed. (%d)\n", GETSOCKETERRNO());
+      exit(EXIT_FAILURE);
+    }
+    add_client(socket, &address, address_length);
+  }
+}
+
+/**
+ * @brief Tell whether accept() failed for want of descriptors or memory.
+ *
+ * Those failures are transient: closing connections frees some up.
+ *
+ * @param error The errno value accept() failed with.
+ * @return 1 if so, 0 otherwise.
+ */
+int is_out_of_resources(int error) {
+  return error == EMFILE || error == ENFILE || error == ENOBUFS ||
+         error == ENOMEM;
+}
+
+/**
+ * @brief Leave new connections in the accept queue for a while.
+ *
+ * Called once accept() ran out of descriptors or memory: trying again right
+ * away would fail the same way, over and over. Accepting resumes once a
+ * client is dropped, or at the next second, see resume_accepting(). The
+ * failure is reported once per pause. Meanwhile epoll stops reporting the
+ * listening socket, and select() is not asked about it: being
+ * level-triggered, it would wake the loop up again at once.
+ *
+ * @param server The socket the server is listening on.
+ * @param error The errno value accept() failed with.
+ */
+void pause_accepting(SOCKET server, int error) {
+  if (accept_paused_at)
+    return;
+  fprintf(stderr, "accept() failed, pausing. (%d)\n", error);
+  accept_paused_at = now;
+  accept_paused_clients = clients.count;
+#if defined(USE_EPOLL)
+  if (epoll_fd >= 0) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server, &event);
+  }
+#else
+  (void)server;
+#endif
+}
+
+/**
+ * @brief Accept connections again once accepting was paused, if a client
+ *        has been dropped or a second has passed since.
+ *
+ * Called after each turn of the event loop.
+ *
+ * @param server The socket the server is listening on.
+ */
+void resume_accepting(SOCKET server) {
+  if (!accept_paused_at || (clients.count >= accept_paused_clients &&
+                            now == accept_paused_at))
+    return;
+  accept_paused_at = 0;
+#if defined(USE_IO_URING)
+  if (ring.fd >= 0)
+    arm_accept(server);
+#endif
+#if defined(USE_EPOLL)
+  if (epoll_fd >= 0) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, server, &event);
+  }
+#else
+  (void)server;
+#endif
+}
+
+/**
+ * @brief Add an accepted connection to the client table.
+ *
+ * A fresh client_info is allocated for the connection and its socket is made
+ * non-blocking, so a client slow to take its response never stalls the loop.
+ * When built with epoll, the socket is registered edge-triggered for both
+ * directions so it is only reported again once new data arrives or send
+ * buffer space frees up. With io_uring, the first receive is submitted
+ * instead.
+ *
+ * @param socket The socket of the connection.
+ * @param address The address of the client.
+ * @param address_length The size of address.
+ */
+void add_client(SOCKET socket, const struct sockaddr_storage *address,
+                socklen_t address_length) {
+  if (socket >= MAX_CLIENTS) {
+    fprintf(stderr, "Client table full.\n");
+    CLOSESOCKET(socket);
+    return;
+  }
+
+  // The socket is not in the table yet, so this allocates its client_info
+  client_info *client = get_client(socket);
+  client_meta *meta = get_client_meta(client);
+  memcpy(&meta->address, address, address_length);
+  meta->address_length = address_length;
+  getnameinfo((const struct sockaddr *)address, address_length, meta->host,
+              sizeof(meta->host), NULL, 0, NI_NUMERICHOST);
+  metrics_add(&metrics->accepted, 1);
+
+#if defined(USE_IO_URING)
+  if (ring.fd >= 0) {
+    arm_recv(client);
+    return;
+  }
+#endif
+
+#if !defined(__linux__)
+  // accept4() took care of it on Linux
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+#if defined(USE_EPOLL)
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = client;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->socket, &event) < 0) {
+    fprintf(stderr, "epoll_ctl() failed. (%d)\n", GETSOCKETERRNO());
+    drop_client(client);
+    return;
+  }
+#else
+  // FD_SET() on a descriptor past FD_SETSIZE writes out of bounds
+  if (client->socket >= FD_SETSIZE) {
+    fprintf(stderr, "Too many connections for select().\n");
+    drop_client(client);
+    return;
+  }
+#endif
+}
+
+/**
+ * @brief Read available request data from a client and answer the requests
+ *        that are complete.
+ *
+ * With epoll the socket is edge-triggered, so it is read until recv() would
+ * block: data left in the kernel buffer would otherwise go unnoticed until the
+ * peer sends more. With select() a single recv() is done per wakeup, since the
+ * socket is reported again as long as data is pending.
+ *
+ * The request is parsed incrementally as it arrives: http_parse_request()
+ * resumes where it stopped, so each received byte is scanned once however
+ * the request trickles in.
+ *
+ * Clients may pipeline requests, sending the next ones before the first is
+ * answered. Complete requests are answered in order straight from the buffer,
+ * and reading stops as soon as a response cannot be sent in full: the rest of
+ * the pipeline waits in the buffer (or in the kernel) until it is done.
+ *
+ * The request buffer is only borrowed from the pool once the socket is ready,
+ * and given back if it turns out there was nothing to read.
+ *
+ * @param client The client whose socket is ready for reading.
+ */
+void receive_request(client_info *client) {
+#if !defined(USE_EPOLL)
+  int has_read = 0;
+#endif
+
+  while (1) {
+    if (client->state == CLIENT_IDLE) {
+      char *buffer = acquire_buffer();
+      client->parsed = (http_request *)buffer;
+      client->request = buffer + sizeof(http_request);
+      http_request_init(client->parsed);
+      client->state = CLIENT_READING;
+    }
+
+    enum http_parse_result result =
+        http_parse_request(client->parsed, client->request, client->received);
+    if (result != HTTP_PARSE_INCOMPLETE)
+      client->started = precise_clock();
+    if (result == HTTP_PARSE_ERROR) {
+      send_400(client);
+      return;
+    }
+    if (result == HTTP_PARSE_DONE) {
+      if (!handle_request(client))
+        return; // Response in progress, or connection closed
+      continue;
+    }
+
+#if !defined(USE_EPOLL)
+    if (has_read)
+      return; // Level-triggered: select() reports the rest on the next pass
+#endif
+
+    if (MAX_REQUEST_SIZE == client->received) {
+      client->started = precise_clock();
+      send_400(client);
+      return;
+    }
+
+#if defined(USE_IO_URING)
+    int bytes_received =
+        ring.fd >= 0
+            ? take_ring_data(client, client->request + client->received,
+                             MAX_REQUEST_SIZE - client->received)
+            : recv(client->socket, client->request + client->received,
+                   MAX_REQUEST_SIZE - client->received, 0);
+#else
+    int bytes_received =
+        recv(client->socket, client->request + client->received,
+             MAX_REQUEST_SIZE - client->received, 0);
+#endif
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (client->received == 0)
+        release_request_buffer(client);
+      return; // Drained: wait for the next edge
+    }
+
+    // TEST: Monitor packets split across multiple recv() calls
+    /* printf("\nReceived Data (%d bytes) ->>\n%.*s\n<<-\n", bytes_received,
+           bytes_received, client->request + client->received); */
+
+    if (bytes_received < 1) {
+      // Closing a persistent connection between two requests is expected
+      if (client->received > 0 || client->requests == 0)
+        metrics_add(&metrics->disconnects, 1);
+      drop_client(client);
+      return;
+    }
+
+#if !defined(USE_EPOLL)
+    has_read = 1;
+#endif
+    client->received += bytes_received;
+    // The headers have a deadline from their first byte on, however slowly
+    // they come, whereas a body only has to keep coming
+    if (client->parsed->header_length)
+      set_timeout(client, TIMEOUT_BODY);
+    else if (client->timeout == TIMEOUT_KEEP_ALIVE)
+      set_timeout(client, TIMEOUT_HEADER);
+  }
+}
+
+/**
+ * @brief Answer the request parsed at the front of the request buffer.
+ *
+ * GET and HEAD are served, POST is refused with a 405 once its body has been
+ * received, and anything else is a bad request. The connection is kept open
+ * after the response if the client wants it to, unless it has already been
+ * used for MAX_KEEP_ALIVE_REQUESTS requests.
+ *
+ * @param client The client in CLIENT_READING state, with a complete request.
+ * @return 1 if the response is complete and the next request can be read, 0
+ * if it is still being sent or the client was dropped.
+ */
+int handle_request(client_info *client) {
+  http_request *request = client->parsed;
+  client->request_length = http_request_length(request);
+  client->keep_alive = http_keep_alive(request) &&
+                       ++client->requests < MAX_KEEP_ALIVE_REQUESTS;
+
+  if (request->method == HTTP_POST)
+    return send_405(client);
+  // The path is the one part of the request needed as a C string
+  char path[MAX_PATH_LENGTH + 1];
+  if ((request->method != HTTP_GET && request->method != HTTP_HEAD) ||
+      http_normalize_path(request->path, path, sizeof(path)) < 0) {
+    send_400(client);
+    return 0;
+  }
+  if (strcmp(path, METRICS_PATH) == 0)
+    return send_metrics(client);
+  return serve_resource(client, path);
+}
+
+/**
+ * @brief Converts a client_info struct into a string representation of the IP
+ *        address.
+ *
+ * The address is formatted once, when the connection is accepted, so this
+ * costs nothing and the string stays valid as long as the client is
+ * connected.
+ *
+ * @param client The client_info pointer to convert.
+ * @return A string representation of the client's IP address.
+ */
+const char *get_client_address(client_info *client) {
+  return get_client_meta(client)->host;
+}
+
+/**
+ * @brief Return the cold meta data matching a client_info.
+ *
+ * @param client The client_info, which must belong to client_slab.
+ * @return The client_meta stored at the same index in client_metas.
+ */
+client_meta *get_client_meta(client_info *client) {
+  return &client_metas[client - client_slab];
+}
+
+/**
+ * @brief Retrieve connected client_info structure for a given socket.
+ *
+ * The client_info is looked up directly in the table indexed by socket. If no
+ * such client_info exists, one dropped before this turn of the event loop is
+ * reused (or one is taken from the unused end of the slab if there is none),
+ * indexed by the socket and appended to the live clients. Every path is
+ * constant time, and nothing is allocated on the heap. A new client does not
+ * hold a request buffer yet.
+ *
+ * @param socket The socket associated with the client to retrieve. It must be
+ * lower than MAX_CLIENTS.
+ * @return Either a pointer the connected client_info or to a freshly
+ * initialized one.
+ */
+client_info *get_client(SOCKET socket) {
+  table_entry *entry = client_table_find(&clients, socket);
+  if (entry)
+    return table_client(entry);
+
+  // Recycle a dropped client_info if any, otherwise take a fresh one
+  client_info *client;
+  if ((entry = client_table_reuse(&clients))) {
+    client = table_client(entry);
+  } else if (client_slab_used < MAX_CLIENTS) {
+    client = &client_slab[client_slab_used++];
+  } else {
+    fprintf(stderr, "Out of client slots.\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(client, 0, sizeof(*client));
+  memset(get_client_meta(client), 0, sizeof(client_meta));
+
+  // Initialize the new client_info and add it to the table.
+  get_client_meta(client)->address_length = sizeof(struct sockaddr_storage);
+  client->state = CLIENT_IDLE;
+  client->socket = socket;
+#if defined(USE_IO_URING)
+  client->ring_buffer = -1;
+#endif
+  client_table_add(&clients, &client->entry, socket);
+  set_timeout(client, TIMEOUT_KEEP_ALIVE);
+  return client;
+}
+
+/**
+ * @brief Get the client_info a client table entry is embedded in.
+ *
+ * @param entry The entry.
+ * @return The client_info.
+ */
+client_info *table_client(table_entry *entry) {
+  return (client_info *)((char *)entry - offsetof(client_info, entry));
+}
+
+/**
+ * @brief Take a request or response buffer from the pool.
+ *
+ * Buffers are only held by clients in the middle of receiving a request or
+ * sending a response, so idle connections cost no more than their
+ * client_info. When the pool runs dry a whole chunk of buffers is allocated at
+ * once and threaded onto the free list. Buffers are never given back to the
+ * system.
+ *
+ * @return A buffer of BUFFER_SIZE bytes.
+ */
+char *acquire_buffer(void) {
+  if (!free_buffers) {
+    size_t buffer_size = BUFFER_SIZE;
+    char *chunk = (char *)malloc(REQUEST_BUFFERS_PER_CHUNK * buffer_size);
+    if (!chunk) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < REQUEST_BUFFERS_PER_CHUNK; ++i) {
+      char *buffer = chunk + i * buffer_size;
+      memcpy(buffer, &free_buffers, sizeof(free_buffers));
+      free_buffers = buffer;
+    }
+  }
+
+  char *buffer = free_buffers;
+  memcpy(&free_buffers, buffer, sizeof(free_buffers));
+  return buffer;
+}
+
+/**
+ * @brief Give a buffer back to the pool.
+ *
+ * @param buffer A buffer obtained from acquire_buffer().
+ */
+void release_buffer(char *buffer) {
+  memcpy(buffer, &free_buffers, sizeof(free_buffers));
+  free_buffers = buffer;
+}
+
+/**
+ * @brief Give the request buffer of a client back to the pool.
+ *
+ * The client goes back to CLIENT_IDLE with an empty request.
+ *
+ * @param client The client holding the buffer.
+ */
+void release_request_buffer(client_info *client) {
+  if (!client->parsed)
+    return;
+
+  release_buffer((char *)client->parsed);
+  client->parsed = NULL;
+  client->request = NULL;
+  client->received = 0;
+  client->state = CLIENT_IDLE;
+}
+
+/**
+ * @brief Format an error response whose body is its reason phrase.
+ *
+ * @param response The canned_response to fill in.
+ * @param status The status code.
+ * @param reason Its reason phrase.
+ * @param headers Additional header lines, each ending with CRLF.
+ */
+void prepare_response(canned_response *response, int status,
+                      const char *reason, const char *headers) {
+  http_builder builder;
+  http_builder_init(&builder, response->text, sizeof(response->text), NULL, 0);
+  http_builder_text(&builder, headers);
+  http_builder_header_number(&builder, "Content-Length", strlen(reason));
+  http_builder_end(&builder);
+  response->header_length = builder.length;
+  http_builder_text(&builder, reason);
+  if (builder.failed) {
+    fprintf(stderr, "Response headers too long.\n");
+    exit(EXIT_FAILURE);
+  }
+  response->reason = reason;
+  response->status = status;
+  response->length = builder.length;
+}
+
+/**
+ * @brief Switch a client to CLIENT_WRITING with an empty write queue.
+ *
+ * The caller then queues the pieces of the response and calls flush_queue().
+ *
+ * @param client The client in CLIENT_READING state.
+ * @param status The status code of the response, counted once it is sent.
+ */
+void begin_response(client_info *client, int status) {
+  client->status = status;
+  get_client_meta(client)->sent = 0;
+  client->queue = (write_queue *)acquire_buffer();
+  client->queue->head = 0;
+  client->queue->count = 0;
+  http_builder_init(&client->queue->text, (char *)(client->queue + 1),
+                    QUEUE_TEXT_SIZE, NULL, 0);
+  client->queue->text_queued = 0;
+  client->queue->body = NULL;
+  set_timeout(client, TIMEOUT_WRITE);
+#if defined(USE_IO_URING)
+  client->queue->pipe[0] = client->queue->pipe[1] = -1;
+  client->queue->piped = 0;
+#endif
+  client->state = CLIENT_WRITING;
+}
+
+/**
+ * @brief Take the next free segment of the write queue of a client.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @return The segment, which the caller fills in.
+ */
+segment *next_segment(client_info *client) {
+  write_queue *queue = client->queue;
+  if (queue->count == MAX_SEGMENTS) {
+    fprintf(stderr, "Write queue full.\n");
+    exit(EXIT_FAILURE);
+  }
+  segment *piece = &queue->segments[queue->count++];
+  memset(piece, 0, sizeof(*piece));
+  piece->file = -1;
+  return piece;
+}
+
+/**
+ * @brief Queue bytes in memory, which must stay untouched until sent.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @param data The bytes to send.
+ * @param length The number of bytes to send.
+ */
+void queue_buffer(client_info *client, const char *data, size_t length) {
+  segment *piece = next_segment(client);
+  piece->data = data;
+  piece->remaining = length;
+}
+
+/**
+ * @brief Queue formatted text, stored in the buffer of the write queue.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @param format The printf() format of the text.
+ */
+void queue_format(client_info *client, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  http_builder_vformat(&client->queue->text, format, args);
+  va_end(args);
+  queue_text(client);
+}
+
+/**
+ * @brief Start the headers of a response in the buffer of the write queue.
+ *
+ * The status, Connection and Date lines are written, and the caller appends
+ * the other headers to the builder returned, then calls queue_text(). The
+ * date is copied from the one formatted each second, which the queue cannot
+ * refer to: it may change before the response is sent.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @param status The status code.
+ * @param reason Its reason phrase.
+ * @return The builder of the text of the write queue.
+ */
+http_builder *start_headers(client_info *client, int status,
+                            const char *reason) {
+  http_builder *headers = &client->queue->text;
+  http_builder_status(headers, status, reason);
+  http_builder_header(headers, "Connection",
+                      client->keep_alive ? "keep-alive" : "close");
+  size_t length;
+  const char *date = date_cache_header(&length);
+  http_builder_append(headers, date, length);
+  return headers;
+}
+
+/**
+ * @brief Queue the text written to the buffer of the write queue since it
+ *        last was.
+ *
+ * Text following text queued the same way is merged into its segment, so
+ * headers can be written line by line. Responses headers are produced by the
+ * server alone, and a too long one is a bug: it is reported and the program
+ * exits.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ */
+void queue_text(client_info *client) {
+  write_queue *queue = client->queue;
+  if (queue->text.failed) {
+    fprintf(stderr, "Response headers too long.\n");
+    exit(EXIT_FAILURE);
+  }
+  char *text = queue->text.arena + queue->text_queued;
+  size_t length = queue->text.length - queue->text_queued;
+  queue->text_queued = queue->text.length;
+
+  segment *last = queue->count ? &queue->segments[queue->count - 1] : NULL;
+  if (last && last->file < 0 && last->data + last->remaining == text)
+    last->remaining += length;
+  else
+    queue_buffer(client, text, length);
+}
+
+/**
+ * @brief Send a canned error response to the client.
+ *
+ * The response to a HEAD request stops after the headers.
+ *
+ * @param client The client to send the error response to.
+ * @param response The response.
+ * @return The result of flush_queue().
+ */
+int send_error(client_info *client, const canned_response *response) {
+  int length = client->parsed->method == HTTP_HEAD ? response->header_length
+                                                   : response->length;
+  begin_response(client, response->status);
+  start_headers(client, response->status, response->reason);
+  queue_text(client);
+  queue_buffer(client, response->text, length);
+  return flush_queue(client);
+}
+
+/**
+ * @brief Send a 400 error response to the client and close the connection.
+ *
+ * The request cannot be trusted, so neither can anything pipelined behind it:
+ * the connection is closed once the response is sent.
+ *
+ * @param client The client to send the error response to.
+ */
+void send_400(client_info *client) {
+  client->keep_alive = 0;
+  send_error(client, &response_400);
+}
+
+/**
+ * @brief Send a 404 error response to the client.
+ *
+ * The connection stays open afterwards if the client asked for it.
+ *
+ * @param client The client to send the error response to.
+ * @return The result of flush_queue().
+ */
+int send_404(client_info *client) {
+  return send_error(client, &response_404);
+}
+
+/**
+ * @brief Send a 405 error response to the client.
+ *
+ * The request body has been received along with the request, so the
+ * connection stays usable.
+ *
+ * @param client The client to send the error response to.
+ * @return The result of flush_queue().
+ */
+int send_405(client_info *client) {
+  return send_error(client, &response_405);
+}
+
+/**
+ * @brief Remove a client_info struct from the client table.
+ *
+ * This function closes the client socket and removes the client_info from the
+ * table, effectively disconnecting the client. The last live client takes over
+ * its slot so the live clients stay packed. The client_info is only reused
+ * for another connection once the turn of the event loop ends: until then,
+ * events harvested for it are told apart and skipped. If the client_info is
+ * not in the table, the program exits with an error.
+ *
+ * @param client The pointer to the client_info to remove.
+ */
+void drop_client(client_info *client) {
+  if (!client_table_contains(&clients, &client->entry)) {
+    fprintf(stderr, "drop_client not found.\n");
+    exit(EXIT_FAILURE);
+  }
+  cancel_timeout(client);
+
+#if defined(USE_IO_URING)
+  // The operations in flight still use the socket and the write queue: shut
+  // the connection down so that they end, the last one dropping the client
+  if (client->receiving || client->sending) {
+    shutdown(client->socket, SHUT_RDWR);
+    client->dropping = 1;
+    return;
+  }
+  if (client->ring_buffer >= 0)
+    io_ring_recycle_buffer(&ring, client->ring_buffer);
+#endif
+  metrics_add(&metrics->closed, 1);
+#if defined(USE_EPOLL)
+  // Deregister explicitly: the kernel only forgets the socket on close() if no
+  // other descriptor refers to the same open file.
+  if (epoll_fd >= 0)
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+#endif
+  // Close the socket
+  CLOSESOCKET(client->socket);
+  release_request_buffer(client);
+  clear_queue(client);
+
+  client_table_remove(&clients, &client->entry, client->socket);
+}
+
+/**
+ * @brief Refresh the coarse clock used to time out idle connections, and the
+ *        date of responses and log lines along with it.
+ */
+void update_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = ts.tv_sec;
+  date_cache_update(time(NULL));
+}
+
+/**
+ * @brief Read a monotonic clock precise enough to time requests.
+ *
+ * @return The time in microseconds, from an arbitrary point but never 0.
+ */
+uint64_t precise_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + 1;
+}
+
+/**
+ * @brief Give a client a deadline, replacing the one it had.
+ *
+ * The client is linked into the slot of the timing wheel its deadline falls
+ * in, in constant time. Clients making progress push their deadline back
+ * every time, which costs nothing when it stays within the same second.
+ *
+ * @param client The client.
+ * @param timeout What the client is given time for.
+ */
+void set_timeout(client_info *client, enum client_timeout timeout) {
+  // clang-format off
+  static const int seconds[] = {
+    [TIMEOUT_KEEP_ALIVE] = KEEP_ALIVE_TIMEOUT,
+    [TIMEOUT_HEADER]     = HEADER_TIMEOUT,
+    [TIMEOUT_BODY]       = BODY_TIMEOUT,
+    [TIMEOUT_WRITE]      = WRITE_TIMEOUT,
+  };
+  // clang-format on
+  time_t deadline = now + seconds[timeout];
+  if (client->timer.deadline == deadline && client->timeout == timeout)
+    return;
+
+  client->timeout = timeout;
+  timing_wheel_add(&timeouts, &client->timer, deadline);
+}
+
+/**
+ * @brief Take a client out of the timing wheel, if it is in.
+ *
+ * @param client The client.
+ */
+void cancel_timeout(client_info *client) {
+  timing_wheel_remove(&timeouts, &client->timer);
+}
+
+/**
+ * @brief Drop the clients whose deadline has passed.
+ *
+ * A client is dropped once it fails to send its next request, or to take
+ * its response, in time, see enum client_timeout. The cost does not depend
+ * on the number of clients but on the number timing out.
+ */
+void expire_timeouts(void) {
+  wheel_timer *timer;
+  while ((timer = timing_wheel_expire(&timeouts, now))) {
+    client_info *client =
+        (client_info *)((char *)timer - offsetof(client_info, timer));
+    metrics_add(&metrics->timeouts[client->timeout], 1);
+    drop_client(client);
+  }
+}
+
+/**
+ * @brief Record the identity and version of a file.
+ *
+ * @param version Receives the identity and version.
+ * @param file_stat The metadata of the file.
+ */
+void read_version(file_version *version, const struct stat *file_stat) {
+  version->device = file_stat->st_dev;
+  version->inode = file_stat->st_ino;
+  version->mtime = file_stat->st_mtime;
+  version->size = file_stat->st_size;
+}
+
+/**
+ * @brief Tell whether a file is still the version recorded.
+ *
+ * @param version The version recorded by read_version().
+ * @param file_stat The metadata of the file now.
+ * @return 1 if the file has been neither replaced nor modified, 0 otherwise.
+ */
+int is_same_version(const file_version *version,
+                    const struct stat *file_stat) {
+  return version->device == file_stat->st_dev &&
+         version->inode == file_stat->st_ino &&
+         version->mtime == file_stat->st_mtime &&
+         version->size == file_stat->st_size;
+}
+
+/**
+ * @brief Read a whole file into memory.
+ *
+ * @param file The open file, whose offset is left untouched.
+ * @param size The size of the file.
+ * @return The content of the file, to be freed, or NULL if it could not be
+ * read in full.
+ */
+char *read_file(int file, off_t size) {
+  char *body = (char *)malloc(size + 1);
+  if (!body) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  off_t loaded = 0;
+  while (loaded < size) {
+    ssize_t rd = pread(file, body + loaded, size - loaded, loaded);
+    if (rd < 0 && errno == EINTR)
+      continue;
+    if (rd < 1) {
+      free(body);
+      return NULL;
+    }
+    loaded += rd;
+  }
+  return body;
+}
+
+#if defined(USE_ZLIB)
+/**
+ * @brief Compress a file in the gzip format, at the best compression level.
+ *
+ * This is only done once per version of a file, whose result is cached, so
+ * the slowest level is worth it.
+ *
+ * @param body The content of the file.
+ * @param size The size of body.
+ * @param gzip_size Receives the size of the compressed content.
+ * @return The compressed content, to be freed, or NULL on failure.
+ */
+char *gzip_body(const char *body, off_t size, off_t *gzip_size) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // 16 added to the window bits asks for a gzip header and trailer
+  if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  uLong bound = deflateBound(&stream, size);
+  char *gzip = (char *)malloc(bound);
+  if (!gzip) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  stream.next_in = (Bytef *)body;
+  stream.avail_in = size;
+  stream.next_out = (Bytef *)gzip;
+  stream.avail_out = bound;
+  int status = deflate(&stream, Z_FINISH);
+  *gzip_size = stream.total_out;
+  deflateEnd(&stream);
+  if (status != Z_STREAM_END) {
+    fprintf(stderr, "deflate() failed. (%d)\n", status);
+    free(gzip);
+    return NULL;
+  }
+
+  // Give back what the bound reserved for incompressible data
+  char *shrunk = (char *)realloc(gzip, *gzip_size + 1);
+  return shrunk ? shrunk : gzip;
+}
+#endif
+
+/**
+ * @brief Make a new cache entry of a file.
+ *
+ * The header block is formatted once here, along with the Content-Type, the
+ * coding and the validators, and the entry is added to the cache, which may
+ * evict the least recently used ones to make room for it.
+ *
+ * @param path The path of the file, as passed to open().
+ * @param encoding The coding body is in.
+ * @param type The type of the file.
+ * @param file_stat The metadata of the file.
+ * @param body The content of the file, encoded, taken over by the cache, or
+ * NULL to keep file open instead.
+ * @param file The open file if body is NULL, taken over by the cache, or -1.
+ * @param size The size of body, or of the file.
+ * @return The new entry, or NULL if the file cannot be cached, in which case
+ * body is freed, or file closed.
+ */
+cache_entry *cache_file(const char *path, enum content_encoding encoding,
+                        const mime_type *type, const struct stat *file_stat,
+                        char *body, int file, off_t size) {
+  if (strlen(path) >= sizeof(((cache_entry *)0)->path) ||
+      (body && size > FILE_CACHE_BUDGET)) {
+    free(body);
+    if (file >= 0)
+      close(file);
+    return NULL;
+  }
+
+  cache_entry *entry = (cache_entry *)calloc(1, sizeof(cache_entry));
+  if (!entry) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  strcpy(entry->path, path);
+  entry->encoding = encoding;
+  entry->body = body;
+  entry->file = file;
+  entry->size = size;
+  entry->type = type;
+  make_validators(&entry->validators, file_stat, encoding);
+  http_builder header;
+  http_builder_init(&header, entry->header, sizeof(entry->header), NULL, 0);
+  http_builder_header_number(&header, "Content-Length", entry->size);
+  http_builder_append(&header, type->header, type->header_length);
+  if (encoding == ENCODING_IDENTITY)
+    http_builder_header(&header, "Accept-Ranges", "bytes");
+  http_builder_text(&header, encoding_header(encoding, type));
+  http_builder_append(&header, entry->validators.text,
+                      entry->validators.length);
+  http_builder_end(&header);
+  entry->header_length = header.length; // The type is bounded, it fits
+  read_version(&entry->version, file_stat);
+  entry->checked = now;
+
+  file_cache_insert(&cache, entry);
+  return entry;
+}
+
+/**
+ * @brief Queue a complete 200 response for a cached file.
+ *
+ * Only the status, Connection and Date lines are written per request, the
+ * rest comes ready-made from the entry. Nothing is copied: the write queue
+ * keeps a reference on the entry until it is cleared. A HEAD request only
+ * gets the headers.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @param entry The cache entry of the file.
+ * @return 1 on success, 0 if the file could not be mapped.
+ */
+int queue_cached_file(client_info *client, cache_entry *entry) {
+  start_headers(client, 200, "OK");
+  queue_text(client);
+  queue_buffer(client, entry->header, entry->header_length);
+  if (client->parsed->method == HTTP_HEAD)
+    return 1;
+  return queue_cached_range(client, entry, 0, entry->size);
+}
+
+/**
+ * @brief Queue a range of a cached file, held in memory or kept open.
+ *
+ * The write queue keeps a reference on the entry until it is cleared, and
+ * sends from the file of the entry without owning it: sendfile() and
+ * splice() are given the offset to read from, so clients sending the same
+ * file at once never move its position under one another.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @param entry The cache entry of the file.
+ * @param first The first byte of the range.
+ * @param length The number of bytes of the range.
+ * @return 1 on success, 0 if the range could not be mapped.
+ */
+int queue_cached_range(client_info *client, cache_entry *entry, off_t first,
+                       off_t length) {
+  segment *piece = next_segment(client);
+  piece->entry = entry;
+  piece->remaining = length;
+  entry->references++;
+  if (entry->body) {
+    piece->data = entry->body + first;
+    return 1;
+  }
+  piece->file = entry->file;
+  piece->offset = first;
+#if defined(__linux__)
+  return 1;
+#else
+  return map_segment(piece);
+#endif
+}
+
+/**
+ * @brief Return the header lines describing the coding of a response.
+ *
+ * Responses for the types negotiated with --compress say which coding they
+ * are in, and that the Accept-Encoding header of the request picked it, so
+ * that caches keep one response per coding.
+ *
+ * @param encoding The coding of the body.
+ * @param type The type of the file.
+ * @return The header lines, empty if the type is not negotiated.
+ */
+const char *encoding_header(enum content_encoding encoding,
+                            const mime_type *type) {
+  if (!compress_types || !type->compressible)
+    return "";
+  return codings[encoding].header;
+}
+
+/**
+ * @brief Format the ETag and Last-Modified headers of a file.
+ *
+ * The ETag is made of the inode, size and modification time of the file, so
+ * that it changes whenever the file is replaced or modified, and of the
+ * coding it is sent with, since each coding is a representation of its own.
+ *
+ * @param validators Receives the header lines.
+ * @param file_stat The metadata of the file.
+ * @param encoding The coding the file is sent with.
+ */
+void make_validators(file_validators *validators,
+                     const struct stat *file_stat,
+                     enum content_encoding encoding) {
+  char date[HTTP_DATE_SIZE];
+  http_format_date(file_stat->st_mtime, date);
+  http_builder text;
+  http_builder_init(&text, validators->text, sizeof(validators->text), NULL,
+                    0);
+
+  // The values are located as they are written, rather than measured
+  http_builder_text(&text, "ETag: ");
+  validators->etag.data = validators->text + text.length;
+  http_builder_format(&text, "\"%jx-%jx-%jx%s\"", (uintmax_t)file_stat->st_ino,
+                      (uintmax_t)file_stat->st_size,
+                      (uintmax_t)file_stat->st_mtime, codings[encoding].etag);
+  validators->etag.length = validators->text + text.length -
+                            validators->etag.data;
+  http_builder_text(&text, "\r\nLast-Modified: ");
+  validators->last_modified.data = validators->text + text.length;
+  http_builder_append(&text, date, HTTP_DATE_SIZE - 1);
+  validators->last_modified.length = HTTP_DATE_SIZE - 1;
+  http_builder_append(&text, "\r\n", 2);
+  validators->length = text.length;
+}
+
+/**
+ * @brief Describe a cached file for send_file().
+ *
+ * @param view Receives the description.
+ * @param entry The cache entry of the file.
+ */
+void view_cached_file(file_view *view, cache_entry *entry) {
+  view->entry = entry;
+  view->size = entry->size;
+  view->mtime = entry->version.mtime;
+  view->type = entry->type;
+  view->encoding = entry->encoding;
+  view->validators = &entry->validators;
+}
+
+/**
+ * @brief Add a file to the candidates of a request.
+ *
+ * The file is left out if public/ is watched and does not hold it.
+ *
+ * @param job The job of the request.
+ * @param path The path of the file requested.
+ * @param suffix Appended to path to make that of the candidate.
+ * @param encoding The coding the response is in with the candidate.
+ * @param gzip Whether the candidate is to be gzipped on the fly.
+ */
+void add_candidate(file_job *job, const char *path, const char *suffix,
+                   enum content_encoding encoding, int gzip) {
+  file_candidate *candidate = &job->candidates[job->count];
+  if (snprintf(candidate->path, sizeof(candidate->path), "%s%s", path,
+               suffix) >= (int)sizeof(candidate->path))
+    return;
+#if defined(__linux__)
+  // Files known not to be there are not looked for
+  enum path_kind kind =
+      file_cache_find_route(&cache, candidate->path + strlen("public"), now);
+  if (kind != PATH_FILE && kind != PATH_UNKNOWN)
+    return;
+#endif
+  candidate->encoding = encoding;
+  candidate->gzip = gzip;
+  candidate->cached = 0;
+  job->count++;
+}
+
+/**
+ * @brief List the files that may answer a request, preferred first.
+ *
+ * With --compress, clients accepting compressed responses get text assets
+ * compressed. Precompressed siblings are preferred, foo.css.br then
+ * foo.css.gz, since they may have been made with slower and better
+ * compressors than zlib. The siblings are kept up to date by whoever
+ * publishes the files: they are served as they are, whatever their age.
+ * Without any, a file small enough for the cache is gzipped into it, once
+ * per version of the file, so that compression is paid once rather than on
+ * every request. The file itself comes last.
+ *
+ * @param job The job of the request, whose type is set.
+ * @param request The request, whose Accept-Encoding header is looked at.
+ * @param path The path of the file, as passed to open().
+ */
+void plan_candidates(file_job *job, const http_request *request,
+                     const char *path) {
+  job->count = 0;
+  if (compress_types && job->type->compressible) {
+    int gzip = http_accepts_encoding(request, codings[ENCODING_GZIP].name);
+    if (http_accepts_encoding(request, codings[ENCODING_BR].name))
+      add_candidate(job, path, codings[ENCODING_BR].suffix, ENCODING_BR, 0);
+    if (gzip)
+      add_candidate(job, path, codings[ENCODING_GZIP].suffix, ENCODING_GZIP,
+                    0);
+#if defined(USE_ZLIB)
+    if (gzip)
+      add_candidate(job, path, "", ENCODING_GZIP, 1);
+#endif
+  }
+  add_candidate(job, path, "", ENCODING_IDENTITY, 0);
+}
+
+/**
+ * @brief Answer a request for a file from the cache, or have it found.
+ *
+ * The candidates are looked up in the cache in order. Hot files are answered
+ * right away, without a single system call. Otherwise the first candidate
+ * not in the cache, or due for a check against the disk, and those after it
+ * are left to a file job: a preferred file may have appeared on disk since
+ * the others were cached. Files whose changes inotify reports are due far
+ * less often than the others.
+ *
+ * @param client The client to answer.
+ * @param job The job of the request, planned by plan_candidates(), given
+ * back to the buffer pool once the request is answered.
+ * @return The result of flush_queue(), 0 if the client was dropped or waits
+ * for an I/O thread.
+ */
+int resolve_file(client_info *client, file_job *job) {
+  job->client = client;
+  job->first = -1;
+  for (int i = 0; i < job->count; ++i) {
+    file_candidate *candidate = &job->candidates[i];
+    cache_entry *entry =
+        file_cache_find(&cache, candidate->path, candidate->encoding);
+    if (entry && job->first < 0 &&
+        now - entry->checked < (entry->watched ? FILE_CACHE_WATCHED_REVALIDATE
+                                               : FILE_CACHE_REVALIDATE)) {
+      release_buffer((char *)job);
+      metrics_add(&metrics->cache_hits, 1);
+      file_view view;
+      view_cached_file(&view, entry);
+      return send_file(client, &view);
+    }
+    if (job->first < 0)
+      job->first = i;
+    // The I/O thread reads the file again only if it changed
+    candidate->cached = entry != NULL;
+    if (entry)
+      candidate->version = entry->version;
+  }
+  metrics_add(&metrics->cache_misses, 1);
+  return submit_file_job(job);
+}
+
+/**
+ * @brief Have the blocking part of a file job done.
+ *
+ * The job is queued for the I/O threads and the client waits for it without
+ * being read from. Without I/O threads, the job is run right away.
+ *
+ * @param job The job, with its candidates to look for from job->first.
+ * @return The result of complete_file_job() without I/O threads, 0 while
+ * the job is pending.
+ */
+int submit_file_job(file_job *job) {
+  job->events = cache.events;
+  if (io_threads == 0) {
+    run_file_job(job);
+    return complete_file_job(job);
+  }
+
+  // Clients only wait on the file system, which has no timeout
+  job->client->state = CLIENT_WAITING;
+  cancel_timeout(job->client);
+  job->next = NULL;
+  pthread_mutex_lock(&io_lock);
+  if (io_queue_head)
+    io_queue_tail->next = job;
+  else
+    io_queue_head = job;
+  io_queue_tail = job;
+  pthread_cond_signal(&io_pending);
+  pthread_mutex_unlock(&io_lock);
+  return 0;
+}
+
+/**
+ * @brief Find the first candidate of a job on disk, and read it.
+ *
+ * This is the part of answering a request that may block on a slow disk:
+ * opening, stat()ing and reading the file, and compressing it. It runs on an
+ * I/O thread, so it only touches the job. A file whose cached version is
+ * still current is not read again, and one too large to hold is left open,
+ * for the cache to keep and send from disk.
+ *
+ * @param job The job, whose results are filled in.
+ */
+void run_file_job(file_job *job) {
+  job->found = -1;
+  job->unchanged = 0;
+  job->file = -1;
+  job->body = NULL;
+
+  for (int i = job->first; i < job->count; ++i) {
+    file_candidate *candidate = &job->candidates[i];
+    int file = open(candidate->path, O_RDONLY);
+    if (file < 0)
+      continue;
+    struct stat *file_stat = &job->file_stat;
+    if (fstat(file, file_stat) < 0 || !S_ISREG(file_stat->st_mode) ||
+        (candidate->gzip && file_stat->st_size > FILE_CACHE_MAX_FILE)) {
+      close(file);
+      continue;
+    }
+
+    if (candidate->cached && is_same_version(&candidate->version, file_stat)) {
+      close(file);
+      job->found = i;
+      job->unchanged = 1;
+      return;
+    }
+    if (file_stat->st_size > FILE_CACHE_MAX_FILE) {
+      job->found = i;
+      job->file = file;
+      return;
+    }
+
+    char *body = read_file(file, file_stat->st_size);
+    close(file);
+    if (!body)
+      continue;
+    job->size = file_stat->st_size;
+#if defined(USE_ZLIB)
+    if (candidate->gzip) {
+      char *gzip = gzip_body(body, file_stat->st_size, &job->size);
+      free(body);
+      if (!(body = gzip))
+        continue;
+    }
+#endif
+    job->found = i;
+    job->body = body;
+    return;
+  }
+}
+
+/**
+ * @brief Answer a request once its file job has run.
+ *
+ * Back on the event loop, the cache is brought up to date: the candidates
+ * found missing or changed lose their entry, and the file found is added to
+ * it, read or kept open. The request is then answered with the file found,
+ * or with a 404 if there is none. The entry is only trusted to be reported
+ * changed by inotify if nothing changed while the job ran, since the event
+ * may have concerned the version the job read.
+ *
+ * @param job The job, given back to the buffer pool once the request is
+ * answered.
+ * @return The result of flush_queue(), 0 if the client was dropped or waits
+ * for an I/O thread again.
+ */
+int complete_file_job(file_job *job) {
+  client_info *client = job->client;
+  int stale_end = job->found < 0 ? job->count : job->found + !job->unchanged;
+  for (int i = job->first; i < stale_end; ++i) {
+    cache_entry *entry =
+        file_cache_find(&cache, job->candidates[i].path,
+                        job->candidates[i].encoding);
+    if (entry)
+      file_cache_evict(&cache, entry);
+  }
+
+  if (job->found < 0) {
+    release_buffer((char *)job);
+    return send_404(client);
+  }
+
+  file_candidate *candidate = &job->candidates[job->found];
+  cache_entry *entry;
+  if (job->unchanged) {
+    entry = file_cache_find(&cache, candidate->path, candidate->encoding);
+    if (!entry || !is_same_version(&entry->version, &job->file_stat)) {
+      // Evicted meanwhile: the file has to be read after all
+      candidate->cached = 0;
+      job->first = job->found;
+      return submit_file_job(job);
+    }
+    entry->checked = now;
+  } else {
+    entry = cache_file(candidate->path, candidate->encoding, job->type,
+                       &job->file_stat, job->body, job->file,
+                       job->body ? job->size : job->file_stat.st_size);
+    if (!entry) {
+      release_buffer((char *)job);
+      return send_404(client);
+    }
+  }
+#if defined(__linux__)
+  entry->watched = cache.watch_fd >= 0 && job->events == cache.events;
+#endif
+
+  file_view view;
+  view_cached_file(&view, entry);
+  int result = send_file(client, &view);
+  release_buffer((char *)job);
+  return result;
+}
+
+/**
+ * @brief Tell whether the client already holds the current version of a file.
+ *
+ * If-None-Match takes precedence: If-Modified-Since is only looked at
+ * without it, as RFC 9110 asks.
+ *
+ * @param request The request, a GET or a HEAD.
+ * @param view The file.
+ * @return 1 if a 304 response is due, 0 otherwise.
+ */
+int is_not_modified(const http_request *request, const file_view *view) {
+  const http_slice *if_none_match = http_find_header(request, "If-None-Match");
+  if (if_none_match)
+    return http_etag_matches(*if_none_match, view->validators->etag);
+
+  const http_slice *if_modified_since =
+      http_find_header(request, "If-Modified-Since");
+  if (if_modified_since) {
+    time_t since = http_parse_date(*if_modified_since);
+    return since != -1 && view->mtime <= since;
+  }
+  return 0;
+}
+
+/**
+ * @brief Tell whether the Range header of a request is to be honored.
+ *
+ * With If-Range, the ranges are only sent if the file is still the version
+ * the client has part of: its ETag or Last-Modified date must match exactly.
+ * Otherwise the whole file is sent.
+ *
+ * @param request The request, which has a Range header.
+ * @param view The file.
+ * @return 1 if the ranges are to be sent, 0 if the whole file is.
+ */
+int range_applies(const http_request *request, const file_view *view) {
+  const http_slice *if_range = http_find_header(request, "If-Range");
+  if (!if_range)
+    return 1;
+  const http_slice *validator = if_range->length && if_range->data[0] == '"'
+                                    ? &view->validators->etag
+                                    : &view->validators->last_modified;
+  return if_range->length == validator->length &&
+         memcmp(if_range->data, validator->data, validator->length) == 0;
+}
+
+// Header of each part of a multipart/byteranges body. Parts after the first
+// are preceded by a CRLF, which ends the data of the previous part.
+#define PART_HEADER_FORMAT                                                     \
+  "%s--" MULTIPART_BOUNDARY "\r\n"                                             \
+  "%s"                                                                         \
+  "Content-Range: bytes %jd-%jd/%jd\r\n"                                       \
+  "\r\n"
+#define MULTIPART_END "\r\n--" MULTIPART_BOUNDARY "--\r\n"
+
+/**
+ * @brief Queue a 206 response with the requested ranges of a file.
+ *
+ * A single range is sent as the body itself, described by Content-Range.
+ * Several ranges make a multipart/byteranges body, each of its parts
+ * starting with its own Content-Type and Content-Range headers.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @param view The file.
+ * @param ranges The ranges, as returned by http_parse_ranges().
+ * @param count The number of ranges.
+ * @return 1 on success, 0 if a range could not be mapped.
+ */
+int queue_ranges(client_info *client, const file_view *view,
+                 const http_range *ranges, int count) {
+  http_builder *headers = start_headers(client, 206, "Partial Content");
+
+  if (count == 1) {
+    http_builder_header_number(headers, "Content-Length",
+                               ranges[0].last - ranges[0].first + 1);
+    http_builder_format(headers, "Content-Range: bytes %jd-%jd/%jd\r\n",
+                        (intmax_t)ranges[0].first, (intmax_t)ranges[0].last,
+                        (intmax_t)view->size);
+    http_builder_append(headers, view->type->header,
+                        view->type->header_length);
+    http_builder_header(headers, "Accept-Ranges", "bytes");
+    http_builder_text(headers, encoding_header(view->encoding, view->type));
+    http_builder_append(headers, view->validators->text,
+                        view->validators->length);
+    http_builder_end(headers);
+    queue_text(client);
+    return queue_cached_range(client, view->entry, ranges[0].first,
+                              ranges[0].last - ranges[0].first + 1);
+  }
+
+  // The body length covers the part headers, which are measured first
+  intmax_t length = strlen(MULTIPART_END);
+  for (int i = 0; i < count; ++i)
+    length += snprintf(NULL, 0, PART_HEADER_FORMAT, i ? "\r\n" : "",
+                       view->type->header, (intmax_t)ranges[i].first,
+                       (intmax_t)ranges[i].last, (intmax_t)view->size) +
+              (ranges[i].last - ranges[i].first + 1);
+
+  http_builder_header_number(headers, "Content-Length", length);
+  http_builder_header(headers, "Content-Type",
+                      "multipart/byteranges; boundary=" MULTIPART_BOUNDARY);
+  http_builder_header(headers, "Accept-Ranges", "bytes");
+  http_builder_text(headers, encoding_header(view->encoding, view->type));
+  http_builder_append(headers, view->validators->text,
+                      view->validators->length);
+  http_builder_end(headers);
+  queue_text(client);
+  for (int i = 0; i < count; ++i) {
+    queue_format(client, PART_HEADER_FORMAT, i ? "\r\n" : "",
+                 view->type->header, (intmax_t)ranges[i].first,
+                 (intmax_t)ranges[i].last, (intmax_t)view->size);
+    if (!queue_cached_range(client, view->entry, ranges[i].first,
+                            ranges[i].last - ranges[i].first + 1))
+      return 0;
+  }
+  queue_format(client, MULTIPART_END);
+  return 1;
+}
+
+/**
+ * @brief Answer a GET or HEAD request for a file.
+ *
+ * A client revalidating a file it holds gets a 304 response without body,
+ * and a GET with a Range header only gets the ranges asked for, with a 206
+ * response, or a 416 one if they are all past the end of the file. Otherwise
+ * the whole file is sent, with 200. Responses carry the ETag and
+ * Last-Modified headers of the file for the next revalidation.
+ *
+ * Ranges are only served from files sent as they are: a compressed version
+ * is always sent whole, without Accept-Ranges, so that clients never have to
+ * stitch together pieces of a compressed stream.
+ *
+ * @param client The client to answer.
+ * @param view The file.
+ * @return The result of flush_queue(), 0 if the client was dropped.
+ */
+int send_file(client_info *client, const file_view *view) {
+  const http_request *request = client->parsed;
+
+  if (is_not_modified(request, view)) {
+    begin_response(client, 304);
+    http_builder *headers = start_headers(client, 304, "Not Modified");
+    http_builder_text(headers, encoding_header(view->encoding, view->type));
+    http_builder_append(headers, view->validators->text,
+                        view->validators->length);
+    http_builder_end(headers);
+    queue_text(client);
+    return flush_queue(client);
+  }
+
+  http_range ranges[HTTP_MAX_RANGES];
+  int count = 0;
+  const http_slice *range = http_find_header(request, "Range");
+  if (range && request->method == HTTP_GET &&
+      view->encoding == ENCODING_IDENTITY && range_applies(request, view))
+    count = http_parse_ranges(*range, view->size, ranges);
+
+  if (count < 0) {
+    begin_response(client, 416);
+    http_builder *headers = start_headers(client, 416, "Range Not Satisfiable");
+    http_builder_format(headers, "Content-Range: bytes */%jd\r\n",
+                        (intmax_t)view->size);
+    http_builder_header_number(headers, "Content-Length", 0);
+    http_builder_end(headers);
+    queue_text(client);
+    return flush_queue(client);
+  }
+
+  begin_response(client, count > 0 ? 206 : 200);
+  if (count > 0) {
+    if (!queue_ranges(client, view, ranges, count)) {
+      drop_client(client);
+      return 0;
+    }
+    return flush_queue(client);
+  }
+
+  // Nothing is sent before flush_queue(), which puts the headers and the
+  // beginning of the body together
+  if (!queue_cached_file(client, view->entry)) {
+    drop_client(client);
+    return 0;
+  }
+  return flush_queue(client);
+}
+
+/**
+ * @brief Send a resource to the client.
+ *
+ * This function takes a connected client and requested resource path then send
+ * the connected client the requested resource. The server expects all hosted
+ * files to be in a subdirectory called public. The path has been normalized
+ * by http_normalize_path(), so it cannot lead outside of it: no ".." is left
+ * in it, even one that was percent-encoded.
+ *
+ * @param client The client to send the resource to.
+ * @param path The normalized path of the resource to send.
+ * @return The result of flush_queue(), 0 if the client was dropped.
+ */
+int serve_resource(client_info *client, const char *path) {
+  if (strcmp(path, "/") == 0)
+    path = "/index.html";
+
+  // Convert path to refer to files in the public directory
+  char full_path[128];
+  snprintf(full_path, 128, "public%s", path);
+
+  // The file is looked for in the cache, then on disk by an I/O thread
+  file_job *job = (file_job *)acquire_buffer();
+  job->type = mime_lookup(full_path);
+  plan_candidates(job, client->parsed, full_path);
+  if (job->count == 0) {
+    release_buffer((char *)job);
+    return send_404(client);
+  }
+  return resolve_file(client, job);
+}
+
+/**
+ * @brief Map a file range into memory to send it from there.
+ *
+ * This is the fallback for systems, or file systems, where sendfile() is not
+ * available: the body is still not copied through a user space buffer, since
+ * sendmsg() reads the pages of the mapping directly.
+ *
+ * @param range A file segment of a write queue.
+ * @return 1 on success, 0 if the file could not be mapped.
+ */
+int map_segment(segment *range) {
+  if (range->remaining == 0)
+    return 1; // Nothing to map, the segment is skipped right away
+
+  // Mappings start on a page boundary
+  off_t start = range->offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+  size_t length = range->offset - start + range->remaining;
+  void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, range->file, start);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "mmap() failed. (%d)\n", errno);
+    return 0;
+  }
+  range->map = map;
+  range->map_length = length;
+  range->data = range->map + (range->offset - start);
+  return 1;
+}
+
+/**
+ * @brief Consume bytes sent from the run of segments in memory at the head of
+ *        a write queue.
+ *
+ * @param queue The write queue.
+ * @param sent The number of bytes sent, nothing is consumed if negative.
+ */
+void advance_segments(write_queue *queue, ssize_t sent) {
+  for (ssize_t left = sent; left > 0; queue->head++) {
+    segment *piece = &queue->segments[queue->head];
+    off_t taken = left < piece->remaining ? left : piece->remaining;
+    piece->data += taken;
+    piece->offset += taken;
+    piece->remaining -= taken;
+    left -= taken;
+    if (piece->remaining > 0)
+      break;
+  }
+}
+
+/**
+ * @brief Send as much of the write queue as the socket accepts.
+ *
+ * File ranges go from the page cache straight to the socket with sendfile().
+ * Runs of segments in memory, or mapped, are gathered into a single sendmsg().
+ * When a file range follows them, they are sent with MSG_MORE so that the
+ * kernel holds them back and puts them in the same packet as the beginning of
+ * the file.
+ *
+ * Any of these may write less than asked for: the segments are advanced by
+ * what was taken and, once the socket would block, the function returns and
+ * is called again when the socket becomes writable. The socket buffer is the
+ * only place where response bytes pile up, so a slow client never costs more
+ * than its write queue. The response is finished once the queue is empty, and
+ * the client is dropped if the connection fails.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @return The result of finish_response() once the response is sent, 0 while
+ * it is still in progress or if the client was dropped.
+ */
+int flush_queue(client_info *client) {
+#if defined(USE_IO_URING)
+  if (ring.fd >= 0)
+    return flush_ring(client);
+#endif
+  write_queue *queue = client->queue;
+
+  while (queue->head < queue->count) {
+    segment *current = &queue->segments[queue->head];
+    if (current->remaining == 0) {
+      queue->head++;
+      continue;
+    }
+
+    ssize_t sent;
+#if defined(__linux__)
+    if (!current->data) {
+      sent = sendfile(client->socket, current->file, &current->offset,
+                      current->remaining);
+      if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        // File system without sendfile() support: fall back on the mapping
+        if (!map_segment(current)) {
+          drop_client(client);
+          return 0;
+        }
+        continue;
+      }
+      if (sent > 0)
+        current->remaining -= sent;
+    } else
+#endif
+    {
+      struct iovec parts[MAX_SEGMENTS];
+      int count = 0;
+      int i = queue->head;
+      for (; i < queue->count && queue->segments[i].data; ++i) {
+        parts[count].iov_base = (char *)queue->segments[i].data;
+        parts[count++].iov_len = queue->segments[i].remaining;
+      }
+
+      struct msghdr message;
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = parts;
+      message.msg_iovlen = count;
+      int flags = 0;
+#if defined(MSG_MORE)
+      if (i < queue->count)
+        flags = MSG_MORE; // A file range comes next
+#endif
+      sent = sendmsg(client->socket, &message, flags);
+      advance_segments(queue, sent);
+    }
+
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0; // Socket buffer full: resume once it is writable again
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 1) {
+      // Connection lost, or the file shrank under our feet
+      metrics_add(&metrics->disconnects, 1);
+      drop_client(client);
+      return 0;
+    }
+    set_timeout(client, TIMEOUT_WRITE);
+    metrics_add(&metrics->bytes_sent, sent);
+    get_client_meta(client)->sent += sent;
+  }
+
+  return finish_response(client);
+}
+
+/**
+ * @brief Wrap up a response that has been sent in full.
+ *
+ * The response is counted along with its duration. Without keep-alive the
+ * client is dropped. Otherwise the answered request is discarded from the
+ * request buffer, shifting any pipelined data to its front, and the client
+ * is ready for its next request.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @return 1 if the connection is kept open, 0 if the client was dropped.
+ */
+int finish_response(client_info *client) {
+  record_response(client);
+  if (!client->keep_alive) {
+    // Disconnect client, which also closes the file
+    drop_client(client);
+    return 0;
+  }
+
+  clear_queue(client);
+
+  client->received -= client->request_length;
+  memmove(client->request, client->request + client->request_length,
+          client->received);
+  client->request_length = 0;
+  http_request_init(client->parsed);
+  client->state = CLIENT_READING;
+  // Requests pipelined behind this one have started already
+  set_timeout(client, client->received ? TIMEOUT_HEADER : TIMEOUT_KEEP_ALIVE);
+  if (client->received == 0)
+    release_request_buffer(client);
+  return 1;
+}
+
+/**
+ * @brief Release the write queue of a client once sent or aborted.
+ *
+ * The mappings of the queue are closed, the cached files it sent are
+ * released, and its buffer is given back to the pool.
+ *
+ * @param client The client, in any state.
+ */
+void clear_queue(client_info *client) {
+  write_queue *queue = client->queue;
+  if (!queue)
+    return;
+
+  for (int i = 0; i < queue->count; ++i) {
+    segment *piece = &queue->segments[i];
+    if (piece->map)
+      munmap(piece->map, piece->map_length);
+    if (piece->entry)
+      file_cache_release(piece->entry);
+  }
+  free(queue->body);
+#if defined(USE_IO_URING)
+  if (queue->pipe[0] >= 0)
+    release_pipe(queue->pipe, queue->piped == 0);
+#endif
+  release_buffer((char *)queue);
+  client->queue = NULL;
+}
+
+#if defined(__linux__)
+/**
+ * @brief Stop watching public/, for good.
+ *
+ * The cached files are no longer trusted to be reported changed.
+ */
+void unwatch_files(void) {
+#if defined(USE_IO_URING)
+  if (ring.fd >= 0) {
+    // The poll on the inotify descriptor holds the file open: remove it
+    struct io_uring_sqe *sqe = get_ring_sqe(NULL, RING_WATCH);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = sqe->user_data;
+  }
+#endif
+  file_cache_unwatch(&cache);
+}
+
+/**
+ * @brief Evict the cache entries of the files reported changed.
+ *
+ * Watching stops if changes can no longer all be seen.
+ */
+void read_file_events(void) {
+  if (file_cache_read_events(&cache) < 0)
+    unwatch_files();
+}
+#endif
+
+/**
+ * @brief Count a response sent in full, and its duration, and log it.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ */
+void record_response(client_info *client) {
+  metrics_add(&metrics->responses[client->status], 1);
+  uint64_t duration = 0;
+  if (client->started) {
+    duration = precise_clock() - client->started;
+    client->started = 0;
+    metrics_add_latency(metrics, duration);
+  }
+  if (request_log.fd >= 0) {
+    client_meta *meta = get_client_meta(client);
+    if (!access_log_append(&request_log, client->parsed, meta->host,
+                           client->status, meta->sent, duration))
+      metrics_add(&metrics->log_dropped, 1);
+  }
+}
+
+/**
+ * @brief Answer a request for METRICS_PATH with the counters of the server.
+ *
+ * The body is formatted on the heap, owned by the write queue, so that a
+ * scrape does not cost a buffer of the pool more than any other response.
+ * A HEAD request only gets the headers.
+ *
+ * @param client The client in CLIENT_READING state.
+ * @return The result of flush_queue(), 0 if the client was dropped.
+ */
+int send_metrics(client_info *client) {
+  char *body = (char *)malloc(METRICS_SIZE);
+  if (!body) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  size_t length = metrics_format(body, METRICS_SIZE);
+  if (length >= METRICS_SIZE) {
+    fprintf(stderr, "Metrics too long.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  begin_response(client, 200);
+  client->queue->body = body;
+  http_builder *headers = start_headers(client, 200, "OK");
+  http_builder_header(headers, "Content-Type", "text/plain; version=0.0.4");
+  http_builder_header_number(headers, "Content-Length", length);
+  http_builder_header(headers, "Cache-Control", "no-store");
+  http_builder_end(headers);
+  queue_text(client);
+  if (client->parsed->method != HTTP_HEAD)
+    queue_buffer(client, body, length);
+  return flush_queue(client);
+}
+
+#if defined(USE_IO_URING)
+/**
+ * @brief Submit the next operation of the write queue to io_uring.
+ *
+ * This stands for flush_queue() when the loop runs on io_uring, one operation
+ * being in flight at a time. Runs of segments in memory, or mapped, go in a
+ * single sendmsg(), with MSG_MORE when a file range follows them. File ranges
+ * are spliced into a pipe, then from the pipe into the socket, so that their
+ * bytes are never copied to user space either. complete_send() moves the
+ * queue on as the operations complete and calls this again.
+ *
+ * @param client The client in CLIENT_WRITING state.
+ * @return The result of finish_response() once the response is sent, 0 while
+ * it is still in progress or if the client was dropped.
+ */
+int flush_ring(client_info *client) {
+  write_queue *queue = client->queue;
+  if (client->sending)
+    return 0;
+
+  struct io_uring_sqe *sqe;
+  if (queue->piped > 0) {
+    sqe = get_ring_sqe(client, RING_SPLICE_OUT);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = client->socket;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = queue->pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = queue->piped;
+    client->sending = 1;
+    return 0;
+  }
+
+  while (queue->head < queue->count &&
+         queue->segments[queue->head].remaining == 0)
+    queue->head++;
+  if (queue->head == queue->count)
+    return finish_response(client);
+
+  segment *current = &queue->segments[queue->head];
+  if (!current->data) {
+    if (queue->pipe[0] < 0 && !acquire_pipe(queue->pipe)) {
+      // Out of descriptors for a pipe: fall back on the mapping
+      if (!map_segment(current)) {
+        drop_client(client);
+        return 0;
+      }
+      return flush_ring(client);
+    }
+    sqe = get_ring_sqe(client, RING_SPLICE_IN);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = queue->pipe[1];
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = current->file;
+    sqe->splice_off_in = current->offset;
+    sqe->len = current->remaining < RING_SPLICE_SIZE ? current->remaining
+                                                     : RING_SPLICE_SIZE;
+    client->sending = 1;
+    return 0;
+  }
+
+  int count = 0;
+  int i = queue->head;
+  for (; i < queue->count && queue->segments[i].data; ++i) {
+    queue->parts[count].iov_base = (char *)queue->segments[i].data;
+    queue->parts[count++].iov_len = queue->segments[i].remaining;
+  }
+  memset(&queue->message, 0, sizeof(queue->message));
+  queue->message.msg_iov = queue->parts;
+  queue->message.msg_iovlen = count;
+
+  sqe = get_ring_sqe(client, RING_SEND);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = client->socket;
+  sqe->addr = (uint64_t)(uintptr_t)&queue->message;
+  sqe->len = 1;
+  // Sockets are blocking, so a peer gone away is reported with EPIPE
+  sqe->msg_flags = MSG_NOSIGNAL;
+  if (i < queue->count)
+    sqe->msg_flags |= MSG_MORE; // A file range comes next
+  client->sending = 1;
+  return 0;
+}
+
+/**
+ * @brief Take an empty pipe to splice file ranges through.
+ *
+ * Pipes are kept from one response to the next, since creating one costs a
+ * system call and closing it two more.
+ *
+ * @param ends Receives the read and write ends of the pipe.
+ * @return 1 on success, 0 if no pipe can be created.
+ */
+int acquire_pipe(int ends[2]) {
+  if (free_pipe_count > 0) {
+    free_pipe_count--;
+    ends[0] = free_pipes[free_pipe_count][0];
+    ends[1] = free_pipes[free_pipe_count][1];
+    return 1;
+  }
+  if (pipe(ends) < 0) {
+    fprintf(stderr, "pipe() failed. (%d)\n", errno);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief Give a pipe back, or close it if it still holds data.
+ *
+ * @param ends The read and write ends of the pipe, reset to -1.
+ * @param empty Whether all the data spliced into the pipe was spliced out.
+ */
+void release_pipe(int ends[2], int empty) {
+  if (empty && free_pipe_count < RING_PIPES) {
+    free_pipes[free_pipe_count][0] = ends[0];
+    free_pipes[free_pipe_count][1] = ends[1];
+    free_pipe_count++;
+  } else {
+    close(ends[0]);
+    close(ends[1]);
+  }
+  ends[0] = ends[1] = -1;
+}
+#endif
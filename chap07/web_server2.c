@@ -1,8 +1,36 @@
 /* web_server2.c */
 
 #include "chap07.h"
+#include "date_cache.h"
+#include "http_builder.h"
+#include "mime_types.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <signal.h>
+#endif
 
 #define MAX_REQUEST_SIZE (2 * 1024 - 1)
+#define MAX_CLIENTS FD_SETSIZE
+#define MAX_SEGMENTS 2
+#define CHUNK_SIZE 1024
+
+#if defined(_WIN32)
+#define WOULDBLOCK(e) ((e) == WSAEWOULDBLOCK)
+// A Windows SOCKET is an opaque handle rather than a small index: clients are
+// found in an open-addressed table twice the size of the client limit instead
+#define SOCKET_SLOTS (2 * MAX_CLIENTS)
+#else
+#define WOULDBLOCK(e) ((e) == EAGAIN || (e) == EWOULDBLOCK)
+#endif
+
+// A piece of a response: bytes in memory, or the rest of an open file, which
+// is read CHUNK_SIZE bytes at a time as the socket takes them.
+typedef struct segment {
+  const char *data;
+  FILE *file;
+  size_t remaining; // Bytes left to send, or to read from file
+} segment;
 
 typedef struct client_info {
   socklen_t address_length;
@@ -11,48 +39,118 @@ typedef struct client_info {
   SOCKET socket;
   char request[MAX_REQUEST_SIZE + 1];
   int received;
+  int slot;
+  // Outbound queue, flushed whenever the socket is writable. A stalled
+  // client holds at most one chunk of its file in memory.
+  int writing;
+  segment queue[MAX_SEGMENTS];
+  int queue_head;
+  int queue_count;
+  char headers[256];
+  char chunk[CHUNK_SIZE];
+  int chunk_sent;
+  int chunk_length;
   struct client_info *next;
 } client_info;
 
+// Connected clients are packed in live[] and indexed by socket in by_socket[].
+// Dropped client_info structs are chained on free_list for reuse. On Windows,
+// by_socket[] is probed linearly from the hash of the socket.
+typedef struct client_table {
+  client_info *live[MAX_CLIENTS];
+  int count;
+#if defined(_WIN32)
+  client_info *by_socket[SOCKET_SLOTS];
+#else
+  client_info *by_socket[MAX_CLIENTS];
+#endif
+  client_info *free_list;
+} client_table;
+
 SOCKET create_socket(const char *host, const char *port);
-fd_set wait_on_clients(client_info *clients_head, SOCKET server);
-client_info *get_client(client_info **clients_head, SOCKET socket);
-void send_400(client_info **clients_head, client_info *client);
-void send_404(client_info **clients_head, client_info *client);
-void drop_client(client_info **clients_head, client_info *client);
-const char *get_content_type(const char *path);
-void serve_resource(client_info **clients_head, client_info *client,
+void wait_on_clients(client_table *clients, SOCKET server, fd_set *readfds,
+                     fd_set *writefds);
+client_info **find_slot(client_table *clients, SOCKET socket);
+void clear_slot(client_table *clients, SOCKET socket);
+client_info *get_client(client_table *clients, SOCKET socket);
+void queue_segment(client_info *client, const char *data, FILE *file,
+                   size_t length);
+void queue_parts(client_info *client, const http_builder *response);
+int flush_queue(client_info *client);
+void send_queued(client_table *clients, client_info *client);
+void send_error(client_table *clients, client_info *client, int status,
+                const char *reason);
+void send_400(client_table *clients, client_info *client);
+void send_404(client_table *clients, client_info *client);
+void drop_client(client_table *clients, client_info *client);
+void serve_resource(client_table *clients, client_info *client,
                     const char *path);
 
-int main(void) {
+int main(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "--mime-types") == 0) {
+    if (mime_load(argv[2]) < 0) {
+      fprintf(stderr, "mime_load() failed. (%d)\n", errno);
+      return EXIT_FAILURE;
+    }
+  } else if (argc != 1) {
+    fprintf(stderr, "usage: web_server2 [--mime-types FILE]\n");
+    return EXIT_FAILURE;
+  }
 
 #if defined(_WIN32)
   WSADATA d;
-  if (WASStartup(MAKEWORD(2, 2), &d)) {
+  if (WSAStartup(MAKEWORD(2, 2), &d)) {
     fprintf(stderr, "Failed to initialize Winsock.\n");
     return EXIT_FAILURE;
   }
 #endif
 
+#if !defined(_WIN32)
+  // Writing to a client that went away must fail with EPIPE, not kill us
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
   SOCKET server = create_socket(0, "3158");
 
-  client_info *clients_head = 0;
+  static client_table clients;
   // Main loop
   while (1) {
-    // Wait for incoming connections
-    fd_set readfds;
-    readfds = wait_on_clients(clients_head, server);
+    // Wait for incoming connections, requests and room to send responses
+    fd_set readfds, writefds;
+    wait_on_clients(&clients, server, &readfds, &writefds);
+    // The Date header of the responses sent this turn
+    date_cache_update(time(NULL));
 
     if (FD_ISSET(server, &readfds)) {
-      // Get a new client_info
-      client_info *client = get_client(&clients_head, -1);
-
-      client->socket = accept(server, (struct sockaddr *)&client->address,
-                              &client->address_length);
-      if (!ISVALIDSOCKET(client->socket)) {
+      struct sockaddr_storage address;
+      socklen_t address_length = sizeof(address);
+      SOCKET socket =
+          accept(server, (struct sockaddr *)&address, &address_length);
+      if (!ISVALIDSOCKET(socket)) {
         fprintf(stderr, "accept() failed with error %d\n", GETSOCKETERRNO());
         exit(EXIT_FAILURE);
       }
+#if defined(_WIN32)
+      if (clients.count == MAX_CLIENTS) {
+#else
+      if (socket >= MAX_CLIENTS) {
+#endif
+        fprintf(stderr, "Too many connections.\n");
+        CLOSESOCKET(socket);
+        continue;
+      }
+
+      // Get a new client_info
+      client_info *client = get_client(&clients, socket);
+      memcpy(&client->address, &address, address_length);
+      client->address_length = address_length;
+      // Responses are sent as the socket takes them, never blocking the loop
+#if defined(_WIN32)
+      u_long non_blocking = 1;
+      ioctlsocket(socket, FIONBIO, &non_blocking);
+#else
+      fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
       // Cache formatted address of client
       getnameinfo((struct sockaddr *)&client->address, client->address_length,
                   client->info_buf, sizeof(client->info_buf), 0, 0,
@@ -61,15 +159,18 @@ int main(void) {
       printf("New Connection from %s\n", client->info_buf);
     }
 
-    client_info *client = clients_head;
-    while (client) {
-      client_info *next_client = client->next;
+    // Backwards, since dropping a client moves the last one into its slot
+    for (int i = clients.count - 1; i >= 0; --i) {
+      client_info *client = clients.live[i];
+
+      if (client->writing) {
+        if (FD_ISSET(client->socket, &writefds))
+          send_queued(&clients, client);
 
-      if (FD_ISSET(client->socket, &readfds)) {
+      } else if (FD_ISSET(client->socket, &readfds)) {
 
         if (client->received == MAX_REQUEST_SIZE) {
-          send_400(&clients_head, client);
-          client = next_client;
+          send_400(&clients, client);
           continue;
         }
 
@@ -78,7 +179,7 @@ int main(void) {
 
         if (received < 1) {
           printf("Unexpected disconnect from %s.\n", client->info_buf);
-          drop_client(&clients_head, client);
+          drop_client(&clients, client);
 
         } else {
           client->received += received;
@@ -91,24 +192,22 @@ int main(void) {
             char *request_type = "GET /";
 
             if (strncmp(request_type, client->request, strlen(request_type))) {
-              send_400(&clients_head, client);
+              send_400(&clients, client);
 
             } else {
               char *path = client->request + strlen(headers_terminator);
               char *path_end = strstr(path, " ");
               if (!path_end) {
-                send_400(&clients_head, client);
+                send_400(&clients, client);
 
               } else {
                 *path_end = 0;
-                serve_resource(&clients_head, client, path);
+                serve_resource(&clients, client, path);
               }
             }
           }
         }
       }
-
-      client = next_client;
     }
   } // infinite loop
 
@@ -161,140 +260,239 @@ SOCKET create_socket(const char *host, const char *port) {
   return socket_listen;
 }
 
-fd_set wait_on_clients(client_info *clients_head, SOCKET server) {
+void wait_on_clients(client_table *clients, SOCKET server, fd_set *readfds,
+                     fd_set *writefds) {
 
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(server, &readfds);
+  FD_ZERO(readfds);
+  FD_ZERO(writefds);
+  FD_SET(server, readfds);
   SOCKET max_socket = server;
 
-  client_info *client = clients_head;
-  while (client) {
-    FD_SET(client->socket, &readfds);
+  // Clients with a response queued wait for room in their send buffer, the
+  // others for their request
+  for (int i = 0; i < clients->count; ++i) {
+    client_info *client = clients->live[i];
+    FD_SET(client->socket, client->writing ? writefds : readfds);
     if (client->socket > max_socket)
       max_socket = client->socket;
-    client = client->next;
   }
 
-  if (select(max_socket + 1, &readfds, 0, 0, 0) < 0) {
+  if (select(max_socket + 1, readfds, writefds, 0, 0) < 0) {
     fprintf(stderr, "select() failed with error %d\n", GETSOCKETERRNO());
     exit(EXIT_FAILURE);
   }
+}
 
-  return readfds;
+// Slot of by_socket[] holding the client of a socket, or where it goes
+client_info **find_slot(client_table *clients, SOCKET socket) {
+#if defined(_WIN32)
+  // Handles are multiples of 4: spread them with a multiplicative hash. The
+  // table is never more than half full, so an empty slot is always found.
+  size_t slot = (size_t)((socket >> 2) * 2654435761u) % SOCKET_SLOTS;
+  while (clients->by_socket[slot] && clients->by_socket[slot]->socket != socket)
+    slot = (slot + 1) % SOCKET_SLOTS;
+  return &clients->by_socket[slot];
+#else
+  return &clients->by_socket[socket];
+#endif
+}
+
+// Forget the client of a socket, which must be in by_socket[]
+void clear_slot(client_table *clients, SOCKET socket) {
+  client_info **slot = find_slot(clients, socket);
+  *slot = NULL;
+#if defined(_WIN32)
+  // Move back the clients of the run that follows if the hole cut them off
+  // from where their probe starts
+  size_t hole = slot - clients->by_socket;
+  for (size_t i = (hole + 1) % SOCKET_SLOTS; clients->by_socket[i];
+       i = (i + 1) % SOCKET_SLOTS) {
+    client_info *moved = clients->by_socket[i];
+    clients->by_socket[i] = NULL;
+    *find_slot(clients, moved->socket) = moved;
+  }
+#endif
 }
 
-client_info *get_client(client_info **clients_head, SOCKET socket) {
+client_info *get_client(client_table *clients, SOCKET socket) {
 
-  client_info *client_node = *clients_head;
+  client_info **slot = find_slot(clients, socket);
+  client_info *client_node = *slot;
+  if (client_node)
+    return client_node;
 
-  // INFO: This loop is dead code in the current version of this program where
-  // this function is only called with -1. Keep it for flexibility in case you
-  // run into a scenario where the server needs to look up an existing client.
-  while (client_node) {
-    if (client_node->socket == socket) {
-      return client_node;
+  if (clients->free_list) {
+    client_node = clients->free_list;
+    clients->free_list = client_node->next;
+    memset(client_node, 0, sizeof(client_info));
+  } else {
+    client_node = (client_info *)calloc(1, sizeof(client_info));
+    if (!client_node) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
     }
-    client_node = client_node->next;
-  }
-
-  client_node = (client_info *)calloc(1, sizeof(client_info));
-  if (!client_node) {
-    fprintf(stderr, "Out of memory.\n");
-    exit(EXIT_FAILURE);
   }
 
   client_node->address_length = sizeof(struct sockaddr_storage);
-  client_node->next = *clients_head;
-  *clients_head = client_node;
+  client_node->socket = socket;
+  client_node->slot = clients->count;
+  clients->live[clients->count++] = client_node;
+  *slot = client_node;
 
   return client_node;
 }
 
-void send_400(client_info **clients_head, client_info *client) {
-  char res_400[1024];
-  char *status = "Bad Request";
-  snprintf(res_400, sizeof(res_400),
-           "HTTP/1.1 400 %s\r\n"
-           "Connection: close\r\n"
-           "Content-Length: %d\r\n\r\n"
-           "%s",
-           status, (int)strlen(status), status);
-  send(client->socket, res_400, strlen(res_400), 0);
-  drop_client(clients_head, client);
+void queue_segment(client_info *client, const char *data, FILE *file,
+                   size_t length) {
+  if (client->queue_count == MAX_SEGMENTS) {
+    fprintf(stderr, "Write queue full.\n");
+    exit(EXIT_FAILURE);
+  }
+  segment *piece = &client->queue[client->queue_count++];
+  piece->data = data;
+  piece->file = file;
+  piece->remaining = length;
+  client->writing = 1;
 }
 
-void send_404(client_info **clients_head, client_info *client) {
-  char res_404[1024];
-  char *status = "Not Found";
-  snprintf(res_404, sizeof(res_404),
-           "HTTP/1.1 404 %s\r\n"
-           "Connection: close\r\n"
-           "Content-Length: %d\r\n\r\n"
-           "%s",
-           status, (int)strlen(status), status);
-  send(client->socket, res_404, strlen(res_404), 0);
-  drop_client(clients_head, client);
+// Queue the parts of a response put together by a builder over
+// client->headers: the headers, and the body added by reference if any
+void queue_parts(client_info *client, const http_builder *response) {
+  if (response->failed) {
+    fprintf(stderr, "Response too large.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < response->part_count; ++i)
+    queue_segment(client, (const char *)response->parts[i].iov_base, NULL,
+                  response->parts[i].iov_len);
 }
 
-void drop_client(client_info **clients_head, client_info *client) {
-  CLOSESOCKET(client->socket);
-
-  client_info **temp = clients_head;
+// Send queued segments until the socket would block. Returns 1 once the queue
+// is empty, 0 if the rest has to wait for the socket to be writable again and
+// -1 if the connection failed.
+int flush_queue(client_info *client) {
+  while (client->queue_head < client->queue_count) {
+    segment *current = &client->queue[client->queue_head];
+    const char *data;
+    size_t length;
+
+    if (current->file) {
+      // Refill the chunk once the socket has taken all of it
+      if (client->chunk_sent == client->chunk_length) {
+        if (current->remaining == 0) {
+          client->queue_head++;
+          continue;
+        }
+        size_t wanted =
+            current->remaining < CHUNK_SIZE ? current->remaining : CHUNK_SIZE;
+        size_t rd = fread(client->chunk, 1, wanted, current->file);
+        if (rd == 0)
+          return -1; // The file shrank under our feet
+        current->remaining -= rd;
+        client->chunk_sent = 0;
+        client->chunk_length = rd;
+      }
+      data = client->chunk + client->chunk_sent;
+      length = client->chunk_length - client->chunk_sent;
+    } else {
+      if (current->remaining == 0) {
+        client->queue_head++;
+        continue;
+      }
+      data = current->data;
+      length = current->remaining;
+    }
 
-  while (*temp) {
-    if (*temp == client) {
-      *temp = client->next;
-      free(client);
-      return;
+    int sent = send(client->socket, data, length, 0);
+    if (sent < 0 && WOULDBLOCK(GETSOCKETERRNO()))
+      return 0;
+    if (sent < 1)
+      return -1;
+
+    if (current->file) {
+      client->chunk_sent += sent;
+    } else {
+      current->data += sent;
+      current->remaining -= sent;
     }
-    temp = &(*temp)->next;
   }
 
-  fprintf(stderr, "drop_client not found.\n");
-  exit(EXIT_FAILURE);
+  return 1;
 }
 
-const char *get_content_type(const char *full_path) {
-  const char *ct;
-  const char *last_dot = strrchr(full_path, '.');
-  if (last_dot) {
-    // clang-format off
-      if (strcmp(last_dot, ".css") == 0)       ct = "text/css";
-      else if (strcmp(last_dot, ".csv") == 0)  ct = "text/csv";
-      else if (strcmp(last_dot, ".htm") == 0)  ct = "text/html";
-      else if (strcmp(last_dot, ".html") == 0) ct = "text/html";
-      else if (strcmp(last_dot, ".txt") == 0)  ct = "text/plain";
-      else if (strcmp(last_dot, ".gif") == 0)  ct = "image/gif";
-      else if (strcmp(last_dot, ".ico") == 0)  ct = "image/x-icon";
-      else if (strcmp(last_dot, ".jpeg") == 0) ct = "image/jpeg";
-      else if (strcmp(last_dot, ".jpg") == 0)  ct = "image/jpeg";
-      else if (strcmp(last_dot, ".png") == 0)  ct = "image/png";
-      else if (strcmp(last_dot, ".svg") == 0)  ct = "image/svg+xml";
-      else if (strcmp(last_dot, ".js") == 0)   ct = "application/javascript";
-      else if (strcmp(last_dot, ".json") == 0) ct = "application/json";
-      else if (strcmp(last_dot, ".pdf") == 0)  ct = "application/pdf";
-      else if (strcmp(last_dot, ".xml") == 0)  ct = "application/xml";
-      else ct = "application/octet-stream";
-    // clang-format on
-  } else {
-    ct = "application/octet-stream";
+// Flush the queue of a client, and disconnect it once the response is sent
+void send_queued(client_table *clients, client_info *client) {
+  int status = flush_queue(client);
+  if (status == 0)
+    return;
+
+  if (status < 0)
+    printf("Unexpected disconnect from %s.\n", client->info_buf);
+  else
+    printf("Response completed %s\n", client->info_buf);
+  drop_client(clients, client);
+}
+
+// Send an error whose body is its reason phrase. The phrase is a string
+// literal: it is queued where it is, rather than copied after the headers.
+void send_error(client_table *clients, client_info *client, int status,
+                const char *reason) {
+  size_t length = strlen(reason);
+  struct iovec parts[MAX_SEGMENTS];
+  http_builder response;
+  http_builder_init(&response, client->headers, sizeof(client->headers),
+                    parts, MAX_SEGMENTS);
+  http_builder_status(&response, status, reason);
+  http_builder_header(&response, "Connection", "close");
+  http_builder_header(&response, "Date", date_cache_http());
+  http_builder_header_number(&response, "Content-Length", length);
+  http_builder_end(&response);
+  http_builder_reference(&response, reason, length);
+  queue_parts(client, &response);
+  send_queued(clients, client);
+}
+
+void send_400(client_table *clients, client_info *client) {
+  send_error(clients, client, 400, "Bad Request");
+}
+
+void send_404(client_table *clients, client_info *client) {
+  send_error(clients, client, 404, "Not Found");
+}
+
+void drop_client(client_table *clients, client_info *client) {
+  if (clients->live[client->slot] != client) {
+    fprintf(stderr, "drop_client not found.\n");
+    exit(EXIT_FAILURE);
   }
 
-  return ct;
+  CLOSESOCKET(client->socket);
+  for (int i = 0; i < client->queue_count; ++i)
+    if (client->queue[i].file)
+      fclose(client->queue[i].file);
+
+  client_info *last = clients->live[--clients->count];
+  clients->live[client->slot] = last;
+  last->slot = client->slot;
+  clients->live[clients->count] = NULL;
+  clear_slot(clients, client->socket);
+
+  client->next = clients->free_list;
+  clients->free_list = client;
 }
-void serve_resource(client_info **clients_head, client_info *client,
+
+void serve_resource(client_table *clients, client_info *client,
                     const char *path) {
   printf("serve_resource initiated %s %s\n", client->info_buf, path);
 
   if (strcmp(path, "/") == 0)
     path = "/index.html";
   if (strlen(path) > 100) {
-    send_400(clients_head, client);
+    send_400(clients, client);
     return;
   }
   if (strstr(path, "..")) {
-    send_404(clients_head, client);
+    send_404(clients, client);
     return;
   }
 
@@ -312,7 +510,7 @@ void serve_resource(client_info **clients_head, client_info *client,
 
   FILE *fp = fopen(full_path, "rb");
   if (!fp) {
-    send_404(clients_head, client);
+    send_404(clients, client);
     return;
   }
 
@@ -320,27 +518,21 @@ void serve_resource(client_info **clients_head, client_info *client,
   size_t cl = ftell(fp);
   rewind(fp);
 
-  const char *ct = get_content_type(full_path);
-
-#define BSIZE 1024
-  char buffer[BSIZE];
-
-  snprintf(buffer, BSIZE, "HTTP/1.1 200 OK\r\n");
-  send(client->socket, buffer, strlen(buffer), 0);
-  snprintf(buffer, BSIZE, "Connection: close\r\n");
-  send(client->socket, buffer, strlen(buffer), 0);
-  snprintf(buffer, BSIZE, "Content-Length: %zu\r\n", cl);
-  send(client->socket, buffer, strlen(buffer), 0);
-  snprintf(buffer, BSIZE, "Content-Type: %s\r\n", ct);
-  send(client->socket, buffer, strlen(buffer), 0);
-  snprintf(buffer, BSIZE, "\r\n");
-  send(client->socket, buffer, strlen(buffer), 0);
-
-  size_t rd;
-  while ((rd = fread(buffer, 1, BSIZE, fp)) > 0)
-    send(client->socket, buffer, rd, 0);
-  printf("serve_resource completed %s %s\n", client->info_buf, full_path);
-
-  fclose(fp);
-  drop_client(clients_head, client);
+  const mime_type *type = mime_lookup(full_path);
+
+  // Queue the response and send what the socket takes right away. The rest
+  // goes out from the main loop as the client reads it.
+  struct iovec parts[1];
+  http_builder response;
+  http_builder_init(&response, client->headers, sizeof(client->headers),
+                    parts, 1);
+  http_builder_status(&response, 200, "OK");
+  http_builder_header(&response, "Connection", "close");
+  http_builder_header(&response, "Date", date_cache_http());
+  http_builder_header_number(&response, "Content-Length", cl);
+  http_builder_text(&response, type->header);
+  http_builder_end(&response);
+  queue_parts(client, &response);
+  queue_segment(client, NULL, fp, cl);
+  send_queued(clients, client);
 }
@@ -12,6 +12,8 @@
  * */
 
 #include "chap08.h"
+#include "date_cache.h"
+#include "scan.h"
 
 #define MAXINPUT 512
 #define MAXRESPONSE 1024
@@ -79,14 +81,8 @@ int main(void) {
   send_format(server, "To:<%s>\r\n", recipient);
   send_format(server, "Subject:<%s>\r\n", subject);
 
-  time_t timer;
-  time(&timer);
-  struct tm *timeinfo;
-  timeinfo = gmtime(&timer);
-  char date[128];
-  strftime(date, 128, "%a, %d %b %Y %H:%M:%S +0000", timeinfo);
-
-  send_format(server, "Date:%s\r\n", date);
+  date_cache_update(time(NULL));
+  send_format(server, "Date:%s\r\n", date_cache_mail());
 
   send_format(server, "\r\n");
 
@@ -172,19 +168,20 @@ void send_format(SOCKET server, const char *text, ...) {
  *         3 digit code.
  */
 int parse_response(const char *response) {
-  const char *k = response;
-  if (!k[0] || !k[1] || !k[2])
-    return 0;
-
-  for (; k[3]; k++) {
-    if (k == response || k[-1] == '\n') {
-      if (isdigit(k[0]) && isdigit(k[1]) && isdigit(k[2])) {
-        if (k[3] != '-') {
-          if (strstr(k, "\r\n"))
-            return strtol(k, 0, 10);
-        }
+  const char *end = response + strlen(response);
+
+  // Jump from line start to line start rather than testing every byte
+  for (const char *k = response; end - k > 3;) {
+    if (isdigit(k[0]) && isdigit(k[1]) && isdigit(k[2])) {
+      if (k[3] != '-') {
+        if (scan_find(k, end, "\r\n", 2) != end)
+          return strtol(k, 0, 10);
       }
     }
+    const char *line_end = scan_delimiters(k, end, SCAN_LF);
+    if (line_end == end)
+      break;
+    k = line_end + 1;
   }
   return 0;
 }
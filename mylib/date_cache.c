@@ -0,0 +1,202 @@
+/* mylib/date_cache.c */
+
+#include "date_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// The compiler cannot tell that the fields fit: each form gets ample space
+#define FORM_SIZE 64
+
+static const char days[7][4] = {"Sun", "Mon", "Tue", "Wed",
+                                "Thu", "Fri", "Sat"};
+static const char months[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+static int break_down(time_t date, struct tm *tm);
+static void format_imf(const struct tm *tm, const char *zone,
+                       char text[FORM_SIZE]);
+static long long days_from_civil(long long year, int month, int day);
+static int parse_digits(const char *text, int count);
+
+static int ready = 0;
+static time_t second;
+static char http_date[FORM_SIZE];   // "Sun, 06 Nov 1994 08:49:37 GMT"
+static char header[FORM_SIZE];      // "Date: " and the above, with CRLF
+static size_t header_length;
+static char mail_date[FORM_SIZE];   // "Sun, 06 Nov 1994 08:49:37 +0000"
+static char common_date[FORM_SIZE]; // "06/Nov/1994:08:49:37 +0000"
+static char iso_date[FORM_SIZE];    // "1994-11-06T08:49:37Z"
+
+/**
+ * @brief Format a date in the IMF-fixdate form of HTTP, in GMT.
+ *
+ * Unlike strftime(), the result does not depend on the locale.
+ *
+ * @param date The date in seconds since the Epoch.
+ * @param text Receives the date, NUL-terminated.
+ */
+void date_format_http(time_t date, char text[DATE_HTTP_SIZE]) {
+  // Years 0000 to 9999, the ones that can be written with 4 digits
+  long long seconds = date;
+  if (seconds < -62167219200LL)
+    seconds = -62167219200LL;
+  if (seconds > 253402300799LL)
+    seconds = 253402300799LL;
+  struct tm tm;
+  if (!break_down((time_t)seconds, &tm))
+    break_down(0, &tm); // Before 1970 where gmtime_s() cannot tell
+
+  char formatted[FORM_SIZE];
+  format_imf(&tm, "GMT", formatted);
+  memcpy(text, formatted, DATE_HTTP_SIZE - 1);
+  text[DATE_HTTP_SIZE - 1] = 0;
+}
+
+/**
+ * @brief Parse a date in the IMF-fixdate form of HTTP, such as
+ * "Sun, 06 Nov 1994 08:49:37 GMT".
+ *
+ * The obsolete RFC 850 and asctime() forms are not recognized.
+ *
+ * @param text The date, which need not be NUL-terminated.
+ * @param length The length of text.
+ * @return The date in seconds since the Epoch, or -1 if it is not valid.
+ */
+time_t date_parse_http(const char *text, size_t length) {
+  const char *d = text;
+  if (length != DATE_HTTP_SIZE - 1 || d[3] != ',' || d[4] != ' ' ||
+      d[7] != ' ' || d[11] != ' ' || d[16] != ' ' || d[19] != ':' ||
+      d[22] != ':' || memcmp(d + 25, " GMT", 4) != 0)
+    return -1;
+
+  int month = 0;
+  while (month < 12 && memcmp(months[month], d + 8, 3) != 0)
+    ++month;
+  int day = parse_digits(d + 5, 2);
+  int year = parse_digits(d + 12, 4);
+  int hour = parse_digits(d + 17, 2);
+  int minute = parse_digits(d + 20, 2);
+  int second = parse_digits(d + 23, 2);
+  if (month == 12 || day < 1 || day > 31 || year < 0 || hour < 0 ||
+      hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60)
+    return -1;
+
+  return (time_t)(days_from_civil(year, month + 1, day) * 86400 +
+                  hour * 3600 + minute * 60 + second);
+}
+
+/**
+ * @brief Format the current time again if it is a new second.
+ *
+ * The names of days and months are those of RFC 7231 and RFC 5322 whatever
+ * the locale, which strftime() would follow.
+ *
+ * @param wall The current time, as returned by time().
+ * @return 1 if the forms changed, 0 if they are still those of wall.
+ */
+int date_cache_update(time_t wall) {
+  if (ready && wall == second)
+    return 0;
+  struct tm tm;
+  if (!break_down(wall, &tm))
+    return 0;
+
+  const char *month = months[tm.tm_mon];
+  int year = tm.tm_year + 1900;
+  format_imf(&tm, "GMT", http_date);
+  header_length = snprintf(header, FORM_SIZE, "Date: %s\r\n", http_date);
+  format_imf(&tm, "+0000", mail_date);
+  snprintf(common_date, FORM_SIZE, "%02d/%s/%04d:%02d:%02d:%02d +0000",
+           tm.tm_mday, month, year, tm.tm_hour, tm.tm_min, tm.tm_sec);
+  snprintf(iso_date, FORM_SIZE, "%04d-%02d-%02dT%02d:%02d:%02dZ", year,
+           tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+  second = wall;
+  ready = 1;
+  return 1;
+}
+
+/**
+ * @brief The date of HTTP headers, in the IMF-fixdate form of RFC 7231.
+ */
+const char *date_cache_http(void) { return http_date; }
+
+/**
+ * @brief The whole Date header line of an HTTP response, CRLF included.
+ *
+ * @param length Receives the length of the line.
+ * @return The line, not to be sent without a copy if sending may wait.
+ */
+const char *date_cache_header(size_t *length) {
+  *length = header_length;
+  return header;
+}
+
+/**
+ * @brief The date of mail headers, in the form of RFC 5322.
+ */
+const char *date_cache_mail(void) { return mail_date; }
+
+/**
+ * @brief The date of the Common Log Format, without its brackets.
+ */
+const char *date_cache_common_log(void) { return common_date; }
+
+/**
+ * @brief The date in ISO 8601 form, as in JSON logs.
+ */
+const char *date_cache_iso(void) { return iso_date; }
+
+/**
+ * @brief Break a date down in GMT, into storage of the caller's rather than
+ *        the static one of gmtime(), so that any thread may call it.
+ *
+ * @param date The date in seconds since the Epoch.
+ * @param tm Receives the date broken down.
+ * @return 1 on success, 0 if the date cannot be broken down.
+ */
+static int break_down(time_t date, struct tm *tm) {
+#if defined(_WIN32)
+  return gmtime_s(tm, &date) == 0;
+#else
+  return gmtime_r(&date, tm) != NULL;
+#endif
+}
+
+/**
+ * @brief Format a date the way both HTTP and mail headers write it, as in
+ *        "Sun, 06 Nov 1994 08:49:37 GMT".
+ *
+ * @param tm The date broken down.
+ * @param zone The zone written last, "GMT" for HTTP or "+0000" for mail.
+ * @param text Receives the date, NUL-terminated.
+ */
+static void format_imf(const struct tm *tm, const char *zone,
+                       char text[FORM_SIZE]) {
+  snprintf(text, FORM_SIZE, "%s, %02d %s %04d %02d:%02d:%02d %s",
+           days[tm->tm_wday], tm->tm_mday, months[tm->tm_mon],
+           tm->tm_year + 1900, tm->tm_hour, tm->tm_min, tm->tm_sec, zone);
+}
+
+// Days since 1970-01-01 of a date of the proleptic Gregorian calendar
+static long long days_from_civil(long long year, int month, int day) {
+  year -= month <= 2;
+  long long era = (year >= 0 ? year : year - 399) / 400;
+  long long year_of_era = year - era * 400;
+  long long day_of_year =
+      (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  long long day_of_era = year_of_era * 365 + year_of_era / 4 -
+                         year_of_era / 100 + day_of_year;
+  return era * 146097 + day_of_era - 719468;
+}
+
+// Value of a run of digits, or -1 if one of them is not a digit
+static int parse_digits(const char *text, int count) {
+  int value = 0;
+  for (int i = 0; i < count; ++i) {
+    if (text[i] < '0' || text[i] > '9')
+      return -1;
+    value = value * 10 + (text[i] - '0');
+  }
+  return value;
+}
@@ -0,0 +1,36 @@
+/* mylib/date_cache.h */
+
+#ifndef DATE_CACHE_H
+#define DATE_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+
+// The current time, formatted once per second in each of the forms messages
+// and logs need, so that nothing is formatted per message. The process calls
+// date_cache_update() as its clock ticks, usually once per turn of its event
+// loop, and reads the forms in between. The forms are shared by the whole
+// process, without locking: they are meant to be updated and read by a
+// single thread.
+//
+// Strings returned stay valid, but are overwritten at the next second: a
+// message that is not sent right away takes a copy.
+//
+// Dates other than the current time, such as those of files, are formatted
+// and parsed in the IMF-fixdate form of HTTP by date_format_http() and
+// date_parse_http(), which any thread may call.
+
+// Size of an IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT", its terminating
+// NUL included
+#define DATE_HTTP_SIZE 30
+
+void date_format_http(time_t date, char text[DATE_HTTP_SIZE]);
+time_t date_parse_http(const char *text, size_t length);
+int date_cache_update(time_t wall);
+const char *date_cache_http(void);
+const char *date_cache_header(size_t *length);
+const char *date_cache_mail(void);
+const char *date_cache_common_log(void);
+const char *date_cache_iso(void);
+
+#endif
@@ -0,0 +1,210 @@
+/* mylib/http_builder.c */
+
+#include "http_builder.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @brief Prepare a builder for a new message.
+ *
+ * @param builder The builder.
+ * @param arena Where the text of the message is written.
+ * @param size The size of arena.
+ * @param parts Receives the parts of the message, or NULL to gather it all
+ * in arena.
+ * @param max_parts The number of parts that fit in parts.
+ */
+void http_builder_init(http_builder *builder, char *arena, size_t size,
+                       struct iovec *parts, int max_parts) {
+  builder->arena = arena;
+  builder->size = size;
+  builder->length = 0;
+  builder->parts = parts;
+  builder->part_count = 0;
+  builder->max_parts = parts ? max_parts : 0;
+  builder->failed = 0;
+}
+
+/**
+ * @brief Account for text just written at the end of the arena.
+ *
+ * The text goes to the last part if it ends where the text starts, so that
+ * headers appended line by line make a single part.
+ *
+ * @param builder The builder, whose length does not include the text yet.
+ * @param length The length of the text.
+ */
+static void commit_text(http_builder *builder, size_t length) {
+  char *text = builder->arena + builder->length;
+  if (builder->parts) {
+    struct iovec *last = builder->part_count
+                             ? &builder->parts[builder->part_count - 1]
+                             : NULL;
+    if (last && (char *)last->iov_base + last->iov_len == text) {
+      last->iov_len += length;
+    } else if (builder->part_count == builder->max_parts) {
+      builder->failed = 1;
+      return;
+    } else {
+      builder->parts[builder->part_count].iov_base = text;
+      builder->parts[builder->part_count++].iov_len = length;
+    }
+  }
+  builder->length += length;
+}
+
+/**
+ * @brief Append text, copied to the arena.
+ *
+ * @param builder The builder.
+ * @param text The text, which need not be NUL-terminated.
+ * @param length The length of text.
+ */
+void http_builder_append(http_builder *builder, const char *text,
+                         size_t length) {
+  if (builder->failed || length > builder->size - builder->length) {
+    builder->failed = 1;
+    return;
+  }
+  memcpy(builder->arena + builder->length, text, length);
+  commit_text(builder, length);
+}
+
+/**
+ * @brief Append a string, such as header lines formatted beforehand.
+ *
+ * @param builder The builder.
+ * @param text The string, NUL-terminated.
+ */
+void http_builder_text(http_builder *builder, const char *text) {
+  http_builder_append(builder, text, strlen(text));
+}
+
+/**
+ * @brief Append formatted text, for lines put together from several values.
+ *
+ * @param builder The builder.
+ * @param format The printf() format of the text.
+ */
+void http_builder_format(http_builder *builder, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  http_builder_vformat(builder, format, args);
+  va_end(args);
+}
+
+/**
+ * @brief Append formatted text, as http_builder_format() does.
+ *
+ * @param builder The builder.
+ * @param format The printf() format of the text.
+ * @param args The values to format.
+ */
+void http_builder_vformat(http_builder *builder, const char *format,
+                          va_list args) {
+  if (builder->failed)
+    return;
+  size_t space = builder->size - builder->length;
+  int length = vsnprintf(builder->arena + builder->length, space, format, args);
+  if (length < 0 || (size_t)length >= space) {
+    builder->failed = 1;
+    return;
+  }
+  commit_text(builder, length);
+}
+
+/**
+ * @brief Append the status line of a response.
+ *
+ * @param builder The builder, empty.
+ * @param status The status code, of three digits.
+ * @param reason The reason phrase.
+ */
+void http_builder_status(http_builder *builder, int status,
+                         const char *reason) {
+  char code[] = "HTTP/1.1 000 ";
+  code[9] = (char)('0' + status / 100 % 10);
+  code[10] = (char)('0' + status / 10 % 10);
+  code[11] = (char)('0' + status % 10);
+  http_builder_append(builder, code, sizeof(code) - 1);
+  http_builder_text(builder, reason);
+  http_builder_append(builder, "\r\n", 2);
+}
+
+/**
+ * @brief Append a header line.
+ *
+ * @param builder The builder.
+ * @param name The name of the header.
+ * @param value Its value.
+ */
+void http_builder_header(http_builder *builder, const char *name,
+                         const char *value) {
+  http_builder_text(builder, name);
+  http_builder_append(builder, ": ", 2);
+  http_builder_text(builder, value);
+  http_builder_append(builder, "\r\n", 2);
+}
+
+/**
+ * @brief Append a header line whose value is a number, such as
+ *        Content-Length.
+ *
+ * @param builder The builder.
+ * @param name The name of the header.
+ * @param value Its value.
+ */
+void http_builder_header_number(http_builder *builder, const char *name,
+                                long long value) {
+  // Digits written backwards from the end, without going through printf()
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  unsigned long long magnitude =
+      value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+  do {
+    *--p = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude);
+  if (value < 0)
+    *--p = '-';
+
+  http_builder_text(builder, name);
+  http_builder_append(builder, ": ", 2);
+  http_builder_append(builder, p, digits + sizeof(digits) - p);
+  http_builder_append(builder, "\r\n", 2);
+}
+
+/**
+ * @brief End the headers with the blank line.
+ *
+ * @param builder The builder.
+ */
+void http_builder_end(http_builder *builder) {
+  http_builder_append(builder, "\r\n", 2);
+}
+
+/**
+ * @brief Append bytes that stay where they are, such as a body.
+ *
+ * They make a part of their own, which points to them: they must be left
+ * untouched until the message is sent. Without a list of parts, they are
+ * copied to the arena instead.
+ *
+ * @param builder The builder.
+ * @param data The bytes.
+ * @param length The number of bytes.
+ */
+void http_builder_reference(http_builder *builder, const void *data,
+                            size_t length) {
+  if (!builder->parts) {
+    http_builder_append(builder, (const char *)data, length);
+    return;
+  }
+  if (builder->failed || builder->part_count == builder->max_parts) {
+    builder->failed = 1;
+    return;
+  }
+  builder->parts[builder->part_count].iov_base = (void *)data;
+  builder->parts[builder->part_count++].iov_len = length;
+}
@@ -0,0 +1,57 @@
+/* mylib/http_builder.h */
+
+#ifndef HTTP_BUILDER_H
+#define HTTP_BUILDER_H
+
+#include <stdarg.h>
+#include <stddef.h>
+
+#if defined(_WIN32)
+// As writev() and sendmsg() take it elsewhere
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+// An HTTP request or response put together in an arena provided by the
+// caller, typically one per connection. Lines are appended at the end of
+// what the arena holds, whose length is tracked: nothing is ever measured
+// again with strlen(). The message comes out as a list of iovecs, runs of
+// appended text making one part each and bytes added by reference making
+// their own, without being copied. Without a list of parts, the whole
+// message is gathered in the arena.
+//
+// Once something does not fit, the builder fails and appends nothing more,
+// so that a message is only checked once it is complete.
+typedef struct http_builder {
+  char *arena;
+  size_t size;
+  size_t length;       // Bytes of the arena used
+  struct iovec *parts; // Or NULL
+  int part_count;
+  int max_parts;
+  int failed;
+} http_builder;
+
+void http_builder_init(http_builder *builder, char *arena, size_t size,
+                       struct iovec *parts, int max_parts);
+void http_builder_append(http_builder *builder, const char *text,
+                         size_t length);
+void http_builder_text(http_builder *builder, const char *text);
+void http_builder_format(http_builder *builder, const char *format, ...);
+void http_builder_vformat(http_builder *builder, const char *format,
+                          va_list args);
+void http_builder_status(http_builder *builder, int status,
+                         const char *reason);
+void http_builder_header(http_builder *builder, const char *name,
+                         const char *value);
+void http_builder_header_number(http_builder *builder, const char *name,
+                                long long value);
+void http_builder_end(http_builder *builder);
+void http_builder_reference(http_builder *builder, const void *data,
+                            size_t length);
+
+#endif
@@ -0,0 +1,339 @@
+/* mylib/scan.c */
+
+#include "scan.h"
+
+#include <string.h>
+
+// SSE2 is part of x86-64, AVX2 is checked for when the program starts
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__SSE2__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+// Which bytes stop scan_delimiters(), indexed by byte value
+static unsigned char delimiter_class[256];
+
+typedef const char *(*delimiters_fn)(const char *p, const char *end,
+                                     int set);
+typedef const char *(*find_fn)(const char *p, const char *end,
+                               const char *needle, size_t length);
+
+typedef struct scan_backend {
+  const char *name;
+  delimiters_fn delimiters;
+  find_fn find;
+} scan_backend;
+
+static const scan_backend *select_backend(void);
+
+/**
+ * @brief Fill in delimiter_class before the first scan.
+ */
+static void init_delimiter_class(void) {
+  for (int c = 0; c < 256; ++c) {
+    int flags = 0;
+    if (c < 0x20 && c != '\t')
+      flags |= SCAN_CTL;
+    if (c == 0x7f)
+      flags |= SCAN_CTL;
+    delimiter_class[c] = flags;
+  }
+  delimiter_class['\r'] |= SCAN_CR;
+  delimiter_class['\n'] |= SCAN_LF;
+  delimiter_class[' '] |= SCAN_SPACE;
+  delimiter_class[':'] |= SCAN_COLON;
+  delimiter_class['\t'] |= SCAN_TAB;
+}
+
+static const char *delimiters_scalar(const char *p, const char *end,
+                                     int set) {
+  while (p < end && !(delimiter_class[(unsigned char)*p] & set))
+    ++p;
+  return p;
+}
+
+static const char *find_scalar(const char *p, const char *end,
+                               const char *needle, size_t length) {
+  if (length == 0)
+    return p;
+  while ((size_t)(end - p) >= length) {
+    p = memchr(p, needle[0], end - p - length + 1);
+    if (!p)
+      break;
+    if (memcmp(p + 1, needle + 1, length - 1) == 0)
+      return p;
+    ++p;
+  }
+  return end;
+}
+
+#if defined(SCAN_X86)
+// Bit i set if byte i of block is in set. The tests on set do not depend on
+// the data, so they cost next to nothing once the loop is running.
+static inline unsigned delimiter_mask_sse2(__m128i block, int set) {
+  __m128i hit = _mm_setzero_si128();
+  if (set & SCAN_CTL) {
+    // Bytes below 0x20 but tab, and DEL
+    __m128i low =
+        _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(0x1f)), block);
+    low = _mm_andnot_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\t')), low);
+    hit = _mm_or_si128(low, _mm_cmpeq_epi8(block, _mm_set1_epi8(0x7f)));
+  }
+  if (set & SCAN_CR)
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, _mm_set1_epi8('\r')));
+  if (set & SCAN_LF)
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+  if (set & SCAN_SPACE)
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+  if (set & SCAN_COLON)
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, _mm_set1_epi8(':')));
+  if (set & SCAN_TAB)
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(block, _mm_set1_epi8('\t')));
+  return (unsigned)_mm_movemask_epi8(hit);
+}
+
+static const char *delimiters_sse2(const char *p, const char *end, int set) {
+  if (end - p < 16)
+    return delimiters_scalar(p, end, set);
+
+  for (; end - p >= 16; p += 16) {
+    unsigned mask =
+        delimiter_mask_sse2(_mm_loadu_si128((const __m128i *)p), set);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  if (p == end)
+    return end;
+
+  // The last block overlaps bytes already known not to match
+  const char *last = end - 16;
+  unsigned mask =
+      delimiter_mask_sse2(_mm_loadu_si128((const __m128i *)last), set);
+  return mask ? last + __builtin_ctz(mask) : end;
+}
+
+static const char *find_sse2(const char *p, const char *end,
+                             const char *needle, size_t length) {
+  if (length < 2 || (size_t)(end - p) < length + 15)
+    return find_scalar(p, end, needle, length);
+
+  // Compare the first and last bytes of the needle 16 positions at a time
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i last = _mm_set1_epi8(needle[length - 1]);
+  for (; (size_t)(end - p) >= length + 15; p += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + length - 1));
+    unsigned mask = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int i = __builtin_ctz(mask);
+      if (memcmp(p + i + 1, needle + 1, length - 2) == 0)
+        return p + i;
+      mask &= mask - 1;
+    }
+  }
+  return find_scalar(p, end, needle, length);
+}
+
+// Same as delimiter_mask_sse2(), 32 bytes at a time
+__attribute__((target("avx2"))) static inline unsigned
+delimiter_mask_avx2(__m256i block, int set) {
+  __m256i hit = _mm256_setzero_si256();
+  if (set & SCAN_CTL) {
+    __m256i low = _mm256_cmpeq_epi8(
+        _mm256_min_epu8(block, _mm256_set1_epi8(0x1f)), block);
+    low = _mm256_andnot_si256(
+        _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t')), low);
+    hit = _mm256_or_si256(low,
+                          _mm256_cmpeq_epi8(block, _mm256_set1_epi8(0x7f)));
+  }
+  if (set & SCAN_CR)
+    hit = _mm256_or_si256(hit,
+                          _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r')));
+  if (set & SCAN_LF)
+    hit = _mm256_or_si256(hit,
+                          _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+  if (set & SCAN_SPACE)
+    hit = _mm256_or_si256(hit,
+                          _mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')));
+  if (set & SCAN_COLON)
+    hit = _mm256_or_si256(hit,
+                          _mm256_cmpeq_epi8(block, _mm256_set1_epi8(':')));
+  if (set & SCAN_TAB)
+    hit = _mm256_or_si256(hit,
+                          _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t')));
+  return (unsigned)_mm256_movemask_epi8(hit);
+}
+
+__attribute__((target("avx2"))) static const char *
+delimiters_avx2(const char *p, const char *end, int set) {
+  // Most header values fit in 16 bytes
+  if (end - p < 32)
+    return delimiters_sse2(p, end, set);
+
+  unsigned mask =
+      delimiter_mask_sse2(_mm_loadu_si128((const __m128i *)p), set);
+  if (mask)
+    return p + __builtin_ctz(mask);
+
+  for (p += 16; end - p >= 32; p += 32) {
+    mask = delimiter_mask_avx2(_mm256_loadu_si256((const __m256i *)p), set);
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  if (p == end)
+    return end;
+
+  // The last block overlaps bytes already known not to match
+  const char *last = end - 32;
+  mask = delimiter_mask_avx2(_mm256_loadu_si256((const __m256i *)last), set);
+  return mask ? last + __builtin_ctz(mask) : end;
+}
+
+__attribute__((target("avx2"))) static const char *
+find_avx2(const char *p, const char *end, const char *needle, size_t length) {
+  if (length < 2 || (size_t)(end - p) < length + 31)
+    return find_sse2(p, end, needle, length);
+
+  __m256i first = _mm256_set1_epi8(needle[0]);
+  __m256i last = _mm256_set1_epi8(needle[length - 1]);
+  for (; (size_t)(end - p) >= length + 31; p += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + length - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int i = __builtin_ctz(mask);
+      if (memcmp(p + i + 1, needle + 1, length - 2) == 0)
+        return p + i;
+      mask &= mask - 1;
+    }
+  }
+  return find_sse2(p, end, needle, length);
+}
+#endif
+
+// clang-format off
+static const scan_backend backends[] = {
+#if defined(SCAN_X86)
+  {"avx2",   delimiters_avx2,   find_avx2},
+  {"sse2",   delimiters_sse2,   find_sse2},
+#endif
+  {"scalar", delimiters_scalar, find_scalar},
+};
+// clang-format on
+
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+static const char *resolve_delimiters(const char *p, const char *end,
+                                      int set);
+static const char *resolve_find(const char *p, const char *end,
+                                const char *needle, size_t length);
+
+// The backend in use, picked on the first call
+static const scan_backend unresolved = {"unresolved", resolve_delimiters,
+                                        resolve_find};
+static const scan_backend *backend = &unresolved;
+
+static const char *resolve_delimiters(const char *p, const char *end,
+                                      int set) {
+  return select_backend()->delimiters(p, end, set);
+}
+
+static const char *resolve_find(const char *p, const char *end,
+                                const char *needle, size_t length) {
+  return select_backend()->find(p, end, needle, length);
+}
+
+/**
+ * @brief Tell whether the processor runs a backend.
+ */
+static int supported(const scan_backend *candidate) {
+#if defined(SCAN_X86)
+  if (strcmp(candidate->name, "avx2") == 0) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  (void)candidate;
+  return 1;
+}
+
+/**
+ * @brief Pick the widest backend the processor supports.
+ *
+ * Every thread picks the same one, so racing first calls are harmless.
+ *
+ * @return The backend now in use.
+ */
+static const scan_backend *select_backend(void) {
+  init_delimiter_class();
+  for (size_t i = 0; i < BACKEND_COUNT; ++i) {
+    if (supported(&backends[i])) {
+      backend = &backends[i];
+      break;
+    }
+  }
+  return backend;
+}
+
+/**
+ * @brief Find the first delimiter in a range of bytes.
+ *
+ * Runs of ordinary bytes are skipped 32 bytes at a time with AVX2, 16 with
+ * SSE2, or one at a time on other processors.
+ *
+ * @param p The start of the range.
+ * @param end The end of the range.
+ * @param set The SCAN_* flags of the bytes to stop at.
+ * @return The first delimiter, or end if the range has none.
+ */
+const char *scan_delimiters(const char *p, const char *end, int set) {
+  return backend->delimiters(p, end, set);
+}
+
+/**
+ * @brief Find the first occurrence of a byte string in a range of bytes.
+ *
+ * Unlike strstr(), the range is not NUL-terminated, so a search can resume
+ * where the previous one stopped as data arrives.
+ *
+ * @param p The start of the range.
+ * @param end The end of the range.
+ * @param needle The bytes to look for.
+ * @param length The number of bytes in needle.
+ * @return The start of the first occurrence, or end if there is none.
+ */
+const char *scan_find(const char *p, const char *end, const char *needle,
+                      size_t length) {
+  if (end - p < (ptrdiff_t)length)
+    return end;
+  return backend->find(p, end, needle, length);
+}
+
+/**
+ * @brief Name the backend in use: "avx2", "sse2" or "scalar".
+ */
+const char *scan_implementation(void) {
+  if (backend == &unresolved)
+    select_backend();
+  return backend->name;
+}
+
+/**
+ * @brief Force a backend, to test or benchmark it against the others.
+ *
+ * @param name The backend name, as returned by scan_implementation().
+ * @return 1 if the backend is now in use, 0 if it is unknown or the processor
+ * does not support it.
+ */
+int scan_use(const char *name) {
+  init_delimiter_class();
+  for (size_t i = 0; i < BACKEND_COUNT; ++i) {
+    if (strcmp(backends[i].name, name) == 0 && supported(&backends[i])) {
+      backend = &backends[i];
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,22 @@
+/* mylib/scan.h */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// Bytes scan_delimiters() can stop at, combined with |
+#define SCAN_CR 0x01
+#define SCAN_LF 0x02
+#define SCAN_SPACE 0x04
+#define SCAN_COLON 0x08
+#define SCAN_TAB 0x10
+#define SCAN_CTL 0x20 // Control characters other than tab, and DEL
+
+const char *scan_delimiters(const char *p, const char *end, int set);
+const char *scan_find(const char *p, const char *end, const char *needle,
+                      size_t length);
+const char *scan_implementation(void);
+int scan_use(const char *name);
+
+#endif